@@ -0,0 +1,44 @@
+#ifndef _ASID_H
+#define _ASID_H
+
+#include "types.h"
+
+/*
+ * Address Space IDentifier (ASID)
+ * 每個 user address space 拿到一個 ASID，放在 TTBR0_EL1[63:48]，TLB entry 會被 tag 上這個 ASID (nG pages only)
+ * 所以 context switch 時不需要把整個 TLB flush 掉，換回來的 task 也不需要重新 refill TLB
+ *
+ * task->asid 存的是 (generation | ASID)：
+ * ASID 用完時 generation + 1 並 flush 整個 TLB，舊 generation 的 task 下次被 schedule 時重新分配 ASID
+ */
+#define ASID_MAX_BITS           16
+#define TTBR_ASID_SHIFT         48
+#define TCR_AS                  (1UL << 36)     // TCR_EL1.AS : 0 for 8-bit ASID, 1 for 16-bit ASID
+
+/* ASID 0 is reserved for tasks without a user address space (kernel threads, idle task) */
+#define ASID_RESERVED           0
+
+struct task_struct;
+
+/* Detect the ASID size supported by the CPU and enable 16-bit ASIDs if possible */
+void asid_init(void);
+
+/* Make sure the task owns an ASID of the current generation and encode it into cpu_context.phy_addr_pgd */
+void check_and_switch_context(struct task_struct* task);
+
+/* TTBR0_EL1 value of the reserved empty PGD with ASID_RESERVED, for tasks without a user address space */
+unsigned long reserved_ttbr0(void);
+
+/* Release the task's ASID and invalidate every TLB entry tagged with it (task teardown) */
+void asid_free(struct task_struct* task);
+
+/* Get the ASID currently loaded in TTBR0_EL1 */
+unsigned long current_asid(void);
+
+/* Invalidate all TLB entries of the ASID */
+void flush_tlb_asid(unsigned long asid);
+
+/* Invalidate all TLB entries of every ASID */
+void flush_tlb_all(void);
+
+#endif
@@ -39,11 +39,14 @@ void cpio_cat(const void*, const char*);
 /* Execute the user program in initramfs in EL0 */
 void cpio_exec(const void* cpio_file_addr, const char* file_name);
 
-/* Load the user program from initramfs and copy it to the task's user space */
+/* Find a file in the CPIO archive and return the address and size of its data inside the archive (no copy) */
+int cpio_get_backing_pages(const void* cpio_file_addr, const char* file_name, const void** data, unsigned int* size);
+
+/* Load the user program from initramfs and map it to the task's user space */
 unsigned long cpio_load_program(const void* cpio_file_addr, const char* file_name);
 
 /* The API for other modules set the initramfs_address */
-void set_initramfs_address(unsigned int addr);
+void set_initramfs_address(unsigned long addr);
 
 /* The API for other modules get the initramfs_address */
 const void* get_cpio_addr(void);
@@ -0,0 +1,70 @@
+#ifndef _ELF_H
+#define _ELF_H
+
+#include "types.h"
+
+/* e_ident[] */
+#define EI_NIDENT       16
+#define ELFMAG0         0x7F
+#define ELFMAG1         'E'
+#define ELFMAG2         'L'
+#define ELFMAG3         'F'
+#define EI_CLASS        4
+#define ELFCLASS64      2           // 64-bit objects
+#define EI_DATA         5
+#define ELFDATA2LSB     1           // Little-endian
+
+/* e_type, e_machine */
+#define ET_EXEC         2           // Executable file
+#define ET_DYN          3           // Shared object file (PIE)
+#define EM_AARCH64      183
+
+/* p_type, p_flags */
+#define PT_LOAD         1           // Loadable segment
+#define PF_X            (1 << 0)    // Executable
+#define PF_W            (1 << 1)    // Writable
+#define PF_R            (1 << 2)    // Readable
+
+/* ELF64 file header */
+typedef struct {
+    unsigned char  e_ident[EI_NIDENT];
+    unsigned short e_type;
+    unsigned short e_machine;
+    unsigned int   e_version;
+    unsigned long  e_entry;         // Virtual address of the entry point
+    unsigned long  e_phoff;         // Program header table file offset
+    unsigned long  e_shoff;
+    unsigned int   e_flags;
+    unsigned short e_ehsize;
+    unsigned short e_phentsize;     // Size of one program header
+    unsigned short e_phnum;         // Number of program headers
+    unsigned short e_shentsize;
+    unsigned short e_shnum;
+    unsigned short e_shstrndx;
+} Elf64_Ehdr;
+
+/* ELF64 program header */
+typedef struct {
+    unsigned int   p_type;
+    unsigned int   p_flags;
+    unsigned long  p_offset;        // Segment file offset
+    unsigned long  p_vaddr;         // Segment virtual address
+    unsigned long  p_paddr;
+    unsigned long  p_filesz;        // Segment size in file
+    unsigned long  p_memsz;         // Segment size in memory (p_memsz - p_filesz bytes of BSS)
+    unsigned long  p_align;
+} Elf64_Phdr;
+
+/* Check if the image is an ELF64 AArch64 executable */
+int elf_check(const void* image, unsigned long size);
+
+struct task_struct;
+
+/**
+ * Map all PT_LOAD segments of the ELF image into the task's page table, each one in a VMA with its own protection
+ * Page 0 is never mapped, so a NULL dereference faults
+ * Returns 0 on success and stores the entry point and the end of the highest segment, -1 on failure
+ */
+int elf_load(struct task_struct* task, const void* image, unsigned long size, unsigned long* entry, unsigned long* image_end);
+
+#endif
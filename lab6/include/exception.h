@@ -6,6 +6,18 @@
 #define CORE0_IRQ_SRC        0xFFFF000040000060 // Core 0 interrupt source, use the upper address space
 #define TRAP_FRAME_SIZE      272            // Size of trap frame
 
+/* ESR_EL1 decoding */
+#define ESR_ELx_EC_SHIFT     26             // Exception Class, bits [31:26]
+#define ESR_ELx_EC_MASK      0x3F
+#define ESR_ELx_EC_SVC64     0x15           // SVC instruction execution in AArch64 state
+#define ESR_ELx_EC_IABT_LOW  0x20           // Instruction Abort from a lower Exception level
+#define ESR_ELx_EC_DABT_LOW  0x24           // Data Abort from a lower Exception level
+#define ESR_ELx_EC_DABT_CUR  0x25           // Data Abort taken without a change in Exception level (kernel access)
+#define ESR_ELx_WNR          (1 << 6)       // Data abort caused by a write
+#define ESR_ELx_FSC_TYPE     0x3C           // Fault status code without the level bits [1:0]
+#define ESR_ELx_FSC_FAULT    0x04           // Translation fault
+#define ESR_ELx_FSC_PERM     0x0C           // Permission fault
+
 #ifndef __ASSEMBLER__
 
 // Trap frame
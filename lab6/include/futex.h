@@ -0,0 +1,24 @@
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+/* futex() operations */
+#define FUTEX_WAIT          0   // Sleep if *uaddr == val
+#define FUTEX_WAKE          1   // Wake up at most val tasks waiting on uaddr
+
+#define FUTEX_HASH_BITS     6
+#define FUTEX_HASH_SIZE     (1 << FUTEX_HASH_BITS)
+
+/*
+ * Fast userspace mutex
+ * User space takes and releases an uncontended lock with LDAXR/STXR only, the kernel is entered to sleep or wake up
+ * waiters when the lock is contended. Waiters are keyed by the physical address of the futex word, so the same word
+ * mapped by several tasks (shared memory) is the same futex, and hashed into FUTEX_HASH_SIZE wait queues.
+ */
+
+/* Initialize the futex hash table */
+void futex_init(void);
+
+/* Return 0 on success (WAIT : woken up, WAKE : number of tasks woken up), -1 on error or if *uaddr != val for FUTEX_WAIT */
+int do_futex(unsigned long uaddr, int op, int val);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _KSTACK_H
+#define _KSTACK_H
+
+#include "mmu.h"
+
+/*
+ *********** Kernel stacks mapped in the kernel virtual address space ***********
+ * Each kernel stack owns a slot of KSTACK_SLOT_SIZE bytes in the vmap area (PGD[1] of the kernel page table),
+ * the stack is mapped page by page at the top of its slot and the rest of the slot is left unmapped,
+ * so running off the bottom of a stack hits a guard page instead of silently corrupting the next allocation
+ *
+ *   slot base                                        slot base + KSTACK_SLOT_SIZE
+ *   |  guard (unmapped, >= KSTACK_GUARD_SIZE)  |  stack (mapped, size bytes)  |
+ *                                              ^ kernel_stack                 ^ initial sp
+ */
+#define KSTACK_VMAP_START       (KERNEL_VA_BASE + (1UL << 39))     // 0xFFFF008000000000, PGD index 1
+#define KSTACK_SLOT_SIZE        0x10000                            // 64KB of VA per stack
+#define KSTACK_NR_SLOTS         512
+#define KSTACK_GUARD_SIZE       4096                               // At least one unmapped page below every stack
+#define KSTACK_MAX_SIZE         (KSTACK_SLOT_SIZE - KSTACK_GUARD_SIZE)
+
+/* Default kernel stack size, can be overridden with -DKSTACK_SIZE=... */
+#ifndef KSTACK_SIZE
+#define KSTACK_SIZE             (4 * 4096)
+#endif
+
+/* Unused stack words hold this pattern, the lowest overwritten word gives the high watermark */
+#define KSTACK_POISON           0x57ac57ac57ac57acUL
+
+/* Stack used to report a kernel stack overflow, the overflowed stack can't be used anymore */
+#define KSTACK_OVERFLOW_STACK_SIZE  4096
+
+/* Offset of cpu_context.kstack_guard in task_struct, used by the EL1 exception vector */
+#define TASK_KSTACK_GUARD       (16 * 7)
+
+#ifndef __ASSEMBLER__
+
+struct task_struct;
+
+/* Map a kernel stack of size bytes (rounded up to pages) for the task, return 0 on success, -1 on failure */
+int kstack_alloc(struct task_struct* task, unsigned long size);
+
+/* Unmap the task's kernel stack, free its pages and record its watermark */
+void kstack_free(struct task_struct* task);
+
+/* Bytes of the task's kernel stack that have been used at least once */
+unsigned long kstack_usage(struct task_struct* task);
+
+/* Print the watermark of every task and the highest watermark seen so far */
+void kstack_report(void);
+
+/* Report a kernel stack overflow detected by the EL1 exception vector and stop */
+struct trap_frame;
+void handle_kernel_stack_overflow(unsigned long far, struct trap_frame* tf);
+
+/* Top of the task's kernel stack (initial sp) */
+#define kstack_top(task)        ((unsigned long)(task)->kernel_stack + (task)->kstack_size)
+
+#endif
+
+#endif
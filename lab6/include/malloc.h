@@ -27,6 +27,7 @@ typedef struct page_t{
     struct list_head list; // will be linked in the buddy system's free list 
     unsigned int flag;  
     int order;
+    int refcount;   // Number of users of an allocated page frame (e.g. page tables mapping a shared memory page), set to 1 by the allocator
 }page_t;
 
 /* Holds the free pages of a certain order */
@@ -52,6 +53,18 @@ void* buddy_alloc_pages(buddy_system_t* buddy, unsigned int order);
 /* Free the allocated pages */
 void buddy_free_pages(buddy_system_t* buddy, void* addr);
 
+/* Turn an allocated 2^order block into 2^order order-0 allocations that can be freed one by one */
+void buddy_split_allocation(buddy_system_t* buddy, void* addr);
+
+/* Take one more reference on an allocated page frame of the kernel buddy system */
+void page_get(void* addr);
+
+/* Drop a reference on an allocated page frame, it is freed when the last reference goes away */
+void page_put(void* addr);
+
+/* Get the reference count of an allocated page frame, 0 if the address is not an allocated page */
+int page_count(void* addr);
+
 
 /* --- Dynamic Allocator Data Structures and API --- */
 typedef struct chunk_t {
@@ -0,0 +1,87 @@
+#ifndef _MMAP_H
+#define _MMAP_H
+
+#include "types.h"
+#include "list.h"
+#include "malloc.h"
+
+/* Memory protection of a region (prot argument of mmap / mprotect) */
+#define PROT_NONE       0x0     // Pages may not be accessed
+#define PROT_READ       0x1     // Pages may be read
+#define PROT_WRITE      0x2     // Pages may be written
+#define PROT_EXEC       0x4     // Pages may be executed
+
+/* Flags of mmap */
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10    // Place the mapping at exactly addr, replacing existing mappings
+#define MAP_ANONYMOUS   0x20    // Zero-filled memory, not backed by a file
+#define MAP_GROWSDOWN   0x0100  // Stack region, extended downwards by a page fault just below vm_start
+#define MAP_POPULATE    0x8000  // Fault in all pages at mmap time instead of on demand
+#define MAP_SHM         0x40000000  // Kernel internal : region attached by shmat(), backed by reference counted pages
+
+#define MAP_FAILED      ((unsigned long)-1)
+
+/* User address space used by mmap */
+#define MMAP_BASE       0x0000100000000000  // Default start of the search when mmap gets no address hint
+#define USER_VA_LIMIT   0x0001000000000000  // 48-bit user address space
+
+/* A grow-down stack never gets closer than this to the VMA below it */
+#define STACK_GUARD_GAP (256 * PAGE_SIZE)
+
+#define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+/* Virtual memory area: a contiguous range of the user address space with the same protection and backing */
+struct vm_area_struct {
+    unsigned long vm_start;         // First address of the region
+    unsigned long vm_end;           // First address after the region
+    unsigned long vm_prot;          // PROT_*
+    unsigned long vm_flags;         // MAP_*
+    const void* vm_file;            // Kernel address of the backing file data (initramfs), NULL for anonymous memory
+    unsigned long vm_file_size;     // Size of the backing file
+    unsigned long vm_pgoff;         // Offset in the file of vm_start
+    struct list_head list;          // Linked in task->mmap, sorted by vm_start
+};
+
+struct task_struct;
+
+/* Find the VMA containing addr, NULL if addr is not mapped */
+struct vm_area_struct* find_vma(struct task_struct* task, unsigned long addr);
+
+/**
+ * Find the VMA containing addr for a page fault
+ * If addr is just below a MAP_GROWSDOWN VMA, the VMA is extended down to addr first
+ * Returns NULL if addr is not mapped and no stack can grow to it
+ */
+struct vm_area_struct* find_extend_vma(struct task_struct* task, unsigned long addr);
+
+/* Add a VMA [start, end) to the task, the range must not overlap any existing VMA */
+struct vm_area_struct* vma_insert(struct task_struct* task, unsigned long start, unsigned long end, unsigned long prot,
+                                  unsigned long flags, const void* file, unsigned long file_size, unsigned long pgoff);
+
+/* Create a mapping, return its start address or MAP_FAILED */
+unsigned long do_mmap(struct task_struct* task, unsigned long addr, unsigned long len, unsigned long prot,
+                      unsigned long flags, const void* file, unsigned long file_size, unsigned long offset);
+
+/* Remove the mappings in [addr, addr + len), return 0 on success, -1 on failure */
+int do_munmap(struct task_struct* task, unsigned long addr, unsigned long len);
+
+/* Change the protection of [addr, addr + len), return 0 on success, -1 on failure */
+int do_mprotect(struct task_struct* task, unsigned long addr, unsigned long len, unsigned long prot);
+
+/* Resolve a translation fault at va inside vma (demand-zero or file-backed page), return 0 on success */
+int handle_mm_fault(struct task_struct* task, struct vm_area_struct* vma, unsigned long va);
+
+/* Check if the access described by ESR_EL1 is allowed by the VMA's protection */
+int vma_access_ok(struct vm_area_struct* vma, unsigned long esr);
+
+/* Duplicate the VMA list and the user pages of src into dst (used by fork) */
+int dup_mmap(struct task_struct* dst, struct task_struct* src);
+
+/* Unmap every VMA of the task and free the VMA list (used by exec and task teardown) */
+void exit_mmap(struct task_struct* task);
+
+/* Translate PROT_* to page descriptor attributes */
+unsigned long vma_prot_to_attr(unsigned long prot);
+
+#endif
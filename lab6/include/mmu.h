@@ -71,10 +71,26 @@
 #define PD_VALID                         0b1
 #define PD_TABLE                         0b11
 #define PD_BLOCK                         0b01
+#define PD_TYPE_MASK                     0b11
+#define PD_IS_BLOCK(desc)               (((desc) & PD_TYPE_MASK) == PD_BLOCK)  // Block descriptor (only valid at PUD / PMD level)
 #define PD_ACCESS                       (1 << 10)
 #define PD_USER                         (1 << 6)   // 0 for only kernel access, 1 for user/kernel access.
+#define PD_NG                           (1 << 11)  // not Global, the TLB entry is tagged with the current ASID
 #define PD_READONLY                     (1 << 7)   // 0 for read-write, 1 for read-only (Note that If you set Bits[7:6] to 0b01, which means the user can read/write the region, then the kernel is automatically not executable in that region no matter what the value of Bits[53] is.)
 
+#define PD_PXN                          (1UL << 53)  // Privileged execute-never, EL1 can't execute the page
+#define PD_UXN                          (1UL << 54)  // Unprivileged execute-never, EL0 can't execute the page
+
+/*
+ * Bits[58:55] are ignored by the MMU and reserved for software use
+ * PD_SW_COW : the page is mapped read-only only because it is shared, copy it on the first write
+ * PD_SW_SHARED : the page frame is not owned by this page table (e.g. it lives in the initramfs), never free it
+ * PD_SW_REFCNT : the page frame is shared by several page tables (shared memory), drop a reference with page_put() instead of freeing it
+ */
+#define PD_SW_COW                       (1UL << 55)
+#define PD_SW_SHARED                    (1UL << 56)
+#define PD_SW_REFCNT                    (1UL << 57)
+
 // Page Table Entry Attribute for kernel space 
 #define BOOT_PGD_ATTR                   PD_TABLE
 // #define BOOT_PUD_ATTR                   (PD_ACCESS | (MAIR_IDX_DEVICE_nGnRnE << 2) | PD_BLOCK) // this is block descriptor, for two level translation
@@ -82,8 +98,14 @@
 #define BOOT_PMD_ATTR_RAM              (PD_ACCESS | (MAIR_IDX_NORMAL_NOCACHE << 2) | PD_BLOCK) // this is block descriptor, for 0x00000000 ~ 0x3F000000 set to normal non-cache memory
 #define BOOT_PMD_ATTR_PERIPHERAL       (PD_ACCESS | (MAIR_IDX_DEVICE_nGnRnE << 2) | PD_BLOCK) // this is block descriptor, for 0x3F000000 ~ 0x40000000 and 0x40000000 ~ 0x7FFFFFFFFF set to device nGnRnE memory 
 
+// Page Table Entry Attribute for 4KB kernel pages mapped after boot (e.g. vmap kernel stacks), global and never executable
+#define KERNEL_PTE_ATTR                (PD_ACCESS | (MAIR_IDX_NORMAL_NOCACHE << 2) | PD_PXN | PD_UXN | PD_TABLE)
+
 // Page Table Entry Attribute for user spce
 #define USER_TABLE_ATTR                 PD_TABLE
-#define USER_PTE_ATTR                  (PD_ACCESS | PD_USER | (MAIR_IDX_NORMAL_NOCACHE << 2) | PD_TABLE)
+#define USER_PTE_ATTR                  (PD_ACCESS | PD_USER | PD_NG | (MAIR_IDX_NORMAL_NOCACHE << 2) | PD_TABLE)
+#define USER_PTE_ATTR_COW              (USER_PTE_ATTR | PD_READONLY | PD_SW_COW | PD_SW_SHARED)   // Read-only page shared from the initramfs, copied on write
+#define USER_PTE_ATTR_SHARED           (USER_PTE_ATTR | PD_SW_SHARED)                             // Page that must not be freed or copied (e.g. peripherals)
+#define USER_PTE_ATTR_SHM              (USER_PTE_ATTR | PD_SW_REFCNT)                             // Shared memory page, reference counted in page_t
 
 #endif
\ No newline at end of file
@@ -5,12 +5,13 @@
 #include "list.h"
 #include "pid.h"
 
-#define THREAD_STACK_SIZE 4096
+#define THREAD_STACK_SIZE 4096    // User stack of the idle task, kernel stacks are sized by kstack_alloc()
 
 /* Task states */
 #define TASK_RUNNING    0
 #define TASK_ZOMBIE     1
 #define TASK_DEAD       2
+#define TASK_WAITING    3   // Sleeping on a wait queue, not in the run queue
 
 /* Functions that thread needs to do */
 typedef void (*thread_func_t)(void *);
@@ -30,7 +31,8 @@ struct cpu_context {
     unsigned long fp;      // x29
     unsigned long lr;      // x30
     unsigned long sp;
-    unsigned long phy_addr_pgd; // Physical address of the PGD page table
+    unsigned long phy_addr_pgd; // Physical address of the PGD page table, with the task's ASID in bits [63:48] (loaded into TTBR0_EL1)
+    unsigned long kstack_guard; // Lowest address of the guard page below the kernel stack (TASK_KSTACK_GUARD, checked by el1_sync)
 };
 
 /* Task structure */
@@ -39,14 +41,26 @@ struct task_struct {
     pid_t pid;
     int state;
     struct task_struct* parent;
-    void* kernel_stack;
+    void* kernel_stack;           // Lowest address of the kernel stack, mapped in the vmap area by kstack_alloc()
+    unsigned long kstack_size;    // Size of the kernel stack in bytes
     void* user_stack;
     void* user_program;           // Pointer to allocated user program memory
-    size_t user_program_size;     // Size of user program for cleanup
-    struct list_head list;    // For run queue
+    size_t user_program_size;     // Size of user program image from USER_CODE_BASE (duplicated by fork)
+    struct list_head list;    // For run queue (or the wait queue while TASK_WAITING)
     struct list_head task;    // For task list
 
     unsigned long* pgd; // Pointer to the PGD page table
+    unsigned long asid; // ASID generation | ASID of the user address space, 0 if never assigned
+    struct list_head mmap;  // VMAs of the user address space, sorted by address
+    unsigned long futex_key; // Physical address of the futex word the task is waiting on
+};
+
+/* 
+ * Wait queue : tasks blocked until some condition becomes true
+ * A waiting task is not in the run queue, so its `list` node links it into the wait queue instead
+ */
+struct wait_queue_head {
+    struct list_head task_list;
 };
 
 /* Pass initramfs address through task structure */
@@ -70,6 +84,9 @@ void sched_init(void);
  */
 pid_t kernel_thread(void (*fn)(void*), void* arg);
 
+/* Same as kernel_thread(), with a kernel stack of stack_size bytes (0 for the default KSTACK_SIZE) */
+pid_t kernel_thread_stack(void (*fn)(void*), void* arg, unsigned long stack_size);
+
 /* 
  * Choose a thread to run 
  * 目前 schedule() 只會在以下幾種情況被呼叫
@@ -81,6 +98,22 @@ void schedule(void);
 /* When a thread exit, set the state to ZOMBIE and remove it from the run queue */
 void thread_exit(void);
 
+/* Initialize an empty wait queue */
+void init_waitqueue_head(struct wait_queue_head* wq);
+
+/* 
+ * Put the current task to sleep on the wait queue and run another task
+ * Must be called with interrupt disabled, returns with interrupt still disabled after being woken up,
+ * so the caller can re-check its condition without racing with the waker
+ */
+void sleep_on(struct wait_queue_head* wq);
+
+/* Move a task sleeping on a wait queue back to the run queue */
+void wake_up_process(struct task_struct* task);
+
+/* Move every task sleeping on the wait queue back to the run queue */
+void wake_up(struct wait_queue_head* wq);
+
 
 /* --- Function defined in sched.S --- */
 /* Jump to the address in x19, with the argument in x20 */
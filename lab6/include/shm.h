@@ -0,0 +1,37 @@
+#ifndef _SHM_H
+#define _SHM_H
+
+#include "types.h"
+
+#define SHM_MAX_SEGMENTS    16
+#define SHM_MAX_SIZE        (1024 * 1024)   // 1MB per segment
+
+#define IPC_PRIVATE         0       // shmget() key : always create a new segment
+#define IPC_RMID            0       // shmctl() command : remove the segment
+
+/*
+ * Shared memory segment
+ * The segment holds one reference on each of its pages, every task that attaches it maps the same page frames
+ * (with PD_SW_REFCNT) and holds one more, so a page is freed only after the segment is removed and the last task detaches it
+ */
+struct shm_segment {
+    int used;
+    int key;
+    unsigned long size;         // Size in bytes, rounded up to pages
+    unsigned long nr_pages;
+    void** pages;               // Kernel virtual address of each page frame
+};
+
+/* Get the segment of key, create it (zero-filled) if it doesn't exist, return the segment id or -1 */
+int shm_get(int key, unsigned long size);
+
+/* Map the segment into the current task at addr (0 to let the kernel choose), return the address or MAP_FAILED */
+unsigned long shm_attach(int shmid, unsigned long addr);
+
+/* Unmap the segment attached at addr from the current task, return 0 on success, -1 on failure */
+int shm_detach(unsigned long addr);
+
+/* Remove the segment, its pages are freed once no task maps them any more, return 0 on success, -1 on failure */
+int shm_remove(int shmid);
+
+#endif
@@ -4,7 +4,7 @@
 #include "types.h"
 #include "exception.h"
 
-#define NR_SYS_CALLS 8
+#define NR_SYS_CALLS 18
 
 /* System call numbers */
 #define SYS_GETPID      0
@@ -15,6 +15,16 @@
 #define SYS_EXIT        5
 #define SYS_MBOX_CALL   6
 #define SYS_KILL        7
+#define SYS_MMAP        10
+#define SYS_MUNMAP      11
+#define SYS_MPROTECT    12
+#define SYS_SHMGET      13
+#define SYS_SHMAT       14
+#define SYS_SHMDT       15
+#define SYS_SHMCTL      16
+#define SYS_FUTEX       17
+
+#define EXEC_NAME_MAX   256     // Maximum length of the program name passed to exec
 
 #ifndef __ASSEMBLER__
 /* System call function declarations */
@@ -26,6 +36,14 @@ int sys_fork(void);
 void sys_exit(void);
 int sys_mbox_call(unsigned int ch, unsigned int *mbox);
 void sys_kill(int pid);
+unsigned long sys_mmap(unsigned long addr, size_t len, int prot, int flags, int fd, unsigned long file_offset);
+int sys_munmap(unsigned long addr, size_t len);
+int sys_mprotect(unsigned long addr, size_t len, int prot);
+int sys_shmget(int key, size_t size);
+unsigned long sys_shmat(int shmid, unsigned long addr);
+int sys_shmdt(unsigned long addr);
+int sys_shmctl(int shmid, int cmd);
+int sys_futex(unsigned long uaddr, int op, int val);
 
 /* System call handler */
 // void syscall_handler(void);
@@ -40,6 +58,14 @@ int call_sys_fork(void);
 void call_sys_exit(void);
 int call_sys_mbox_call(unsigned char ch, unsigned int *mbox);
 void call_sys_kill(int pid);
+void* call_sys_mmap(void* addr, size_t len, int prot, int flags, int fd, unsigned long file_offset);
+int call_sys_munmap(void* addr, size_t len);
+int call_sys_mprotect(void* addr, size_t len, int prot);
+int call_sys_shmget(int key, size_t size);
+void* call_sys_shmat(int shmid, void* addr);
+int call_sys_shmdt(void* addr);
+int call_sys_shmctl(int shmid, int cmd);
+int call_sys_futex(int* uaddr, int op, int val);
 #endif
 
 #endif
\ No newline at end of file
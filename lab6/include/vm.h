@@ -17,12 +17,36 @@
 
 // User space memory layout
 #define USER_CODE_BASE    0x0000000000000000    // User code starts at VA 0x0
-#define USER_STACK_BASE   0x0000ffffffffb000    // User stack starts at VA 0x0000ffffffffb000
 #define USER_STACK_TOP    0x0000fffffffff000    // User Stack top is at VA 0x0000fffffffff000
-#define USER_STACK_SIZE   (4 * PAGE_SIZE)       // 4 pages (16KB) for stack
+#define USER_STACK_SIZE   (4 * PAGE_SIZE)       // Initial size of the stack VMA (16KB), pages are only backed when touched
+#define USER_STACK_BASE   (USER_STACK_TOP - USER_STACK_SIZE)   // User stack VMA starts at VA 0x0000ffffffffb000
+#define USER_STACK_MAX    (8 * 1024 * 1024)     // The stack VMA grows down on page faults, up to 8MB
+#define USER_STACK_LIMIT  (USER_STACK_TOP - USER_STACK_MAX)    // Lowest address the stack may reach, mmap() keeps away from it
 
-int mappages(unsigned long* pagetable, unsigned long va, unsigned long size, unsigned long pa);
+// Huge page : one PMD block entry maps 2MB, backed by an order-9 buddy allocation
+#define HUGE_PAGE_ORDER   9
+
+int mappages(unsigned long* pagetable, unsigned long va, unsigned long size, unsigned long pa, unsigned long attr);
 unsigned long *walk(unsigned long* pagetable, unsigned long va);
+unsigned long *walk_pmd(unsigned long* pagetable, unsigned long va);
+unsigned long *lookup_pte(unsigned long* pagetable, unsigned long va);
+unsigned long *lookup_pmd(unsigned long* pagetable, unsigned long va);
+
+/* Split a 2MB block mapping into 512 4KB pages */
+int split_huge_pmd(unsigned long* pmd, unsigned long va);
 int clear_pagetable(unsigned long* pagetable);
 
+/* Invalidate the TLB entry of a single user virtual address */
+void flush_tlb_page(unsigned long va);
+
+/* Remove the mappings of [va, va + size) and free the page frames owned by the page table */
+void unmap_pages(unsigned long* pagetable, unsigned long va, unsigned long size);
+
+/* Duplicate the user mappings of [va, va + size) from src to dst, shared pages are not copied */
+int copy_user_pages(unsigned long* dst, unsigned long* src, unsigned long va, unsigned long size);
+
+/* Handle an instruction / data abort taken from EL0, or a kernel data abort on a user address */
+struct trap_frame;
+void do_page_fault(unsigned long far, unsigned long esr, struct trap_frame* tf);
+
 #endif
@@ -0,0 +1,164 @@
+#include "asid.h"
+#include "sched.h"
+#include "bitmap.h"
+#include "pid.h"
+#include "mmu.h"
+#include "malloc.h"
+#include "muart.h"
+
+#define LOG_ASID 0
+
+static unsigned int asid_bits;                      // 8 or 16, read from ID_AA64MMFR0_EL1
+static unsigned long asid_generation;               // Current generation, stored above the ASID bits
+static DECLARE_BITMAP(asid_map, 1 << ASID_MAX_BITS);   // ASIDs used in the current generation
+static unsigned long last_asid;                     // Start of the next search in asid_map
+
+/*
+ * Empty PGD loaded into TTBR0 by tasks without a user address space (idle task)
+ * The boot tables at PA 0 map 0-2GB with global blocks, their TLB entries would match every ASID
+ */
+static unsigned long reserved_pgd[PAGE_SIZE / sizeof(unsigned long)] __attribute__((aligned(PAGE_SIZE)));
+
+#define NUM_ASIDS           (1UL << asid_bits)
+#define ASID_MASK           (NUM_ASIDS - 1)
+#define ASID_FIRST_VERSION  (1UL << ASID_MAX_BITS)  // Generation counts in units above the largest ASID
+#define asid_stale(asid)    (((asid) & ~(ASID_FIRST_VERSION - 1)) != asid_generation)
+
+void flush_tlb_all(void) {
+    __asm__ volatile(
+        "dsb ishst\n\t"
+        "tlbi vmalle1is\n\t"    // invalidate all EL1&0 entries of every ASID
+        "dsb ish\n\t"
+        "isb\n\t"
+    );
+}
+
+void flush_tlb_asid(unsigned long asid) {
+    __asm__ volatile(
+        "dsb ishst\n\t"
+        "tlbi aside1is, %0\n\t" // invalidate the non-global entries tagged with this ASID
+        "dsb ish\n\t"
+        "isb\n\t"
+        :: "r"(asid << TTBR_ASID_SHIFT)
+    );
+}
+
+unsigned long current_asid(void) {
+    unsigned long ttbr0;
+    __asm__ volatile("mrs %0, ttbr0_el1" : "=r"(ttbr0));
+    return ttbr0 >> TTBR_ASID_SHIFT;
+}
+
+/*
+ * All ASIDs of this generation are in use, start a new generation
+ * The running task keeps its ASID (its TTBR0_EL1 is still live), every other task gets a new one the next time it is scheduled
+ */
+static void new_generation(struct task_struct* current) {
+    asid_generation += ASID_FIRST_VERSION;
+
+    for (int i = 0; i < BITS_TO_LONGS(1 << ASID_MAX_BITS); i++) {
+        asid_map[i] = 0;
+    }
+    set_bit(ASID_RESERVED, asid_map);
+
+    if (current && current->asid) {
+        unsigned long asid = current->asid & ASID_MASK;
+        set_bit(asid, asid_map);
+        current->asid = asid_generation | asid;
+    }
+
+    // Entries of the old generation may alias the ASIDs handed out from now on
+    flush_tlb_all();
+
+    #if LOG_ASID
+    muart_puts("[ASID] rollover, new generation ");
+    muart_send_hex(asid_generation >> ASID_MAX_BITS);
+    muart_puts("\r\n");
+    #endif
+}
+
+static unsigned long new_context(void) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    unsigned long asid = find_next_zero_bit(asid_map, NUM_ASIDS, last_asid);
+
+    if (asid == NUM_ASIDS) {
+        new_generation(current);
+        asid = find_next_zero_bit(asid_map, NUM_ASIDS, 1);
+    }
+
+    set_bit(asid, asid_map);
+    last_asid = asid + 1;
+    return asid_generation | asid;
+}
+
+void check_and_switch_context(struct task_struct* task) {
+    // Tasks without a user address space share the reserved ASID, their PGD has no valid entry to cache
+    if (!task->pgd) {
+        return;
+    }
+
+    if (asid_stale(task->asid)) {
+        task->asid = new_context();
+
+        #if LOG_ASID
+        muart_puts("[ASID] pid ");
+        muart_send_dec(task->pid);
+        muart_puts(" -> ASID ");
+        muart_send_dec(task->asid & ASID_MASK);
+        muart_puts("\r\n");
+        #endif
+    }
+
+    task->cpu_context.phy_addr_pgd = VIRT_TO_PHYS(task->pgd) | ((task->asid & ASID_MASK) << TTBR_ASID_SHIFT);
+}
+
+void asid_free(struct task_struct* task) {
+    if (!task->asid || asid_stale(task->asid)) {
+        // Never got an ASID in this generation, the rollover already flushed its entries
+        task->asid = 0;
+        return;
+    }
+
+    unsigned long asid = task->asid & ASID_MASK;
+    flush_tlb_asid(asid);
+    clear_bit(asid, asid_map);
+    task->asid = 0;
+}
+
+unsigned long reserved_ttbr0(void) {
+    return VIRT_TO_PHYS(reserved_pgd) | ((unsigned long)ASID_RESERVED << TTBR_ASID_SHIFT);
+}
+
+void asid_init(void) {
+    unsigned long mmfr0;
+    unsigned long tcr;
+
+    // ID_AA64MMFR0_EL1.ASIDBits[7:4] : 0b0000 8 bits, 0b0010 16 bits
+    __asm__ volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    if (((mmfr0 >> 4) & 0xF) == 0b0010) {
+        asid_bits = 16;
+        __asm__ volatile("mrs %0, tcr_el1" : "=r"(tcr));
+        tcr |= TCR_AS;
+        __asm__ volatile("msr tcr_el1, %0\n\tisb" :: "r"(tcr));
+    }
+    else {
+        asid_bits = 8;
+    }
+
+    for (int i = 0; i < BITS_TO_LONGS(1 << ASID_MAX_BITS); i++) {
+        asid_map[i] = 0;
+    }
+    set_bit(ASID_RESERVED, asid_map);
+    asid_generation = ASID_FIRST_VERSION;
+    last_asid = 1;
+
+    // Stop using the boot identity map as the user half, then drop its global TLB entries
+    __asm__ volatile("msr ttbr0_el1, %0\n\tisb" :: "r"(reserved_ttbr0()));
+
+    // TLB entries created before ASIDs were enabled are tagged with ASID 0
+    flush_tlb_all();
+
+    muart_puts("ASID initialized, ");
+    muart_send_dec(asid_bits);
+    muart_puts("-bit ASIDs\r\n");
+}
@@ -7,13 +7,15 @@
 #include "mm.h"
 #include "vm.h"
 #include "mmu.h"
+#include "elf.h"
+#include "mmap.h"
 
 // static unsigned long initramfs_address = 0x20000000;
 static unsigned long initramfs_address = 0xFFFF000020000000;
 
 
 /* The API for other modules set the initramfs_address */
-void set_initramfs_address(unsigned int addr) {
+void set_initramfs_address(unsigned long addr) {
     initramfs_address = addr;
 }
 
@@ -210,15 +212,13 @@ void cpio_exec(const void* cpio_file_addr, const char* file_name){
 }
 
 /**
- * 從 cpio archive 中找到對應的 user program
-  1.  allocate 一塊 physical memory space 放 user program 的 data，然後將這塊 physical memory space mapping 到 `USER_CODE_BASE 0x0`
-  2.  allocate 一塊 physical memory space 放 user mode 的 stack， 然後將這塊 physical memory space mapping 到 `USER_STACK_BASE 0x0000ffffffffb000`
+ * Find the file in the cpio archive and return where its data lives, no data is copied
+ * The returned address points into the archive itself, so the pages can be mapped directly
+ * @return: 0 on success, -1 if the file is not found
  */
-unsigned long cpio_load_program(const void* cpio_file_addr, const char* file_name) {
+int cpio_get_backing_pages(const void* cpio_file_addr, const char* file_name, const void** data, unsigned int* size) {
     const char* current_addr = (const char*)cpio_file_addr;
     cpio_newc_header* header;
-    void* program_start_addr = NULL;
-    unsigned int program_size = 0;
 
     while(1){
         header = (cpio_newc_header*)current_addr; 
@@ -234,33 +234,41 @@ unsigned long cpio_load_program(const void* cpio_file_addr, const char* file_nam
 
         // Check if reached the trailer
         if( strcmp(pathname, CPIO_TRAILER) == 0 ){
-            break;
-        }
-        
-        // Store the file information
-        if( strcmp(file_name, pathname) == 0 ){
-            // Calculate the start address where file data starts
-            unsigned long data_start = (unsigned long)current_addr + sizeof(cpio_newc_header) + pathname_size;
-            data_start = cpio_padded_size(data_start);  // 4-byte align
-            program_start_addr = (void*)data_start;
-            program_size = filedata_size;
-            break;
+            return -1;
         }
 
-        // Move to the next entry
         // Calculate data start position (aligned relative to header start position)
         unsigned long data_start = (unsigned long)current_addr + sizeof(cpio_newc_header) + pathname_size;
         data_start = cpio_padded_size(data_start);  // 4-byte align
         
+        if( strcmp(file_name, pathname) == 0 ){
+            *data = (const void*)data_start;
+            *size = filedata_size;
+            return 0;
+        }
+
         // Calculate next header position (aligned relative to data start position)
         unsigned long next_header = data_start + filedata_size;
         next_header = cpio_padded_size(next_header); // 4-byte align
 
         current_addr = (const char*)next_header;
     }
+}
+
+/**
+ * 從 cpio archive 中找到對應的 user program
+  0.  如果是 ELF executable，依照 program header 把每個 PT_LOAD segment mapping 到它的 p_vaddr (BSS 補 0)，回傳 e_entry
+  1.  如果 program 在 archive 中是 page-aligned，直接把 archive 的 page 以 read-only (copy-on-write) mapping 到 `USER_CODE_BASE 0x0`，不需要 memcpy 也不需要額外的 memory
+      否則 allocate 一塊 physical memory space 放 user program 的 data，然後將這塊 physical memory space mapping 到 `USER_CODE_BASE 0x0`
+  2.  user mode 的 stack 只建立一個 grow-down VMA `[USER_STACK_BASE 0x0000ffffffffb000, USER_STACK_TOP)`，不先 allocate physical memory，
+      第一次碰到的 page 才由 page fault 補上，sp 超過 VMA 底部時 VMA 會往下長 (最多 USER_STACK_MAX)
+ */
+unsigned long cpio_load_program(const void* cpio_file_addr, const char* file_name) {
+    const void* program_start_addr = NULL;
+    unsigned int program_size = 0;
 
     // Check if found the file
-    if(program_start_addr == NULL){
+    if(cpio_get_backing_pages(cpio_file_addr, file_name, &program_start_addr, &program_size) != 0){
         muart_puts("Error: File not found: ");
         muart_puts(file_name);
         muart_puts("\r\n");
@@ -283,44 +291,87 @@ unsigned long cpio_load_program(const void* cpio_file_addr, const char* file_nam
     
     // Store program size 
     current->user_program_size = program_size;
-    
-    // Allocate physical memory space for user program
-    current->user_program = dmalloc(program_size);
-    if (!current->user_program) {
-        muart_puts("Error: Failed to allocate memory for user program\r\n");
-        return 0;
+    current->user_program = NULL;
+    unsigned long entry = USER_CODE_BASE;
+    int is_elf = elf_check(program_start_addr, program_size);
+
+    if (is_elf) {
+        // ELF executable : map each PT_LOAD segment at its own virtual address, elf_load() records their VMAs
+        unsigned long image_end;
+        if (elf_load(current, program_start_addr, program_size, &entry, &image_end) != 0) {
+            muart_puts("Error: Failed to load ELF program\r\n");
+            return 0;
+        }
+        current->user_program_size = image_end - USER_CODE_BASE;   // fork duplicates [USER_CODE_BASE, image_end)
+
+        muart_puts("Loaded ELF program, entry point: ");
+        muart_send_hex(entry);
+        muart_puts("\r\n");
     }
+    else if (((unsigned long)program_start_addr & (PAGE_SIZE - 1)) == 0) {
+        // Zero-copy : map the full pages of the archive read-only, a write to them triggers copy-on-write in do_page_fault()
+        unsigned long full_size = program_size & ~(PAGE_SIZE - 1);
+        unsigned long archive_pa = (unsigned long)VIRT_TO_PHYS(program_start_addr);
+        if (full_size && mappages(current->pgd, USER_CODE_BASE, full_size, archive_pa, USER_PTE_ATTR_COW) != 0) {
+            muart_puts("Error: Failed to map user program to virtual address space\r\n");
+            return 0;
+        }
 
-    // Copy program from initramfs to allocated memory
-    memcpy(current->user_program, program_start_addr, program_size);
+        // The last partial page is shared with the next archive entry, give the task its own zero-padded copy
+        unsigned long tail_size = program_size - full_size;
+        if (tail_size) {
+            void* tail = dmalloc(PAGE_SIZE);
+            if (!tail) {
+                muart_puts("Error: Failed to allocate memory for user program\r\n");
+                return 0;
+            }
+            memzero((unsigned long)tail, PAGE_SIZE);
+            memcpy(tail, (const char*)program_start_addr + full_size, tail_size);
+            if (mappages(current->pgd, USER_CODE_BASE + full_size, PAGE_SIZE, VIRT_TO_PHYS(tail), USER_PTE_ATTR) != 0) {
+                dfree(tail);
+                muart_puts("Error: Failed to map user program to virtual address space\r\n");
+                return 0;
+            }
+        }
 
-    // Mapping the physical memory space of the user program to the user virtual address
-    unsigned long user_program_pa = (unsigned long)VIRT_TO_PHYS(current->user_program);
-    if (mappages(current->pgd, USER_CODE_BASE, program_size, user_program_pa) != 0) {
-        dfree(current->user_program);
-        muart_puts("Error: Failed to map user program to virtual address space\r\n");
-        return 0;
+        muart_puts("Mapped user program (initramfs physical address) : ");
+        muart_send_hex(archive_pa);
+        muart_puts(" to user virtual address 0x0 without copying\r\n");
     }
-    muart_puts("Mapped user program (physical address) : ");
-    muart_send_hex(user_program_pa);
-    muart_puts(" to user virtual address 0x0\r\n");
-    
+    else {
+        // Allocate physical memory space for user program
+        current->user_program = dmalloc(program_size);
+        if (!current->user_program) {
+            muart_puts("Error: Failed to allocate memory for user program\r\n");
+            return 0;
+        }
+
+        // Copy program from initramfs to allocated memory
+        memcpy(current->user_program, program_start_addr, program_size);
 
-    // Allocate a 16KB memory space for the task's user stack
-    current->user_stack = dmalloc(USER_STACK_SIZE);
-    if (!current->user_stack) {
-        muart_puts("Failed to allocate new task user stack\r\n");
-        return -1;
+        // Mapping the physical memory space of the user program to the user virtual address
+        unsigned long user_program_pa = (unsigned long)VIRT_TO_PHYS(current->user_program);
+        if (mappages(current->pgd, USER_CODE_BASE, program_size, user_program_pa, USER_PTE_ATTR) != 0) {
+            dfree(current->user_program);
+            muart_puts("Error: Failed to map user program to virtual address space\r\n");
+            return 0;
+        }
+        muart_puts("Mapped user program (physical address) : ");
+        muart_send_hex(user_program_pa);
+        muart_puts(" to user virtual address 0x0\r\n");
     }
+    
 
-    // Initialize user stack to zero
-    memzero((unsigned long)current->user_stack, USER_STACK_SIZE);  
+    // The user stack is a grow-down anonymous VMA, nothing is allocated here :
+    // its pages are demand-zero, and a fault below USER_STACK_BASE extends the VMA (up to USER_STACK_MAX)
+    current->user_stack = NULL;
 
-    // Mapping the user stack to the user virtual address
-    unsigned long user_stack_pa = (unsigned long)VIRT_TO_PHYS(current->user_stack);
-    if (mappages(current->pgd, USER_STACK_BASE, USER_STACK_SIZE, user_stack_pa) != 0) {
-        dfree(current->user_program);
-        muart_puts("Error: Failed to map user stack to virtual address space\r\n");
+    // Record the flat program image and the stack as VMAs, so mmap() won't place anything over them and fork() duplicates them
+    if ((!is_elf && !vma_insert(current, USER_CODE_BASE, USER_CODE_BASE + PAGE_ALIGN(current->user_program_size),
+                                PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE, NULL, 0, 0)) ||
+        !vma_insert(current, USER_STACK_BASE, USER_STACK_TOP, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN, NULL, 0, 0)) {
+        muart_puts("Error: Failed to allocate VMA\r\n");
         return 0;
     }
 
@@ -337,5 +388,5 @@ unsigned long cpio_load_program(const void* cpio_file_addr, const char* file_nam
     
     // lab 5
     // return (unsigned long)current->user_program;
-    return USER_CODE_BASE;  // Return the user virtual address where the program is loaded
+    return entry;  // Return the user virtual address of the program entry point
 }
\ No newline at end of file
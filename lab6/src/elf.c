@@ -0,0 +1,229 @@
+#include "elf.h"
+#include "vm.h"
+#include "mmu.h"
+#include "malloc.h"
+#include "mm.h"
+#include "muart.h"
+#include "sched.h"
+#include "mmap.h"
+
+#define LOG_ELF 0
+
+/* Check if the image is an ELF64 AArch64 executable */
+int elf_check(const void* image, unsigned long size) {
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)image;
+
+    if (size < sizeof(Elf64_Ehdr)) {
+        return 0;
+    }
+    if (ehdr->e_ident[0] != ELFMAG0 || ehdr->e_ident[1] != ELFMAG1 ||
+        ehdr->e_ident[2] != ELFMAG2 || ehdr->e_ident[3] != ELFMAG3) {
+        return 0;
+    }
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+        return 0;
+    }
+    if ((ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN) || ehdr->e_machine != EM_AARCH64) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Translate the segment flags to page descriptor attributes */
+static unsigned long segment_attr(unsigned int p_flags) {
+    unsigned long attr = USER_PTE_ATTR;
+
+    if (!(p_flags & PF_W)) {
+        attr |= PD_READONLY;
+    }
+    if (!(p_flags & PF_X)) {
+        attr |= PD_UXN;
+    }
+    return attr;
+}
+
+/* Translate the segment flags to the protection of its VMA */
+static unsigned long segment_prot(unsigned int p_flags) {
+    unsigned long prot = 0;
+
+    if (p_flags & PF_R) {
+        prot |= PROT_READ;
+    }
+    if (p_flags & PF_W) {
+        prot |= PROT_WRITE;
+    }
+    if (p_flags & PF_X) {
+        prot |= PROT_EXEC;
+    }
+    return prot;
+}
+
+/**
+ * Record the pages of a PT_LOAD segment as a VMA with the segment's own protection
+ * The segments come in ascending order, only the first page may be shared with the previous segment :
+ * that page gets a VMA of its own with both protections, as its page descriptor does in elf_load_segment()
+ */
+static int elf_insert_vma(struct task_struct* task, const Elf64_Phdr* phdr) {
+    unsigned long prot = segment_prot(phdr->p_flags);
+    unsigned long start = phdr->p_vaddr & ~(PAGE_SIZE - 1);
+    unsigned long end = PAGE_ALIGN(phdr->p_vaddr + phdr->p_memsz);
+    struct vm_area_struct* prev = find_vma(task, start);
+
+    if (prev) {
+        if (prev->vm_start == start) {
+            prev->vm_prot |= prot;
+        }
+        else {
+            prev->vm_end = start;
+            if (!vma_insert(task, start, start + PAGE_SIZE, prev->vm_prot | prot, MAP_PRIVATE, NULL, 0, 0)) {
+                return -1;
+            }
+        }
+        start += PAGE_SIZE;
+    }
+
+    if (start < end && !vma_insert(task, start, end, prot, MAP_PRIVATE, NULL, 0, 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Map one PT_LOAD segment page by page
+ *  - A page fully backed by the file whose bytes are page-aligned in the image is mapped straight from the initramfs,
+ *    read-only text is shared by every task running the program, writable data is copied on the first write
+ *  - Other pages (partial pages, BSS) get a private zero-filled page with the file bytes copied in
+ */
+static int elf_load_segment(unsigned long* pagetable, const void* image, const Elf64_Phdr* phdr) {
+    unsigned long attr = segment_attr(phdr->p_flags);
+    unsigned long seg_start = phdr->p_vaddr;
+    unsigned long file_end = seg_start + phdr->p_filesz;
+    unsigned long mem_end = seg_start + phdr->p_memsz;
+    const char* file_data = (const char*)image + phdr->p_offset;     // File bytes of seg_start
+
+    for (unsigned long va = seg_start & ~(PAGE_SIZE - 1); va < mem_end; va += PAGE_SIZE) {
+        unsigned long* pte = walk(pagetable, va);
+        if (!pte) {
+            return -1;
+        }
+
+        const char* src = file_data + (va - seg_start);
+        if (!(*pte & PD_VALID) && va >= seg_start && va + PAGE_SIZE <= file_end &&
+            ((unsigned long)src & (PAGE_SIZE - 1)) == 0) {
+            unsigned long shared_attr = (phdr->p_flags & PF_W) ? (attr | PD_READONLY | PD_SW_COW | PD_SW_SHARED)
+                                                              : (attr | PD_SW_SHARED);
+            if (mappages(pagetable, va, PAGE_SIZE, VIRT_TO_PHYS(src), shared_attr) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        char* page;
+        unsigned long page_attr;
+        if (*pte & PD_VALID) {
+            // The page is shared with the previous segment: make it private and merge the permissions
+            char* old_page = (char*)PHYS_TO_VIRT(*pte & PHY_ADDR_MASK);
+            page_attr = *pte & ~PHY_ADDR_MASK & ~(PD_SW_COW | PD_SW_SHARED);
+            if (*pte & PD_SW_COW) {
+                page_attr &= ~PD_READONLY;      // Read-only only because it was copy-on-write
+            }
+            if (*pte & PD_SW_SHARED) {
+                page = (char*)dmalloc(PAGE_SIZE);
+                if (!page) {
+                    return -1;
+                }
+                memcpy(page, old_page, PAGE_SIZE);
+            }
+            else {
+                page = old_page;
+            }
+            if (phdr->p_flags & PF_W) {
+                page_attr &= ~PD_READONLY;
+            }
+            if (phdr->p_flags & PF_X) {
+                page_attr &= ~PD_UXN;
+            }
+        }
+        else {
+            page = (char*)dmalloc(PAGE_SIZE);
+            if (!page) {
+                return -1;
+            }
+            memzero((unsigned long)page, PAGE_SIZE);    // BSS and the bytes outside of the segment are zero
+            page_attr = attr;
+        }
+
+        // Copy the part of the file which falls in this page
+        unsigned long copy_start = (va > seg_start) ? va : seg_start;
+        unsigned long copy_end = (va + PAGE_SIZE < file_end) ? va + PAGE_SIZE : file_end;
+        if (copy_start < copy_end) {
+            memcpy(page + (copy_start - va), file_data + (copy_start - seg_start), copy_end - copy_start);
+        }
+
+        if (mappages(pagetable, va, PAGE_SIZE, VIRT_TO_PHYS(page), page_attr) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Map all PT_LOAD segments of the ELF image into the task's page table, each one in a VMA with its own protection
+ * Page 0 is never mapped, so a NULL dereference faults
+ * Returns 0 on success and stores the entry point and the end of the highest segment, -1 on failure
+ */
+int elf_load(struct task_struct* task, const void* image, unsigned long size, unsigned long* entry, unsigned long* image_end) {
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)image;
+
+    if (!elf_check(image, size)) {
+        return -1;
+    }
+    if (ehdr->e_phentsize != sizeof(Elf64_Phdr) || ehdr->e_phoff > size ||
+        (unsigned long)ehdr->e_phnum * sizeof(Elf64_Phdr) > size - ehdr->e_phoff) {
+        muart_puts("Error: Invalid ELF program header table\r\n");
+        return -1;
+    }
+
+    const Elf64_Phdr* phdrs = (const Elf64_Phdr*)((const char*)image + ehdr->e_phoff);
+    unsigned long end = 0;
+
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr* phdr = &phdrs[i];
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
+            continue;
+        }
+
+        // The segment must lie in the image and in the user address space between page 0 and the range reserved
+        // for the user stack, after the previous segment (the sums are checked without overflowing)
+        if (phdr->p_filesz > size || phdr->p_offset > size - phdr->p_filesz || phdr->p_filesz > phdr->p_memsz ||
+            phdr->p_vaddr < PAGE_SIZE || phdr->p_vaddr < end ||
+            phdr->p_memsz > USER_STACK_LIMIT || phdr->p_vaddr > USER_STACK_LIMIT - phdr->p_memsz) {
+            muart_puts("Error: Invalid ELF segment\r\n");
+            return -1;
+        }
+
+        #if LOG_ELF
+        muart_puts("PT_LOAD VA: ");
+        muart_send_hex(phdr->p_vaddr);
+        muart_puts(", filesz: ");
+        muart_send_hex(phdr->p_filesz);
+        muart_puts(", memsz: ");
+        muart_send_hex(phdr->p_memsz);
+        muart_puts(", flags: ");
+        muart_send_hex(phdr->p_flags);
+        muart_puts("\r\n");
+        #endif
+
+        if (elf_load_segment(task->pgd, image, phdr) != 0 || elf_insert_vma(task, phdr) != 0) {
+            muart_puts("Error: Failed to map ELF segment\r\n");
+            return -1;
+        }
+
+        end = phdr->p_vaddr + phdr->p_memsz;
+    }
+
+    *entry = ehdr->e_entry;
+    *image_end = PAGE_ALIGN(end);
+    return 0;
+}
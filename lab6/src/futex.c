@@ -0,0 +1,122 @@
+#include "futex.h"
+#include "sched.h"
+#include "vm.h"
+#include "mmu.h"
+#include "mmap.h"
+#include "list.h"
+#include "exception.h"
+#include "muart.h"
+
+#define LOG_FUTEX 0
+
+static struct wait_queue_head futex_queues[FUTEX_HASH_SIZE];
+
+/* Initialize the futex hash table */
+void futex_init(void) {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        init_waitqueue_head(&futex_queues[i]);
+    }
+}
+
+static struct wait_queue_head* futex_hash(unsigned long key) {
+    // The futex word is 4-byte aligned, mix in the page frame number so that the same offset in different pages spreads out
+    unsigned long h = (key >> 2) ^ (key >> (PAGE_SHIFT + FUTEX_HASH_BITS));
+    return &futex_queues[h & (FUTEX_HASH_SIZE - 1)];
+}
+
+/* Translate the futex address of the current task to its physical address, paging it in if needed, 0 on failure */
+static unsigned long futex_key(struct task_struct* task, unsigned long uaddr) {
+    if (uaddr & 0x3) {
+        return 0;
+    }
+
+    for (int tries = 0; tries < 2; tries++) {
+        unsigned long* pmd = lookup_pmd(task->pgd, uaddr);
+        if (pmd && PD_IS_BLOCK(*pmd)) {
+            return (*pmd & PHY_ADDR_MASK & ~(BLOCK_SIZE_2MB - 1)) | (uaddr & (BLOCK_SIZE_2MB - 1));
+        }
+
+        unsigned long* pte = lookup_pte(task->pgd, uaddr);
+        if (pte && (*pte & PD_VALID)) {
+            return (*pte & PHY_ADDR_MASK) | (uaddr & (PAGE_SIZE - 1));
+        }
+
+        // Not present yet : page it in like a read fault would
+        struct vm_area_struct* vma = find_vma(task, uaddr);
+        if (!vma || !(vma->vm_prot & PROT_READ) || handle_mm_fault(task, vma, uaddr) != 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int futex_wait(struct task_struct* current, unsigned long uaddr, int val) {
+    unsigned long key = futex_key(current, uaddr);
+    if (!key) {
+        return -1;
+    }
+
+    // The value check and going to sleep must not be interleaved with a FUTEX_WAKE
+    disable_irq_in_el1();
+    if (*(volatile int*)uaddr != val) {
+        enable_irq_in_el1();
+        return -1;  // The lock changed hands, let user space retry
+    }
+
+    #if LOG_FUTEX
+    muart_puts("[futex] pid ");
+    muart_send_dec(current->pid);
+    muart_puts(" waits on PA ");
+    muart_send_hex(key);
+    muart_puts("\r\n");
+    #endif
+
+    current->futex_key = key;
+    sleep_on(futex_hash(key));
+    current->futex_key = 0;
+
+    enable_irq_in_el1();
+    return 0;
+}
+
+static int futex_wake(struct task_struct* current, unsigned long uaddr, int nr_wake) {
+    unsigned long key = futex_key(current, uaddr);
+    if (!key) {
+        return -1;
+    }
+
+    disable_irq_in_el1();
+
+    // Tasks with other keys may share the bucket, only wake up the ones waiting on this word
+    struct wait_queue_head* wq = futex_hash(key);
+    struct list_head* pos;
+    struct list_head* tmp;
+    int woken = 0;
+    list_for_each_safe(pos, tmp, &wq->task_list) {
+        if (woken >= nr_wake) {
+            break;
+        }
+        struct task_struct* task = list_entry(pos, struct task_struct, list);
+        if (task->futex_key == key) {
+            wake_up_process(task);
+            woken++;
+        }
+    }
+
+    enable_irq_in_el1();
+    return woken;
+}
+
+/* Return 0 on success (WAIT : woken up, WAKE : number of tasks woken up), -1 on error or if *uaddr != val for FUTEX_WAIT */
+int do_futex(unsigned long uaddr, int op, int val) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    switch (op) {
+        case FUTEX_WAIT:
+            return futex_wait(current, uaddr, val);
+        case FUTEX_WAKE:
+            return futex_wake(current, uaddr, val);
+        default:
+            return -1;
+    }
+}
@@ -79,6 +79,9 @@ void main(void* fdt){
     muart_send_hex(((unsigned long)fdt));
     muart_puts("\r\n");
 
+    // The bootloader passes the physical address, TTBR0 no longer maps the boot identity tables once the scheduler starts
+    fdt = (void*)PHYS_TO_VIRT(fdt);
+
     // Get the initramfs address from the device tree
     unsigned long initramfs_addr = get_initramfs_address(fdt);
     if (initramfs_addr == 1) {
@@ -90,7 +93,7 @@ void main(void* fdt){
     muart_puts("\r\n");
 
     // Update the initramfs address in CPIO module
-    set_initramfs_address(initramfs_addr);
+    set_initramfs_address(PHYS_TO_VIRT(initramfs_addr));
 
     // Initialize the vector table
     exception_table_init();
@@ -0,0 +1,223 @@
+#include "kstack.h"
+#include "sched.h"
+#include "vm.h"
+#include "mmu.h"
+#include "mmap.h"
+#include "malloc.h"
+#include "bitmap.h"
+#include "exception.h"
+#include "muart.h"
+
+#define LOG_KSTACK 0
+
+/* The kernel page table built in boot.S, loaded in TTBR1_EL1 */
+#define KERNEL_PGD              ((unsigned long*)PHYS_TO_VIRT(0x0))
+
+static DECLARE_BITMAP(kstack_slots, KSTACK_NR_SLOTS);  // Slots of the vmap area in use
+
+/* Stack of el1_stack_overflow in exception.S */
+unsigned char kstack_overflow_stack[KSTACK_OVERFLOW_STACK_SIZE] __attribute__((aligned(16)));
+
+/* Highest watermark of the stacks freed so far */
+static unsigned long kstack_peak;
+static pid_t kstack_peak_pid;
+
+/* Invalidate the global TLB entry of a kernel virtual address (any ASID) */
+static void flush_tlb_kernel_page(unsigned long va) {
+    __asm__ volatile(
+        "dsb ishst\n\t"
+        "tlbi vaae1is, %0\n\t"
+        "dsb ish\n\t"
+        "isb\n\t"
+        :: "r"((va >> PAGE_SHIFT) & ((1UL << 44) - 1))
+    );
+}
+
+/* Unmap [base, base + size) of the vmap area and free the page frames behind it */
+static void kstack_unmap(unsigned long base, unsigned long size) {
+    for (unsigned long va = base; va < base + size; va += PAGE_SIZE) {
+        unsigned long* pte = lookup_pte(KERNEL_PGD, va);
+        if (!pte || !(*pte & PD_VALID)) {
+            continue;
+        }
+        unsigned long pa = *pte & PHY_ADDR_MASK;
+        *pte = 0;
+        flush_tlb_kernel_page(va);
+        dfree((void*)PHYS_TO_VIRT(pa));
+    }
+}
+
+/* Find and take a free slot, -1 if every slot is in use */
+static int kstack_slot_alloc(void) {
+    for (int i = 0; i < BITS_TO_LONGS(KSTACK_NR_SLOTS); i++) {
+        if (kstack_slots[i] != ~0UL) {
+            int slot = i * BITS_PER_LONG + __builtin_ctzl(~kstack_slots[i]);
+            set_bit(slot, kstack_slots);
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Map a kernel stack at the top of a free slot of the vmap area
+ * The pages do not need to be physically contiguous, every word is filled with KSTACK_POISON
+ *
+ * @param task    Task owning the stack, kernel_stack / kstack_size / cpu_context.kstack_guard are set
+ * @param size    Stack size in bytes, 0 for the default KSTACK_SIZE
+ * @return        0 on success, -1 on failure
+ */
+int kstack_alloc(struct task_struct* task, unsigned long size) {
+    if (size == 0) {
+        size = KSTACK_SIZE;
+    }
+    size = PAGE_ALIGN(size);
+    if (size > KSTACK_MAX_SIZE) {
+        muart_puts("kstack: stack size too large\r\n");
+        return -1;
+    }
+
+    int slot = kstack_slot_alloc();
+    if (slot < 0) {
+        muart_puts("kstack: no free stack slot\r\n");
+        return -1;
+    }
+
+    unsigned long top = KSTACK_VMAP_START + (unsigned long)(slot + 1) * KSTACK_SLOT_SIZE;
+    unsigned long base = top - size;
+
+    for (unsigned long va = base; va < top; va += PAGE_SIZE) {
+        unsigned long* page = (unsigned long*)dmalloc(PAGE_SIZE);
+        if (!page) {
+            goto fail;
+        }
+        for (int i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++) {
+            page[i] = KSTACK_POISON;
+        }
+        if (mappages(KERNEL_PGD, va, PAGE_SIZE, VIRT_TO_PHYS(page), KERNEL_PTE_ATTR) != 0) {
+            dfree(page);
+            goto fail;
+        }
+    }
+
+    // The entries were invalid before, only make sure the table walker sees them
+    __asm__ volatile("dsb ishst\n\tisb\n\t");
+
+    task->kernel_stack = (void*)base;
+    task->kstack_size = size;
+    task->cpu_context.kstack_guard = base - KSTACK_GUARD_SIZE;
+
+    #if LOG_KSTACK
+    muart_puts("kstack: slot ");
+    muart_send_dec(slot);
+    muart_puts(", stack ");
+    muart_send_hex(base);
+    muart_puts(" size ");
+    muart_send_dec(size);
+    muart_puts("\r\n");
+    #endif
+
+    return 0;
+
+fail:
+    muart_puts("kstack: failed to map kernel stack\r\n");
+    kstack_unmap(base, size);
+    clear_bit(slot, kstack_slots);
+    return -1;
+}
+
+/**
+ * Count the bytes of the stack which have been written at least once
+ * The stack grows down, so the poisoned words left at the bottom have never been used
+ */
+unsigned long kstack_usage(struct task_struct* task) {
+    unsigned long* p = (unsigned long*)task->kernel_stack;
+    unsigned long* end = (unsigned long*)kstack_top(task);
+
+    if (!p) {
+        return 0;
+    }
+    while (p < end && *p == KSTACK_POISON) {
+        p++;
+    }
+    return (unsigned long)end - (unsigned long)p;
+}
+
+void kstack_free(struct task_struct* task) {
+    if (!task->kernel_stack) {
+        return;
+    }
+
+    unsigned long used = kstack_usage(task);
+    if (used > kstack_peak) {
+        kstack_peak = used;
+        kstack_peak_pid = task->pid;
+    }
+
+    #if LOG_KSTACK
+    muart_puts("kstack: task ");
+    muart_send_dec(task->pid);
+    muart_puts(" used ");
+    muart_send_dec(used);
+    muart_puts(" / ");
+    muart_send_dec(task->kstack_size);
+    muart_puts(" bytes\r\n");
+    #endif
+
+    unsigned long base = (unsigned long)task->kernel_stack;
+    kstack_unmap(base, task->kstack_size);
+    clear_bit((base - KSTACK_VMAP_START) / KSTACK_SLOT_SIZE, kstack_slots);
+
+    task->kernel_stack = NULL;
+    task->kstack_size = 0;
+}
+
+void kstack_report(void) {
+    struct list_head* pos;
+
+    // A task exiting meanwhile would free the stack being scanned
+    disable_irq_in_el1();
+
+    muart_puts("Kernel stack usage (PID: used / size bytes)\r\n");
+    list_for_each(pos, &task_lists) {
+        struct task_struct* task = list_entry(pos, struct task_struct, task);
+        if (!task->kernel_stack) {
+            continue;
+        }
+        muart_send_dec(task->pid);
+        muart_puts(": ");
+        muart_send_dec(kstack_usage(task));
+        muart_puts(" / ");
+        muart_send_dec(task->kstack_size);
+        muart_puts("\r\n");
+    }
+    muart_puts("Highest watermark of exited tasks: ");
+    muart_send_dec(kstack_peak);
+    muart_puts(" bytes (PID ");
+    muart_send_dec(kstack_peak_pid);
+    muart_puts(")\r\n");
+
+    enable_irq_in_el1();
+}
+
+/**
+ * Called by the EL1 synchronous exception vector on a dedicated stack when sp was in the guard page
+ * The faulting stack can't hold even a trap frame, so there is no way back, report and stop
+ */
+void handle_kernel_stack_overflow(unsigned long far, struct trap_frame* tf) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    muart_puts("\r\nKernel stack overflow in task ");
+    muart_send_dec(current->pid);
+    muart_puts("\r\nsp: ");
+    muart_send_hex(tf->regs[0]);
+    muart_puts(", guard: ");
+    muart_send_hex(current->cpu_context.kstack_guard);
+    muart_puts(", FAR_EL1: ");
+    muart_send_hex(far);
+    muart_puts(", ELR_EL1: ");
+    muart_send_hex(tf->elr_el1);
+    muart_puts("\r\n");
+
+    while (1) {};
+}
@@ -10,6 +10,9 @@ extern char heap_end;
 // next_free pointer will always point to the first available byte
 static char* next_free = &heap_begin;
 
+/* Global buddy system instance */
+extern buddy_system_t buddy;
+
 void* simple_alloc(size_t size) {
     // Align the size to 8 bytes (for ARMv8 64bits)
     size = (size + 7) & ~7;
@@ -70,6 +73,7 @@ void buddy_init(buddy_system_t* buddy, void* mem_start, size_t mem_size, page_t*
         INIT_LIST_HEAD(&page->list);
         page->flag = PAGE_FLAG_UNUSED;
         page->order = 0;
+        page->refcount = 0;
     }
 
     // Add all pages to the highest possible order free lists
@@ -172,8 +176,9 @@ void *buddy_alloc_pages(buddy_system_t* buddy, unsigned int request_order ){
     // Update the order of the allocate page 
     page->order = request_order;
 
-    // Mark the page as used
+    // Mark the page as used, the caller holds the only reference
     page->flag = PAGE_FLAG_USED;
+    page->refcount = 1;
 
     // Calculate the allocate physical page frame number
     unsigned int page_idx = page - buddy->pages;
@@ -353,6 +358,62 @@ void buddy_free_pages(buddy_system_t* buddy, void* allocated_addr){
 
 }
 
+/* 
+ * Turn an allocated 2^order block into 2^order independent order-0 allocations
+ * Used when a huge page is split, so that each 4KB page can be freed (and coalesced again) on its own
+ */
+void buddy_split_allocation(buddy_system_t* buddy, void* allocated_addr){
+    unsigned long allocated_pfn = (unsigned long)allocated_addr >> PAGE_SHIFT;
+    unsigned int page_idx = allocated_pfn - buddy->base_pfn;
+
+    if( page_idx >= buddy->total_pages || buddy->pages[page_idx].flag == PAGE_FLAG_UNUSED ){
+        return;
+    }
+
+    unsigned int nr_pages = 1U << buddy->pages[page_idx].order;
+    for(unsigned int i = 0; i < nr_pages; i++){
+        buddy->pages[page_idx + i].order = 0;
+        buddy->pages[page_idx + i].flag = PAGE_FLAG_USED;
+        buddy->pages[page_idx + i].refcount = 1;
+    }
+}
+
+/* Get the page descriptor of an allocated page frame of the kernel buddy system, NULL if there is none */
+static page_t* addr_to_page(void* addr){
+    unsigned long pfn = (unsigned long)addr >> PAGE_SHIFT;
+    unsigned long page_idx = pfn - buddy.base_pfn;
+
+    if( pfn < buddy.base_pfn || page_idx >= buddy.total_pages || buddy.pages[page_idx].flag == PAGE_FLAG_UNUSED ){
+        return NULL;
+    }
+    return &buddy.pages[page_idx];
+}
+
+/* Take one more reference on an allocated page frame of the kernel buddy system */
+void page_get(void* addr){
+    page_t* page = addr_to_page(addr);
+    if( page ){
+        page->refcount++;
+    }
+}
+
+/* Drop a reference on an allocated page frame, it is freed when the last reference goes away */
+void page_put(void* addr){
+    page_t* page = addr_to_page(addr);
+    if( !page ){
+        return;
+    }
+    if( --page->refcount <= 0 ){
+        buddy_free_pages(&buddy, addr);
+    }
+}
+
+/* Get the reference count of an allocated page frame, 0 if the address is not an allocated page */
+int page_count(void* addr){
+    page_t* page = addr_to_page(addr);
+    return page ? page->refcount : 0;
+}
+
 /* Todo : Usage Function in Buddy System*/
 /* Split a higher-order page to get a page of the requested order */
 static void split_page(buddy_system_t* buddy, page_t* page, unsigned int high_order, unsigned int low_order){
@@ -408,9 +469,6 @@ static inline page_t* find_buddy(buddy_system_t* buddy, page_t* page, unsigned i
 
 /* Demo */
 
-/* Global buddy system instance */
-extern buddy_system_t buddy;
-
 /* Page array for buddy system */
 extern page_t page_array[];
 
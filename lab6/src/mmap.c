@@ -0,0 +1,445 @@
+#include "mmap.h"
+#include "sched.h"
+#include "vm.h"
+#include "mmu.h"
+#include "malloc.h"
+#include "mm.h"
+#include "muart.h"
+#include "exception.h"
+
+#define LOG_MMAP 0
+
+extern buddy_system_t buddy;
+
+/* Translate PROT_* to page descriptor attributes */
+unsigned long vma_prot_to_attr(unsigned long prot) {
+    unsigned long attr = USER_PTE_ATTR;
+
+    if (!(prot & PROT_WRITE)) {
+        attr |= PD_READONLY;
+    }
+    if (!(prot & PROT_EXEC)) {
+        attr |= PD_UXN;
+    }
+    if (prot == PROT_NONE) {
+        attr &= ~PD_USER;   // Only the kernel can access the page
+    }
+    return attr;
+}
+
+/* Find the VMA containing addr, NULL if addr is not mapped */
+struct vm_area_struct* find_vma(struct task_struct* task, unsigned long addr) {
+    struct list_head* pos;
+
+    list_for_each(pos, &task->mmap) {
+        struct vm_area_struct* vma = list_entry(pos, struct vm_area_struct, list);
+        if (addr < vma->vm_start) {
+            break;  // The list is sorted, no VMA after this one can contain addr
+        }
+        if (addr < vma->vm_end) {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+/* Extend a grow-down VMA so that it starts at the page of addr, return 0 on success */
+static int expand_stack(struct task_struct* task, struct vm_area_struct* vma, unsigned long addr) {
+    unsigned long new_start = addr & ~(PAGE_SIZE - 1);
+
+    if (vma->vm_end - new_start > USER_STACK_MAX) {
+        return -1;  // Stack limit reached
+    }
+
+    // Keep a gap to the VMA below, so a runaway stack faults instead of writing into it
+    if (vma->list.prev != &task->mmap) {
+        struct vm_area_struct* prev = list_entry(vma->list.prev, struct vm_area_struct, list);
+        if (prev->vm_end + STACK_GUARD_GAP > new_start) {
+            return -1;
+        }
+    }
+
+    #if LOG_MMAP
+    muart_puts("Stack grows down to VA: ");
+    muart_send_hex(new_start);
+    muart_puts("\r\n");
+    #endif
+
+    // Only the VMA changes, the new pages are backed one by one by handle_mm_fault()
+    vma->vm_start = new_start;
+    return 0;
+}
+
+struct vm_area_struct* find_extend_vma(struct task_struct* task, unsigned long addr) {
+    struct list_head* pos;
+
+    list_for_each(pos, &task->mmap) {
+        struct vm_area_struct* vma = list_entry(pos, struct vm_area_struct, list);
+        if (addr >= vma->vm_end) {
+            continue;
+        }
+        if (addr >= vma->vm_start) {
+            return vma;
+        }
+        // First VMA above addr, only a stack can grow down to it
+        if ((vma->vm_flags & MAP_GROWSDOWN) && expand_stack(task, vma, addr) == 0) {
+            return vma;
+        }
+        break;
+    }
+    return NULL;
+}
+
+/* Add a VMA [start, end) to the task, the range must not overlap any existing VMA */
+struct vm_area_struct* vma_insert(struct task_struct* task, unsigned long start, unsigned long end, unsigned long prot,
+                                  unsigned long flags, const void* file, unsigned long file_size, unsigned long pgoff) {
+    struct vm_area_struct* vma = (struct vm_area_struct*)dmalloc(sizeof(struct vm_area_struct));
+    if (!vma) {
+        return NULL;
+    }
+
+    vma->vm_start = start;
+    vma->vm_end = end;
+    vma->vm_prot = prot;
+    vma->vm_flags = flags;
+    vma->vm_file = file;
+    vma->vm_file_size = file_size;
+    vma->vm_pgoff = pgoff;
+
+    // Insert before the first VMA which starts after this one to keep the list sorted
+    struct list_head* pos;
+    list_for_each(pos, &task->mmap) {
+        if (list_entry(pos, struct vm_area_struct, list)->vm_start > start) {
+            break;
+        }
+    }
+    list_add_tail(&vma->list, pos);
+
+    return vma;
+}
+
+/* Split the VMA containing addr into [vm_start, addr) and [addr, vm_end), return 0 on success */
+static int vma_split(struct task_struct* task, unsigned long addr) {
+    struct vm_area_struct* vma = find_vma(task, addr);
+    if (!vma || vma->vm_start == addr) {
+        return 0;   // Nothing to split
+    }
+
+    struct vm_area_struct* upper = (struct vm_area_struct*)dmalloc(sizeof(struct vm_area_struct));
+    if (!upper) {
+        return -1;
+    }
+
+    *upper = *vma;
+    upper->vm_start = addr;
+    upper->vm_pgoff += addr - vma->vm_start;
+    vma->vm_end = addr;
+    list_add(&upper->list, &vma->list);
+
+    return 0;
+}
+
+/* Find a free range of len bytes at or above hint */
+static unsigned long get_unmapped_area(struct task_struct* task, unsigned long hint, unsigned long len) {
+    unsigned long addr = hint ? hint : MMAP_BASE;
+    struct list_head* pos;
+
+    list_for_each(pos, &task->mmap) {
+        struct vm_area_struct* vma = list_entry(pos, struct vm_area_struct, list);
+        if (vma->vm_end <= addr) {
+            continue;
+        }
+        // The range a stack can still grow into is reserved as well
+        unsigned long start = vma->vm_start;
+        if ((vma->vm_flags & MAP_GROWSDOWN) && vma->vm_end - USER_STACK_MAX < start) {
+            start = vma->vm_end - USER_STACK_MAX;
+        }
+        if (addr + len <= start) {
+            break;      // The gap before this VMA is large enough
+        }
+        addr = vma->vm_end;
+    }
+
+    if (addr + len > USER_VA_LIMIT || addr + len < addr) {
+        // No room above the hint, retry from the default base
+        return (hint && hint != MMAP_BASE) ? get_unmapped_area(task, MMAP_BASE, len) : MAP_FAILED;
+    }
+    return addr;
+}
+
+/* Check if the access described by ESR_EL1 is allowed by the VMA's protection */
+int vma_access_ok(struct vm_area_struct* vma, unsigned long esr) {
+    unsigned long ec = (esr >> ESR_ELx_EC_SHIFT) & ESR_ELx_EC_MASK;
+
+    if (ec == ESR_ELx_EC_IABT_LOW) {
+        return (vma->vm_prot & PROT_EXEC) != 0;
+    }
+    if (esr & ESR_ELx_WNR) {
+        return (vma->vm_prot & PROT_WRITE) != 0;
+    }
+    return vma->vm_prot != PROT_NONE;
+}
+
+/**
+ * Resolve a translation fault at va inside vma
+ *  - Anonymous memory : map a zero-filled page
+ *  - File-backed memory : a full page-aligned page of the initramfs is mapped directly (copy-on-write if writable),
+ *    otherwise the file bytes are copied into a zero-filled private page
+ *  - MAP_SHARED : the new page is reference counted (PD_SW_REFCNT), fork() maps the same frame in the child
+ *    instead of copying it, so parent and child keep seeing each other's writes
+ */
+int handle_mm_fault(struct task_struct* task, struct vm_area_struct* vma, unsigned long va) {
+    va &= ~(PAGE_SIZE - 1);
+
+    // Shared memory is fully mapped by shmat(), there is nothing to page in
+    if (vma->vm_flags & MAP_SHM) {
+        return -1;
+    }
+
+    // Anonymous region covering the whole 2MB around va : try to back it with a huge page
+    // (not for a stack, it should only cost the pages it really touches, nor for a shared region, huge pages aren't reference counted)
+    unsigned long huge_va = va & ~(BLOCK_SIZE_2MB - 1);
+    if (!vma->vm_file && !(vma->vm_flags & (MAP_GROWSDOWN | MAP_SHARED)) && huge_va >= vma->vm_start && huge_va + BLOCK_SIZE_2MB <= vma->vm_end) {
+        unsigned long* pmd = walk_pmd(task->pgd, huge_va);
+        if (pmd && !(*pmd & PD_VALID)) {
+            void* huge = buddy_alloc_pages(&buddy, HUGE_PAGE_ORDER);
+            if (huge) {
+                memzero((unsigned long)huge, BLOCK_SIZE_2MB);
+                if (mappages(task->pgd, huge_va, BLOCK_SIZE_2MB, VIRT_TO_PHYS(huge), vma_prot_to_attr(vma->vm_prot)) == 0) {
+                    return 0;
+                }
+                dfree(huge);
+            }
+            // No free order-9 block, fall back to a 4KB page
+        }
+    }
+
+    unsigned long* pte = walk(task->pgd, va);
+    if (!pte) {
+        return -1;
+    }
+    if (*pte & PD_VALID) {
+        return 0;   // Already mapped
+    }
+
+    unsigned long attr = vma_prot_to_attr(vma->vm_prot);
+    if (vma->vm_flags & MAP_SHARED) {
+        attr |= PD_SW_REFCNT;   // The frame of a shared page is only freed by its last page_put()
+    }
+
+    if (vma->vm_file) {
+        unsigned long offset = vma->vm_pgoff + (va - vma->vm_start);
+        const char* src = (const char*)vma->vm_file + offset;
+
+        if (offset + PAGE_SIZE <= vma->vm_file_size && ((unsigned long)src & (PAGE_SIZE - 1)) == 0) {
+            attr = (attr & ~PD_SW_REFCNT) | PD_READONLY | PD_SW_SHARED;
+            if (vma->vm_prot & PROT_WRITE) {
+                attr |= PD_SW_COW;
+            }
+            return mappages(task->pgd, va, PAGE_SIZE, VIRT_TO_PHYS(src), attr);
+        }
+    }
+
+    void* page = dmalloc(PAGE_SIZE);
+    if (!page) {
+        return -1;
+    }
+    memzero((unsigned long)page, PAGE_SIZE);
+
+    if (vma->vm_file) {
+        unsigned long offset = vma->vm_pgoff + (va - vma->vm_start);
+        if (offset < vma->vm_file_size) {
+            unsigned long n = vma->vm_file_size - offset;
+            memcpy(page, (const char*)vma->vm_file + offset, n < PAGE_SIZE ? n : PAGE_SIZE);
+        }
+    }
+
+    #if LOG_MMAP
+    muart_puts("Demand paging VA: ");
+    muart_send_hex(va);
+    muart_puts("\r\n");
+    #endif
+
+    if (mappages(task->pgd, va, PAGE_SIZE, VIRT_TO_PHYS(page), attr) != 0) {
+        dfree(page);
+        return -1;
+    }
+    return 0;
+}
+
+/* Create a mapping, return its start address or MAP_FAILED */
+unsigned long do_mmap(struct task_struct* task, unsigned long addr, unsigned long len, unsigned long prot,
+                      unsigned long flags, const void* file, unsigned long file_size, unsigned long offset) {
+    if (len == 0 || (offset & (PAGE_SIZE - 1))) {
+        return MAP_FAILED;
+    }
+    // The initramfs can't be written back, a shared file mapping is read-only
+    if ((flags & MAP_SHARED) && file && (prot & PROT_WRITE)) {
+        return MAP_FAILED;
+    }
+    len = PAGE_ALIGN(len);
+
+    if (flags & MAP_FIXED) {
+        if ((addr & (PAGE_SIZE - 1)) || addr + len > USER_VA_LIMIT || do_munmap(task, addr, len) != 0) {
+            return MAP_FAILED;
+        }
+    }
+    else {
+        // The address is only a hint, the region is placed at the next free range
+        addr = get_unmapped_area(task, addr & ~(PAGE_SIZE - 1), len);
+        if (addr == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+    }
+
+    struct vm_area_struct* vma = vma_insert(task, addr, addr + len, prot, flags, file, file_size, offset);
+    if (!vma) {
+        return MAP_FAILED;
+    }
+
+    #if LOG_MMAP
+    muart_puts("mmap: [");
+    muart_send_hex(addr);
+    muart_puts(", ");
+    muart_send_hex(addr + len);
+    muart_puts(")\r\n");
+    #endif
+
+    // Pages are mapped on the first access unless the caller asks to populate them now
+    if (flags & MAP_POPULATE) {
+        for (unsigned long va = addr; va < addr + len; va += PAGE_SIZE) {
+            if (handle_mm_fault(task, vma, va) != 0) {
+                do_munmap(task, addr, len);
+                return MAP_FAILED;
+            }
+        }
+    }
+
+    return addr;
+}
+
+/* Remove the mappings in [addr, addr + len), return 0 on success, -1 on failure */
+int do_munmap(struct task_struct* task, unsigned long addr, unsigned long len) {
+    if ((addr & (PAGE_SIZE - 1)) || len == 0) {
+        return -1;
+    }
+    unsigned long end = addr + PAGE_ALIGN(len);
+
+    // Split the VMAs crossing the boundaries so that only whole VMAs are removed
+    if (vma_split(task, addr) != 0 || vma_split(task, end) != 0) {
+        return -1;
+    }
+
+    struct list_head* pos;
+    struct list_head* n;
+    list_for_each_safe(pos, n, &task->mmap) {
+        struct vm_area_struct* vma = list_entry(pos, struct vm_area_struct, list);
+        if (vma->vm_start >= end) {
+            break;
+        }
+        if (vma->vm_end <= addr) {
+            continue;
+        }
+
+        unmap_pages(task->pgd, vma->vm_start, vma->vm_end - vma->vm_start);
+        list_del(&vma->list);
+        dfree(vma);
+    }
+
+    return 0;
+}
+
+/* Change the protection of [addr, addr + len), return 0 on success, -1 on failure */
+int do_mprotect(struct task_struct* task, unsigned long addr, unsigned long len, unsigned long prot) {
+    if ((addr & (PAGE_SIZE - 1)) || len == 0) {
+        return -1;
+    }
+    unsigned long end = addr + PAGE_ALIGN(len);
+
+    // The whole range must be mapped, and a shared file mapping can't become writable
+    for (unsigned long a = addr; a < end; ) {
+        struct vm_area_struct* vma = find_vma(task, a);
+        if (!vma || ((vma->vm_flags & MAP_SHARED) && vma->vm_file && (prot & PROT_WRITE))) {
+            return -1;
+        }
+        a = vma->vm_end;
+    }
+
+    if (vma_split(task, addr) != 0 || vma_split(task, end) != 0) {
+        return -1;
+    }
+
+    for (struct vm_area_struct* vma = find_vma(task, addr); vma && vma->vm_start < end;
+         vma = (vma->list.next == &task->mmap) ? NULL : list_entry(vma->list.next, struct vm_area_struct, list)) {
+        vma->vm_prot = prot;
+
+        // Update the pages which are already present
+        for (unsigned long va = vma->vm_start; va < vma->vm_end; va += PAGE_SIZE) {
+            unsigned long* pmd = lookup_pmd(task->pgd, va);
+            if (pmd && PD_IS_BLOCK(*pmd)) {
+                if ((va & (BLOCK_SIZE_2MB - 1)) == 0 && va + BLOCK_SIZE_2MB <= vma->vm_end && !(*pmd & PD_SW_SHARED)) {
+                    // The whole huge page gets the new protection
+                    *pmd = (*pmd & PHY_ADDR_MASK) | (vma_prot_to_attr(prot) & ~PD_TYPE_MASK) | PD_BLOCK;
+                    flush_tlb_page(va);
+                    va += BLOCK_SIZE_2MB - PAGE_SIZE;
+                    continue;
+                }
+                if (split_huge_pmd(pmd, va) != 0) {
+                    return -1;
+                }
+            }
+
+            unsigned long* pte = lookup_pte(task->pgd, va);
+            if (!pte || !(*pte & PD_VALID)) {
+                continue;
+            }
+
+            unsigned long attr = vma_prot_to_attr(prot) | (*pte & (PD_SW_SHARED | PD_SW_REFCNT));
+            if (*pte & PD_SW_SHARED) {
+                // Shared frames stay read-only, a writable one is copied on the first write
+                attr |= PD_READONLY;
+                if (prot & PROT_WRITE) {
+                    attr |= PD_SW_COW;
+                }
+            }
+            *pte = (*pte & PHY_ADDR_MASK) | attr;
+            flush_tlb_page(va);
+        }
+    }
+
+    return 0;
+}
+
+/* Duplicate the VMA list and the user pages of src into dst (used by fork) */
+int dup_mmap(struct task_struct* dst, struct task_struct* src) {
+    struct list_head* pos;
+
+    list_for_each(pos, &src->mmap) {
+        struct vm_area_struct* vma = list_entry(pos, struct vm_area_struct, list);
+
+        if (!vma_insert(dst, vma->vm_start, vma->vm_end, vma->vm_prot, vma->vm_flags,
+                        vma->vm_file, vma->vm_file_size, vma->vm_pgoff)) {
+            return -1;
+        }
+        if (copy_user_pages(dst->pgd, src->pgd, vma->vm_start, vma->vm_end - vma->vm_start) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Unmap every VMA of the task and free the VMA list (used by exec and task teardown) */
+void exit_mmap(struct task_struct* task) {
+    struct list_head* pos;
+    struct list_head* n;
+
+    list_for_each_safe(pos, n, &task->mmap) {
+        struct vm_area_struct* vma = list_entry(pos, struct vm_area_struct, list);
+        if (task->pgd) {
+            unmap_pages(task->pgd, vma->vm_start, vma->vm_end - vma->vm_start);
+        }
+        list_del(&vma->list);
+        dfree(vma);
+    }
+}
@@ -10,6 +10,10 @@
 #include "cpio.h"
 #include "mm.h"
 #include "vm.h"
+#include "mmap.h"
+#include "asid.h"
+#include "futex.h"
+#include "kstack.h"
 
 /* Thread Mechanism Progress : 
  * use `kernel_thread` to create a new thread and add it to run queue
@@ -36,6 +40,10 @@ static struct task_struct* idle_task = NULL;       // Idle thread
  * Return the thread ID or -1 if fail   
  */
 pid_t kernel_thread(thread_func_t fn, void* arg) {
+    return kernel_thread_stack(fn, arg, 0);
+}
+
+pid_t kernel_thread_stack(thread_func_t fn, void* arg, unsigned long stack_size) {
     struct task_struct* new_task;
     
     // Disable interrupt when creating a new thread (prevent race conditions when accessing global variable like run queue, pid_bitmap and task list)
@@ -62,9 +70,8 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
     new_task->state = TASK_RUNNING;
     new_task->parent = (struct task_struct*)get_current_thread();
     
-    // Allocate a memory space for the task's kernel stack
-    new_task->kernel_stack = dmalloc(THREAD_STACK_SIZE);
-    if (!new_task->kernel_stack) {
+    // Map the task's kernel stack in the vmap area, with a guard page below it
+    if (kstack_alloc(new_task, stack_size) != 0) {
         pid_free(new_task->pid);
         dfree(new_task);
         muart_puts("Failed to allocate kernel stack\r\n");
@@ -76,7 +83,7 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
     new_task->pgd = dmalloc(PAGE_SIZE);
     if (!new_task->pgd) {
         pid_free(new_task->pid);
-        dfree(new_task->kernel_stack);
+        kstack_free(new_task);
         dfree(new_task);
         enable_irq_in_el1();
     }
@@ -86,15 +93,19 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
     // Initialize user program fields
     new_task->user_program = NULL;        // Will be set by cpio_load_program
     new_task->user_program_size = 0;      // Will be set by cpio_load_program
+    new_task->user_stack = NULL;
+    INIT_LIST_HEAD(&new_task->mmap);      // VMAs will be added by cpio_load_program / mmap
 
     // Set the cpu context of new task
-    new_task->cpu_context.sp = (unsigned long)((char*)new_task->kernel_stack + THREAD_STACK_SIZE);          // Set the stack pointer point to the top of the task's kernel stack
+    new_task->cpu_context.sp = kstack_top(new_task);                                                        // Set the stack pointer point to the top of the task's kernel stack
     new_task->cpu_context.lr = (unsigned long)ret_from_kernel_thread;                                       // Set the link register store the address of ret_from_kernel_thread
     new_task->cpu_context.x19 = (unsigned long)fn;                                                          // Store the function address into the callee-saved register
     new_task->cpu_context.x20 = (unsigned long)arg;     
     
-    // Store the physical address of the PGD page table into the cpu context
+    // Store the physical address of the PGD page table into the cpu context, the ASID is assigned when the task is first scheduled
     new_task->cpu_context.phy_addr_pgd = (unsigned long)VIRT_TO_PHYS(new_task->pgd);
+    new_task->asid = 0;
+    new_task->futex_key = 0;
 
     // Add the new task into the run queue
     INIT_LIST_HEAD(&new_task->list);
@@ -171,6 +182,9 @@ void schedule(){
         // muart_send_dec(next->pid);
         // muart_puts("\r\n");
         
+        // Make sure the next task's ASID belongs to the current generation before it is loaded into TTBR0_EL1
+        check_and_switch_context(next);
+
         // Perform context switch
         cpu_switch_to(prev, next);
         return;
@@ -205,6 +219,47 @@ void thread_exit(){
     while(1) {}
 }
 
+/* Initialize an empty wait queue */
+void init_waitqueue_head(struct wait_queue_head* wq){
+    INIT_LIST_HEAD(&wq->task_list);
+}
+
+/* 
+ * Put the current task to sleep on the wait queue and run another task
+ * 呼叫前要先 disable interrupt，避免在檢查 condition 和進入 sleep 之間被 wake_up 而錯過 (lost wake-up)
+ */
+void sleep_on(struct wait_queue_head* wq){
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    // Move the current task from the run queue to the wait queue
+    current->state = TASK_WAITING;
+    list_del(&current->list);
+    list_add_tail(&current->list, &wq->task_list);
+
+    // schedule() won't put a waiting task back to the run queue
+    schedule();
+
+    // Woken up by wake_up(), schedule() returns with interrupt disabled
+    disable_irq_in_el1();
+}
+
+/* Move a task sleeping on a wait queue back to the run queue */
+void wake_up_process(struct task_struct* task){
+    list_del(&task->list);
+    task->state = TASK_RUNNING;
+    list_add_tail(&task->list, &rq);
+}
+
+/* Move every task sleeping on the wait queue back to the run queue */
+void wake_up(struct wait_queue_head* wq){
+    struct list_head* pos;
+    struct list_head* tmp;
+
+    list_for_each_safe(pos, tmp, &wq->task_list) {
+        wake_up_process(list_entry(pos, struct task_struct, list));
+    }
+}
+
 /* 
  * The function which the idle task will run
  * When the idle thread is scheduled, it checks if there is any zombie thread : 
@@ -233,32 +288,24 @@ void idle_task_fn(){
                 muart_send_dec(zombie->pid);
                 muart_puts("\r\n");
                 
-                // Free the resoures : free the zombie task's stack
-                if (zombie->kernel_stack) {
-                    dfree(zombie->kernel_stack);
-                }
-
-                if (zombie->user_stack) {
-                    dfree(zombie->user_stack);
-                }
+                // Free the resoures : unmap the zombie task's kernel stack (its watermark is recorded)
+                kstack_free(zombie);
 
-                // Free the zombie task's user program memory
-                if (zombie->user_program) {
-                    muart_puts("  Freeing user program (size: ");
-                    muart_send_dec(zombie->user_program_size);
-                    muart_puts(" bytes)\r\n");
-                    dfree(zombie->user_program);
-                    zombie->user_program = NULL;
-                    zombie->user_program_size = 0;
-                }
+                // The user program and user stack are owned by the page table, unmap every VMA and free their pages
+                exit_mmap(zombie);
+                zombie->user_program = NULL;
+                zombie->user_program_size = 0;
+                zombie->user_stack = NULL;
 
-                
                 // Free the zombie task's page table
                 if (zombie->pgd) {
                     clear_pagetable(zombie->pgd); // Clear the page table
                     dfree(zombie->pgd);
                     zombie->pgd = NULL;
                 }
+
+                // Release the ASID and drop the TLB entries still tagged with it
+                asid_free(zombie);
                 
                 // Free the zombie task's pid
                 pid_free(zombie->pid);
@@ -291,8 +338,7 @@ static void create_idle_task(){
         return;
     }
     
-    idle_task->kernel_stack = dmalloc(THREAD_STACK_SIZE);
-    if (!idle_task->kernel_stack) {
+    if (kstack_alloc(idle_task, 0) != 0) {
         muart_puts("Failed to allocate idle task kernel stack\r\n");
         enable_irq_in_el1();
         return;
@@ -312,9 +358,14 @@ static void create_idle_task(){
     // Initialize user program fields for idle task (not used, but for consistency)
     idle_task->user_program = NULL;
     idle_task->user_program_size = 0;
+    idle_task->pgd = NULL;
+    idle_task->asid = 0;
+    idle_task->futex_key = 0;
+    idle_task->cpu_context.phy_addr_pgd = reserved_ttbr0();    // Never the boot tables, their global entries would leak into user tasks
+    INIT_LIST_HEAD(&idle_task->mmap);
 
     // Set the cpu context of idle task
-    idle_task->cpu_context.sp = (unsigned long)((char*)idle_task->kernel_stack + THREAD_STACK_SIZE);          // Set the stack pointer point to the top of the task's kernel stack
+    idle_task->cpu_context.sp = kstack_top(idle_task);                                                        // Set the stack pointer point to the top of the task's kernel stack
     idle_task->cpu_context.lr = (unsigned long)ret_from_kernel_thread;                                        // Set the link register store the address of ret_from_kernel_thread
     idle_task->cpu_context.x19 = (unsigned long)idle_task_fn;                                                 // Store the function address into the callee-saved register
     INIT_LIST_HEAD(&idle_task->list);
@@ -337,6 +388,12 @@ void sched_init(){
     // Initialize bitmap of PID management
     pid_bitmap_init();
 
+    // Initialize ASID allocation
+    asid_init();
+
+    // Initialize the futex wait queues
+    futex_init();
+
     // Create an idle task
     create_idle_task();
     
@@ -380,7 +437,7 @@ void thread_test(){
 // Get pointer to trap_frame at the top of a task's kernel stack
 struct trap_frame* task_tf(struct task_struct* tsk) {
     // trap frame is stored at the top of the kernel stack
-    unsigned long p = (unsigned long)((char*)tsk->kernel_stack + THREAD_STACK_SIZE - TRAP_FRAME_SIZE);
+    unsigned long p = kstack_top(tsk) - TRAP_FRAME_SIZE;
     return (struct trap_frame*)p;
 }
 
@@ -399,7 +456,7 @@ int move_to_user_mode(unsigned long user_program_addr) {
     muart_puts("\r\n");    
     
     // mapping the VA 0x3c000000 ~ 0x3fffffff in user mode to PA 0x3c000000 ~ 0x3fffffff (identity mapping)
-    if (mappages(current->pgd, PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START, PERIPHERAL_START) != 0) {
+    if (mappages(current->pgd, PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START, PERIPHERAL_START, USER_PTE_ATTR_SHARED) != 0) {
         muart_puts("Error: Failed to map peripheral memory to user virtual address space\r\n");
     }
 
@@ -408,14 +465,13 @@ int move_to_user_mode(unsigned long user_program_addr) {
         - 確保 MMU 使用這個 task 的 user PGD page table 
         - 在 eret 之前載入，這樣 user mode 才能正確 translate VA to PA
     */
+    check_and_switch_context(current);
     unsigned long pgd_pa = current->cpu_context.phy_addr_pgd;
 
-    
+    // TLB entries are tagged with the ASID in TTBR0_EL1, no need to invalidate the whole TLB
     __asm__(
         "dsb ish\n\t"
-        "msr ttbr0_el1, %0\n\t" // Set the TTBR0_EL1 to the PA of the current task's PGD page table 
-        "tlbi vmalle1is\n\t"
-        "dsb ish\n\t"
+        "msr ttbr0_el1, %0\n\t" // Set the TTBR0_EL1 to the PA of the current task's PGD page table and its ASID
         "isb\n\t"
         "msr tpidr_el1, %1\n\t" // Store the current task pointer into TPIDR_EL1
         "msr elr_el1, %2\n\t"   // Store the user function address 0x0 (VA) into elr_el1
@@ -427,7 +483,7 @@ int move_to_user_mode(unsigned long user_program_addr) {
         "r"(current),
         "r"(user_program_addr), 
         "r"(USER_STACK_TOP),
-        "r"(current->kernel_stack + THREAD_STACK_SIZE)
+        "r"(kstack_top(current))
     ); 
 
     return 0;
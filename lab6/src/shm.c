@@ -0,0 +1,144 @@
+#include "shm.h"
+#include "mmap.h"
+#include "vm.h"
+#include "mmu.h"
+#include "sched.h"
+#include "malloc.h"
+#include "mm.h"
+#include "muart.h"
+
+#define LOG_SHM 0
+
+static struct shm_segment shm_segments[SHM_MAX_SEGMENTS];
+
+static struct shm_segment* shm_lookup(int shmid) {
+    if (shmid < 0 || shmid >= SHM_MAX_SEGMENTS || !shm_segments[shmid].used) {
+        return NULL;
+    }
+    return &shm_segments[shmid];
+}
+
+/* Get the segment of key, create it (zero-filled) if it doesn't exist, return the segment id or -1 */
+int shm_get(int key, unsigned long size) {
+    int free_id = -1;
+
+    for (int i = 0; i < SHM_MAX_SEGMENTS; i++) {
+        if (!shm_segments[i].used) {
+            if (free_id < 0) {
+                free_id = i;
+            }
+            continue;
+        }
+        if (key != IPC_PRIVATE && shm_segments[i].key == key) {
+            return (size <= shm_segments[i].size) ? i : -1;
+        }
+    }
+
+    if (free_id < 0 || size == 0 || size > SHM_MAX_SIZE) {
+        return -1;
+    }
+
+    struct shm_segment* shm = &shm_segments[free_id];
+    shm->nr_pages = PAGE_ALIGN(size) / PAGE_SIZE;
+    shm->pages = dmalloc(shm->nr_pages * sizeof(void*));
+    if (!shm->pages) {
+        return -1;
+    }
+
+    // Each page is a separate order-0 allocation so that its reference count lives in its own page_t
+    for (unsigned long i = 0; i < shm->nr_pages; i++) {
+        shm->pages[i] = dmalloc(PAGE_SIZE);
+        if (!shm->pages[i]) {
+            while (i-- > 0) {
+                page_put(shm->pages[i]);
+            }
+            dfree(shm->pages);
+            return -1;
+        }
+        memzero((unsigned long)shm->pages[i], PAGE_SIZE);
+    }
+
+    shm->key = key;
+    shm->size = shm->nr_pages * PAGE_SIZE;
+    shm->used = 1;
+
+    #if LOG_SHM
+    muart_puts("[shm] Created segment ");
+    muart_send_dec(free_id);
+    muart_puts(", ");
+    muart_send_dec(shm->nr_pages);
+    muart_puts(" pages\r\n");
+    #endif
+
+    return free_id;
+}
+
+/* Map the segment into the current task at addr (0 to let the kernel choose), return the address or MAP_FAILED */
+unsigned long shm_attach(int shmid, unsigned long addr) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    struct shm_segment* shm = shm_lookup(shmid);
+    if (!shm) {
+        return MAP_FAILED;
+    }
+
+    unsigned long flags = MAP_SHARED | MAP_ANONYMOUS | MAP_SHM;
+    if (addr) {
+        flags |= MAP_FIXED;
+    }
+    addr = do_mmap(current, addr, shm->size, PROT_READ | PROT_WRITE, flags, NULL, 0, 0);
+    if (addr == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    // Map the segment's page frames, each mapping holds its own reference
+    for (unsigned long i = 0; i < shm->nr_pages; i++) {
+        unsigned long va = addr + i * PAGE_SIZE;
+        if (mappages(current->pgd, va, PAGE_SIZE, VIRT_TO_PHYS(shm->pages[i]), USER_PTE_ATTR_SHM) != 0) {
+            do_munmap(current, addr, shm->size);
+            return MAP_FAILED;
+        }
+        page_get(shm->pages[i]);
+    }
+
+    #if LOG_SHM
+    muart_puts("[shm] pid ");
+    muart_send_dec(current->pid);
+    muart_puts(" attached segment ");
+    muart_send_dec(shmid);
+    muart_puts(" at ");
+    muart_send_hex(addr);
+    muart_puts("\r\n");
+    #endif
+
+    return addr;
+}
+
+/* Unmap the segment attached at addr from the current task, return 0 on success, -1 on failure */
+int shm_detach(unsigned long addr) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    struct vm_area_struct* vma = find_vma(current, addr);
+
+    if (!vma || vma->vm_start != addr || !(vma->vm_flags & MAP_SHM)) {
+        return -1;
+    }
+
+    // unmap_pages() drops the references of the PD_SW_REFCNT pages
+    return do_munmap(current, vma->vm_start, vma->vm_end - vma->vm_start);
+}
+
+/* Remove the segment, its pages are freed once no task maps them any more, return 0 on success, -1 on failure */
+int shm_remove(int shmid) {
+    struct shm_segment* shm = shm_lookup(shmid);
+    if (!shm) {
+        return -1;
+    }
+
+    for (unsigned long i = 0; i < shm->nr_pages; i++) {
+        page_put(shm->pages[i]);
+    }
+    dfree(shm->pages);
+    shm->pages = NULL;
+    shm->used = 0;
+
+    return 0;
+}
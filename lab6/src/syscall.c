@@ -14,6 +14,10 @@
 #include "utils.h"
 #include "vm.h"
 #include "mailbox.h"
+#include "mmap.h"
+#include "shm.h"
+#include "futex.h"
+#include "kstack.h"
 
 
 void syscall_handler(struct trap_frame* tf) {
@@ -47,6 +51,30 @@ void syscall_handler(struct trap_frame* tf) {
         case SYS_KILL:
             sys_kill((int)tf->regs[0]);
             break;
+        case SYS_MMAP:
+            ret = sys_mmap(tf->regs[0], (size_t)tf->regs[1], (int)tf->regs[2], (int)tf->regs[3], (int)tf->regs[4], tf->regs[5]);
+            break;
+        case SYS_MUNMAP:
+            ret = sys_munmap(tf->regs[0], (size_t)tf->regs[1]);
+            break;
+        case SYS_MPROTECT:
+            ret = sys_mprotect(tf->regs[0], (size_t)tf->regs[1], (int)tf->regs[2]);
+            break;
+        case SYS_SHMGET:
+            ret = sys_shmget((int)tf->regs[0], (size_t)tf->regs[1]);
+            break;
+        case SYS_SHMAT:
+            ret = sys_shmat((int)tf->regs[0], tf->regs[1]);
+            break;
+        case SYS_SHMDT:
+            ret = sys_shmdt(tf->regs[0]);
+            break;
+        case SYS_SHMCTL:
+            ret = sys_shmctl((int)tf->regs[0], (int)tf->regs[1]);
+            break;
+        case SYS_FUTEX:
+            ret = sys_futex(tf->regs[0], (int)tf->regs[1], (int)tf->regs[2]);
+            break;
         default:
             muart_puts("Unknown system call\r\n");
             break;
@@ -81,13 +109,15 @@ int sys_exec(const char* name, char *const argv[]) {
     disable_irq_in_el1();
 
     struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    // The name lives in the old user address space, copy it before tearing the address space down
+    char path[EXEC_NAME_MAX];
+    strncpy(path, name, EXEC_NAME_MAX - 1);
+    path[EXEC_NAME_MAX - 1] = '\0';
+    name = path;
     
-    // Clean up current user program
-    if (current->user_program) {
-        dfree(current->user_program);
-        current->user_program = NULL;
-        current->user_program_size = 0;
-    }
+    // Clean up current user program, its pages are owned by the page table
+    exit_mmap(current);
 
     current->user_stack = NULL;
     current->user_program = NULL;
@@ -102,7 +132,7 @@ int sys_exec(const char* name, char *const argv[]) {
     }
     unsigned long new_program_addr = cpio_load_program(initramfs_addr, name);
 
-    if (mappages(current->pgd, PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START, PERIPHERAL_START) != 0) {
+    if (mappages(current->pgd, PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START, PERIPHERAL_START, USER_PTE_ATTR_SHARED) != 0) {
         muart_puts("Error: Failed to map peripheral memory to user virtual address space\r\n");
     }
 
@@ -113,7 +143,7 @@ int sys_exec(const char* name, char *const argv[]) {
     memzero((unsigned long)regs, sizeof(*regs));
     
     // Set new program entry point
-    regs->elr_el1 = USER_CODE_BASE;
+    regs->elr_el1 = new_program_addr;
     regs->sp_el0 = USER_STACK_TOP;  
     regs->spsr_el1 = 0;  // EL0t mode
     
@@ -126,6 +156,16 @@ int sys_exec(const char* name, char *const argv[]) {
     return 0;
 }
 
+/* Undo a fork whose address space couldn't be duplicated, the child has never run and is in no list */
+static void fork_free_child(struct task_struct* child) {
+    exit_mmap(child);
+    clear_pagetable(child->pgd);
+    dfree(child->pgd);
+    kstack_free(child);
+    pid_free(child->pid);
+    dfree(child);
+}
+
 int sys_fork() {
     disable_irq_in_el1();
     
@@ -149,8 +189,8 @@ int sys_fork() {
         return -1;
     }
     
-    child->kernel_stack = dmalloc(THREAD_STACK_SIZE);
-    if (!child->kernel_stack) {
+    // The child's kernel stack has the same size as the parent's
+    if (kstack_alloc(child, parent->kstack_size) != 0) {
         pid_free(child->pid);
         dfree(child);
         muart_puts("fork: Failed to allocate kernel stack\r\n");
@@ -158,71 +198,39 @@ int sys_fork() {
         return -1;
     }
     
-    // Allocate user stack for child
-    child->user_stack = dmalloc(USER_STACK_SIZE);
-    if (!child->user_stack) {
-        dfree(child->kernel_stack);
-        pid_free(child->pid);
-        dfree(child);
-        muart_puts("fork: Failed to allocate user stack\r\n");
-        enable_irq_in_el1();
-        return -1;
-    }
-    memzero((unsigned long)child->user_stack, USER_STACK_SIZE);  // Initialize user stack to zero
+    // The user stack is part of the address space, it is duplicated with the VMAs
+    child->user_stack = NULL;
 
     // Allocate a memory space for the task's user PGD page table
     child->pgd = dmalloc(PAGE_SIZE);
     if (!child->pgd) {
         pid_free(child->pid);
-        dfree(child->kernel_stack);
-        dfree(child->user_stack);
+        kstack_free(child);
         dfree(child);
         enable_irq_in_el1();
         return -1;
     }
     // Initialze the content in PGD to zero
     memzero((unsigned long)child->pgd, PAGE_SIZE);
+    INIT_LIST_HEAD(&child->mmap);
 
-    // Allocate a physical memory space for the user program
+    // Duplicate the user address space (program image, user stack and mmap regions) VMA by VMA,
+    // pages shared from the initramfs stay shared (copy-on-write), private pages are copied into the child's own pages
     child->user_program_size = parent->user_program_size; 
-    child->user_program = dmalloc(child->user_program_size);
-    if (!child->user_program) {
-        pid_free(child->pid);
-        dfree(child->kernel_stack);
-        dfree(child->user_stack);
-        dfree(child);
-        dfree(child->pgd);
+    child->user_program = NULL;     // The child's program pages are owned by its page table
+    if (dup_mmap(child, parent) != 0) {
+        muart_puts("Error: Failed to duplicate the user address space\r\n");
+        fork_free_child(child);
         enable_irq_in_el1();
         return -1;
-    } 
-
-    // Copy the parent's user program data to the child's user program
-    memcpy(child->user_program, parent->user_program, child->user_program_size);
-    
-    // Mapping the physical memory space of the user program to the user virtual address
-    unsigned long user_program_pa = (unsigned long)VIRT_TO_PHYS(child->user_program);
-    if (mappages(child->pgd, USER_CODE_BASE, child->user_program_size, user_program_pa) != 0) {
-        dfree(child->user_program);
-        muart_puts("Error: Failed to map user program to virtual address space\r\n");
-        return 0;
     }
-    
-    // Copy the stack state
-    memcpy(child->kernel_stack, parent->kernel_stack, THREAD_STACK_SIZE);
-    memcpy(child->user_stack, parent->user_stack, USER_STACK_SIZE);
-        
-    // Mapping the user stack to the user virtual address
-    unsigned long user_stack_pa = (unsigned long)VIRT_TO_PHYS(child->user_stack);
-    if (mappages(child->pgd, USER_STACK_BASE, USER_STACK_SIZE, user_stack_pa) != 0) {
-        dfree(child->user_program);
-        muart_puts("Error: Failed to map user stack to virtual address space\r\n");
-        return 0;
-    }
-    
+
     // Mapping the VA 0x3c000000 ~ 0x3fffffff in user mode to 0x3c000000 ~ 0x3fffffff (identity mapping)
-    if (mappages(child->pgd, PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START, PERIPHERAL_START) != 0) {
+    if (mappages(child->pgd, PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START, PERIPHERAL_START, USER_PTE_ATTR_SHARED) != 0) {
         muart_puts("Error: Failed to map peripheral memory to user virtual address space\r\n");
-        return 0;
+        fork_free_child(child);
+        enable_irq_in_el1();
+        return -1;
     }
     child->parent = parent;
     child->state = TASK_RUNNING;
@@ -239,20 +247,20 @@ int sys_fork() {
     child_tf->regs[19] = 0;
     child_tf->regs[20] = 0;
 
-    // Adjust child's SP_EL0 to point to child's user stack with same offset
-    unsigned long parent_sp_offset = parent_tf->sp_el0 - USER_STACK_BASE;
-    child_tf->sp_el0 = USER_STACK_BASE + parent_sp_offset;
-    
            
     // Set the return values
     child_tf->regs[0] = 0;  // Child returns 0
     parent_tf->regs[0] = child->pid;  // Parent returns child PID
     
-    // Set up child's CPU context
+    // Set up child's CPU context, only the trap frame is needed on the child's kernel stack (ret_to_user restores it),
+    // the rest stays poisoned so the child's stack watermark is its own
     memzero((unsigned long)&child->cpu_context, sizeof(struct cpu_context));
+    child->cpu_context.kstack_guard = (unsigned long)child->kernel_stack - KSTACK_GUARD_SIZE;
     child->cpu_context.lr = (unsigned long)ret_to_user; 
     child->cpu_context.sp = (unsigned long)child_tf;
     child->cpu_context.phy_addr_pgd = (unsigned long)VIRT_TO_PHYS(child->pgd);
+    child->asid = 0;    // The child gets its own ASID when it is first scheduled
+    child->futex_key = 0;
 
     
     // Add the child task to the run queue
@@ -318,4 +326,57 @@ void sys_kill(int pid) {
             return;
         }
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Map a region into the user address space, the pages are allocated on the first access (demand paging)
+ * Only anonymous mappings are supported from user space : lab6 has no file descriptors,
+ * file-backed VMAs are created by the kernel (do_mmap with an initramfs file)
+ */
+unsigned long sys_mmap(unsigned long addr, size_t len, int prot, int flags, int fd, unsigned long file_offset) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    if (!(flags & MAP_ANONYMOUS)) {
+        muart_puts("mmap: file-backed mapping requires a file descriptor\r\n");
+        return MAP_FAILED;
+    }
+    // Exactly one of MAP_SHARED / MAP_PRIVATE, the kernel internal flags can't come from user space
+    if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0) || (flags & MAP_SHM)) {
+        return MAP_FAILED;
+    }
+
+    return do_mmap(current, addr, len, prot, flags, NULL, 0, 0);
+}
+
+int sys_munmap(unsigned long addr, size_t len) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    return do_munmap(current, addr, len);
+}
+
+int sys_mprotect(unsigned long addr, size_t len, int prot) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    return do_mprotect(current, addr, len, prot);
+}
+
+int sys_shmget(int key, size_t size) {
+    return shm_get(key, size);
+}
+
+unsigned long sys_shmat(int shmid, unsigned long addr) {
+    return shm_attach(shmid, addr);
+}
+
+int sys_shmdt(unsigned long addr) {
+    return shm_detach(addr);
+}
+
+int sys_shmctl(int shmid, int cmd) {
+    if (cmd != IPC_RMID) {
+        return -1;
+    }
+    return shm_remove(shmid);
+}
+
+int sys_futex(unsigned long uaddr, int op, int val) {
+    return do_futex(uaddr, op, val);
+}
@@ -4,14 +4,63 @@
 #include "types.h"
 #include "muart.h"
 #include "mm.h"
+#include "sched.h"
+#include "exception.h"
+#include "mmap.h"
+#include "asid.h"
 
 #define LOG_VM 0 
 
+extern buddy_system_t buddy;
+
+/* 2MB block descriptor -> attributes of the 4KB page descriptors covering the same range */
+#define BLOCK_TO_PAGE_ATTR(desc)    (((desc) & ~PHY_ADDR_MASK & ~PD_TYPE_MASK) | PD_TABLE)
+
 /**
- * Walk the page table to find the PTE entry for a given virtual address
- * Returns pointer to the PTE entry
+ * Split a 2MB block mapping into a PTE table of 512 pages with the same attributes
+ * A block owned by the page table is an order-9 buddy allocation, it becomes 512 order-0 allocations
+ * so that the pages can later be freed one by one
  */
-unsigned long* walk(unsigned long* pagetable, unsigned long va) {
+int split_huge_pmd(unsigned long* pmd, unsigned long va) {
+    if (!PD_IS_BLOCK(*pmd)) {
+        return 0;
+    }
+
+    unsigned long* table = (unsigned long*)dmalloc(PAGE_SIZE);
+    if (!table) {
+        return -1;
+    }
+
+    unsigned long pa = *pmd & PHY_ADDR_MASK;
+    unsigned long attr = BLOCK_TO_PAGE_ATTR(*pmd);
+    for (int i = 0; i < 512; i++) {
+        table[i] = (pa + i * PAGE_SIZE) | attr;
+    }
+
+    if (!(*pmd & PD_SW_SHARED)) {
+        buddy_split_allocation(&buddy, (void*)PHYS_TO_VIRT(pa));
+    }
+
+    // Break-before-make : invalidate the block before installing the table
+    *pmd = 0;
+    flush_tlb_page(va);
+    *pmd = VIRT_TO_PHYS(table) | USER_TABLE_ATTR;
+
+    #if LOG_VM
+    muart_puts("Split huge page at VA: ");
+    muart_send_hex(va & ~(BLOCK_SIZE_2MB - 1));
+    muart_puts("\r\n");
+    #endif
+
+    return 0;
+}
+
+/**
+ * Walk the page table to find the entry of a given virtual address at leaf_level (2=PMD, 3=PTE)
+ * Missing tables are allocated, a 2MB block in the way of a PTE lookup is split
+ * Returns pointer to the entry
+ */
+static unsigned long* walk_level(unsigned long* pagetable, unsigned long va, int leaf_level) {
     // Start from PGD (level 0)
     unsigned long* current_table = pagetable;
 
@@ -25,7 +74,7 @@ unsigned long* walk(unsigned long* pagetable, unsigned long va) {
     #endif
 
     // Walk through level 0 PGD -> level 1 PUD -> level 2 PMD
-    for (int level = 0; level < 3; level++) {
+    for (int level = 0; level < leaf_level; level++) {
         unsigned long idx;
         
         // Get index for current level
@@ -54,6 +103,10 @@ unsigned long* walk(unsigned long* pagetable, unsigned long va) {
         
         // If Bits[0] already set, it means the entry is valid, 代表這個 entry 有指向 page table 或是 page frame
         if (*pte & PD_VALID) {
+            // A 2MB block maps this address, split it to reach the PTE
+            if (level == 2 && PD_IS_BLOCK(*pte) && split_huge_pmd(pte, va) != 0) {
+                return NULL;
+            }
             unsigned long next_table_pa = *pte & PHY_ADDR_MASK;  // Get the physical address Bits[47:12] of this page table entry (clear lower 12 bits for paged aligned)
             current_table = (unsigned long*)PHYS_TO_VIRT(next_table_pa);  // Translate to  kernel VA
             
@@ -87,8 +140,8 @@ unsigned long* walk(unsigned long* pagetable, unsigned long va) {
         }
     }
     
-    // At PTE level, retrun PTE page table entry 的 pointer
-    unsigned long pte_idx = PTE_IDX(va);
+    // At leaf level, retrun PTE (or PMD) page table entry 的 pointer
+    unsigned long pte_idx = (leaf_level == 2) ? PMD_IDX(va) : PTE_IDX(va);
     #if LOG_VM
     muart_puts("Final PTE index: ");
     muart_send_hex(pte_idx);
@@ -97,6 +150,50 @@ unsigned long* walk(unsigned long* pagetable, unsigned long va) {
     return &current_table[pte_idx];
 }
 
+/**
+ * Walk the page table to find the PTE entry for a given virtual address
+ * Returns pointer to the PTE entry
+ */
+unsigned long* walk(unsigned long* pagetable, unsigned long va) {
+    return walk_level(pagetable, va, 3);
+}
+
+/* Walk the page table to the PMD entry of a given virtual address (where a 2MB block can be placed) */
+unsigned long* walk_pmd(unsigned long* pagetable, unsigned long va) {
+    return walk_level(pagetable, va, 2);
+}
+
+/**
+ * Look up the PMD entry of a virtual address without allocating missing page tables
+ * Returns NULL if the PGD / PUD entry on the path does not exist
+ */
+unsigned long* lookup_pmd(unsigned long* pagetable, unsigned long va) {
+    unsigned long* current_table = pagetable;
+    unsigned long idx[2] = { PGD_IDX(va), PUD_IDX(va) };
+
+    for (int level = 0; level < 2; level++) {
+        unsigned long pte = current_table[idx[level]];
+        if (!(pte & PD_VALID)) {
+            return NULL;
+        }
+        current_table = (unsigned long*)PHYS_TO_VIRT(pte & PHY_ADDR_MASK);
+    }
+    return &current_table[PMD_IDX(va)];
+}
+
+/**
+ * Look up the PTE of a virtual address without allocating missing page tables
+ * Returns NULL if one of the tables on the path does not exist or the address is mapped by a 2MB block
+ */
+unsigned long* lookup_pte(unsigned long* pagetable, unsigned long va) {
+    unsigned long* pmd = lookup_pmd(pagetable, va);
+    if (!pmd || !(*pmd & PD_VALID) || PD_IS_BLOCK(*pmd)) {
+        return NULL;
+    }
+    unsigned long* pte_table = (unsigned long*)PHYS_TO_VIRT(*pmd & PHY_ADDR_MASK);
+    return &pte_table[PTE_IDX(va)];
+}
+
 /**
  * Map a range of virtual addresses to physical addresses
  * 
@@ -104,9 +201,10 @@ unsigned long* walk(unsigned long* pagetable, unsigned long va) {
  * @param va: Starting virtual address
  * @param size: Size to map
  * @param pa: Starting physical address
+ * @param attr: Attributes of the page descriptors (e.g. USER_PTE_ATTR)
  * @return: 0 on success, -1 on failure
  */
-int mappages(unsigned long* pagetable, unsigned long va, unsigned long size, unsigned long pa) {
+int mappages(unsigned long* pagetable, unsigned long va, unsigned long size, unsigned long pa, unsigned long attr) {
     if (!pagetable) {
         return -1;
     }
@@ -120,6 +218,21 @@ int mappages(unsigned long* pagetable, unsigned long va, unsigned long size, uns
     
     // Map each page in the range
     while (current_va < end_va) {
+        // VA and PA 2MB-aligned and at least 2MB left : use a PMD block entry instead of 512 PTEs
+        if (((current_va | current_pa) & (BLOCK_SIZE_2MB - 1)) == 0 && end_va - current_va >= BLOCK_SIZE_2MB) {
+            unsigned long* pmd = walk_pmd(pagetable, current_va);
+            if (!pmd) {
+                return -1;
+            }
+            if (!(*pmd & PD_VALID) || PD_IS_BLOCK(*pmd)) {
+                *pmd = current_pa | (attr & ~PD_TYPE_MASK) | PD_BLOCK;
+                current_va += BLOCK_SIZE_2MB;
+                current_pa += BLOCK_SIZE_2MB;
+                continue;
+            }
+            // A PTE table already exists for this 2MB, fall back to 4KB pages
+        }
+
         // Walk the page table to find the PTE for a given virtual address,  allocate if no page table exists
         unsigned long* pte = walk(pagetable, current_va);
         if (!pte) { // pte not found
@@ -127,7 +240,7 @@ int mappages(unsigned long* pagetable, unsigned long va, unsigned long size, uns
         }
         
         // Create PTE entry, combine physical address with attributes
-        *pte = current_pa | USER_PTE_ATTR;
+        *pte = current_pa | attr;
         
         current_va += PAGE_SIZE;
         current_pa += PAGE_SIZE;
@@ -164,7 +277,7 @@ static int clear_pagetable_recursive(unsigned long* pagetable, int level) {
             continue;
         }
         
-        if (level < 3) {
+        if (level < 3 && !PD_IS_BLOCK(*pte)) {
             // Not at PTE level - recurse to next level
             unsigned long next_table_pa = *pte & PHY_ADDR_MASK;
             unsigned long* next_table = (unsigned long*)PHYS_TO_VIRT(next_table_pa);
@@ -190,8 +303,13 @@ static int clear_pagetable_recursive(unsigned long* pagetable, int level) {
             #endif
             dfree((void*)next_table);
             
+        } else if (*pte & PD_SW_SHARED) {
+            // The page frame is not owned by this page table (initramfs, peripherals), only drop the mapping
+        } else if (*pte & PD_SW_REFCNT) {
+            // Shared memory page : other tasks may still map it, it is freed with the last reference
+            page_put((void*)PHYS_TO_VIRT(*pte & PHY_ADDR_MASK));
         } else {
-            // At PTE level - free physical pages
+            // At PTE level (or a 2MB block at PMD level) - free physical pages
             unsigned long pa = *pte & PHY_ADDR_MASK;
             void* va = (void*)PHYS_TO_VIRT(pa);
             
@@ -238,4 +356,200 @@ int clear_pagetable(unsigned long* pagetable) {
     int result = clear_pagetable_recursive(pagetable, 0);
 
     return result;
-}
\ No newline at end of file
+}
+
+/* Invalidate the TLB entry of a single user virtual address of the current address space after its PTE has been changed */
+void flush_tlb_page(unsigned long va) {
+    // Xt[63:48] ASID, Xt[43:0] VA[55:12]
+    unsigned long arg = (current_asid() << TTBR_ASID_SHIFT) | ((va >> PAGE_SHIFT) & ((1UL << 44) - 1));
+    __asm__ volatile(
+        "dsb ishst\n\t"         // ensure the PTE update is visible to the table walker
+        "tlbi vae1is, %0\n\t"   // invalidate the entry of this VA tagged with this ASID
+        "dsb ish\n\t"
+        "isb\n\t"
+        :: "r"(arg)
+    );
+}
+
+/**
+ * Duplicate the mappings of [va, va + size) from src to dst (used by fork)
+ * Pages marked PD_SW_SHARED (initramfs text, peripherals) are mapped again with the same attributes,
+ * shared memory pages (PD_SW_REFCNT) are mapped again and get one more reference,
+ * the others are copied into newly allocated pages
+ * @return: 0 on success, -1 on failure
+ */
+int copy_user_pages(unsigned long* dst, unsigned long* src, unsigned long va, unsigned long size) {
+    unsigned long end_va = va + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    for (unsigned long current_va = va; current_va < end_va; current_va += PAGE_SIZE) {
+        unsigned long* src_pmd = lookup_pmd(src, current_va);
+        if (src_pmd && PD_IS_BLOCK(*src_pmd)) {
+            unsigned long pa = *src_pmd & PHY_ADDR_MASK;
+            unsigned long attr = BLOCK_TO_PAGE_ATTR(*src_pmd);
+
+            // The whole 2MB block is in the range : share it or copy it into a new huge page
+            if ((current_va & (BLOCK_SIZE_2MB - 1)) == 0 && end_va - current_va >= BLOCK_SIZE_2MB) {
+                void* huge = NULL;
+                if (!(attr & PD_SW_SHARED)) {
+                    huge = buddy_alloc_pages(&buddy, HUGE_PAGE_ORDER);
+                    if (huge) {
+                        memcpy(huge, (void*)PHYS_TO_VIRT(pa), BLOCK_SIZE_2MB);
+                        pa = VIRT_TO_PHYS(huge);
+                    }
+                }
+                if ((attr & PD_SW_SHARED) || huge) {
+                    if (mappages(dst, current_va, BLOCK_SIZE_2MB, pa, attr) != 0) {
+                        return -1;
+                    }
+                    current_va += BLOCK_SIZE_2MB - PAGE_SIZE;
+                    continue;
+                }
+            }
+
+            // Partial range or no free huge page : fall back to copying 4KB pages
+            if (split_huge_pmd(src_pmd, current_va) != 0) {
+                return -1;
+            }
+        }
+
+        unsigned long* src_pte = lookup_pte(src, current_va);
+        if (!src_pte || !(*src_pte & PD_VALID)) {
+            continue;   // Not mapped in the parent
+        }
+
+        unsigned long pa = *src_pte & PHY_ADDR_MASK;
+        unsigned long attr = *src_pte & ~PHY_ADDR_MASK;
+
+        if (attr & PD_SW_REFCNT) {
+            page_get((void*)PHYS_TO_VIRT(pa));
+        }
+        else if (!(attr & PD_SW_SHARED)) {
+            void* page = dmalloc(PAGE_SIZE);
+            if (!page) {
+                return -1;
+            }
+            memcpy(page, (void*)PHYS_TO_VIRT(pa), PAGE_SIZE);
+            pa = VIRT_TO_PHYS(page);
+        }
+
+        if (mappages(dst, current_va, PAGE_SIZE, pa, attr) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Remove the mappings of [va, va + size) and free the page frames owned by the page table
+ * Page tables themselves are kept, they are freed by clear_pagetable()
+ */
+void unmap_pages(unsigned long* pagetable, unsigned long va, unsigned long size) {
+    unsigned long end_va = va + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    for (unsigned long current_va = va; current_va < end_va; current_va += PAGE_SIZE) {
+        unsigned long* pmd = lookup_pmd(pagetable, current_va);
+        if (pmd && PD_IS_BLOCK(*pmd)) {
+            if ((current_va & (BLOCK_SIZE_2MB - 1)) == 0 && end_va - current_va >= BLOCK_SIZE_2MB) {
+                // The whole 2MB block goes away
+                if (!(*pmd & PD_SW_SHARED)) {
+                    dfree((void*)PHYS_TO_VIRT(*pmd & PHY_ADDR_MASK));
+                }
+                *pmd = 0;
+                flush_tlb_page(current_va);
+                current_va += BLOCK_SIZE_2MB - PAGE_SIZE;
+                continue;
+            }
+            if (split_huge_pmd(pmd, current_va) != 0) {
+                continue;
+            }
+        }
+
+        unsigned long* pte = lookup_pte(pagetable, current_va);
+        if (!pte || !(*pte & PD_VALID)) {
+            continue;
+        }
+        if (*pte & PD_SW_REFCNT) {
+            page_put((void*)PHYS_TO_VIRT(*pte & PHY_ADDR_MASK));
+        }
+        else if (!(*pte & PD_SW_SHARED)) {
+            dfree((void*)PHYS_TO_VIRT(*pte & PHY_ADDR_MASK));
+        }
+        *pte = 0;
+        flush_tlb_page(current_va);
+    }
+}
+
+/* Break the sharing of a copy-on-write page: give the task its own writable copy */
+static int do_cow_fault(unsigned long* pagetable, unsigned long va) {
+    unsigned long* pte = walk(pagetable, va);
+    if (!pte || !(*pte & PD_VALID) || !(*pte & PD_SW_COW)) {
+        return -1;
+    }
+
+    void* page = dmalloc(PAGE_SIZE);
+    if (!page) {
+        return -1;
+    }
+
+    unsigned long old_pa = *pte & PHY_ADDR_MASK;
+    memcpy(page, (void*)PHYS_TO_VIRT(old_pa), PAGE_SIZE);
+
+    // Keep the other attributes, the new page is private and writable
+    unsigned long attr = *pte & ~PHY_ADDR_MASK & ~(PD_READONLY | PD_SW_COW | PD_SW_SHARED);
+    *pte = VIRT_TO_PHYS(page) | attr;
+    flush_tlb_page(va);
+
+    #if LOG_VM
+    muart_puts("COW fault at VA: ");
+    muart_send_hex(va);
+    muart_puts(", copied PA ");
+    muart_send_hex(old_pa);
+    muart_puts(" to PA ");
+    muart_send_hex(VIRT_TO_PHYS(page));
+    muart_puts("\r\n");
+    #endif
+
+    return 0;
+}
+
+/*
+ * Handle an instruction / data abort taken from EL0, or a kernel data abort on a user address
+ * Called from el0_sync / el1_sync in exception.S, the task is terminated if the fault can't be resolved
+ */
+void do_page_fault(unsigned long far, unsigned long esr, struct trap_frame* tf) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    unsigned long ec = (esr >> ESR_ELx_EC_SHIFT) & ESR_ELx_EC_MASK;
+    unsigned long fsc = esr & ESR_ELx_FSC_TYPE;
+    unsigned long va = far & ~(PAGE_SIZE - 1);
+
+    // A fault just below the user stack grows the stack VMA
+    struct vm_area_struct* vma = find_extend_vma(current, far);
+
+    // Write to a read-only page of a writable region: copy-on-write
+    // The kernel writing into a user buffer (ESR_ELx_EC_DABT_CUR) copies the page the same way
+    if ((ec == ESR_ELx_EC_DABT_LOW || ec == ESR_ELx_EC_DABT_CUR) && fsc == ESR_ELx_FSC_PERM && (esr & ESR_ELx_WNR) && (!vma || (vma->vm_prot & PROT_WRITE))) {
+        if (do_cow_fault(current->pgd, va) == 0) {
+            return;
+        }
+    }
+
+    // Page not present yet: demand paging inside a VMA
+    if (fsc == ESR_ELx_FSC_FAULT && vma && vma_access_ok(vma, esr)) {
+        if (handle_mm_fault(current, vma, va) == 0) {
+            return;
+        }
+    }
+
+    muart_puts("[Segmentation fault] pid ");
+    muart_send_dec(current->pid);
+    muart_puts(", FAR: ");
+    muart_send_hex(far);
+    muart_puts(", ESR: ");
+    muart_send_hex(esr);
+    muart_puts(", ELR: ");
+    muart_send_hex(tf->elr_el1);
+    muart_puts("\r\n");
+
+    thread_exit();
+}
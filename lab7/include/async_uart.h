@@ -12,12 +12,27 @@
 /* Initialize asynchronous UART with interrupt support */
 void async_uart_init(void);
 
+/* Enable the mini UART interrupt for transmitting only (RX is still read by polling) */
+void async_uart_tx_init(void);
+
+/* Free space in the Transmit Buffer */
+size_t async_uart_tx_space(void);
+
+/* Transmit everything left in the TX buffer by polling */
+void async_uart_flush_sync(void);
+
 /* Non-blocking read : Read the data from the Receive Buffer */
 size_t async_uart_read(char* buffer, size_t size);
 
 /* Non-blocking write : Write the data into the Transmit Buffer */ 
 size_t async_uart_write(const char* buffer, size_t size);
 
+/* Blocking read : sleep until some data is received, return a short count if less than size bytes are buffered */
+long async_uart_read_wait(char* buffer, size_t size);
+
+/* Blocking write : sleep while the Transmit Buffer is full, return size unless interrupted by a signal */
+long async_uart_write_wait(const char* buffer, size_t size);
+
 /* Non-blocking puts for strings */
 size_t async_uart_puts(const char* str);
 
@@ -2,15 +2,93 @@
 #define _BOOTLOADER_H
 
 #define KERNEL_LOAD_ADDR    0x80000
+#define INITRAMFS_LOAD_ADDR 0x20000000  // Same as the default of set_initramfs_address, far from the kernel and the buddy system
+#define INITRAMFS_MAX       0x4000000   // 64MB
+#define DTB_LOAD_ADDR       (INITRAMFS_LOAD_ADDR + INITRAMFS_MAX)
+#define DTB_MAX             0x100000    // Including room for the properties added by the bootloader
 #define BOOT_SIGNATURE      0x544F4F42  // "BOOT" in ASCII (little endian)
 
+/*
+ *********** UART boot protocol (send_kernel.py <-> bootloader) ***********
+ * 1. Host sends header_t (resent until answered), bootloader answers BOOT_RESP_HDR_OK / BOOT_RESP_HDR_BAD
+ * 2. Host streams the image in frames of block_size bytes, up to a window of frames ahead of the last ACK
+ *      | sync 0x5A 0xA5 | seq (2) | len (2) | payload (len) | CRC32 of seq, len and payload (4) |
+ *    Bootloader only accepts the frame it expects (go-back-N) :
+ *      BOOT_RESP_ACK  seq : every frame before seq is received (cumulative)
+ *      BOOT_RESP_NAK  seq : bad CRC or a lost frame, resend from seq
+ *    Host resends from the last ACK when nothing is answered for a while
+ * 3. After the last frame, the image is decompressed (BOOT_FLAG_LZ4) and checked against the CRC32 of the header,
+ *    bootloader answers BOOT_RESP_DONE, or BOOT_RESP_FAIL and waits for a new header
+ * 4. Without BOOT_FLAG_MORE the bootloader jumps to the kernel, otherwise it waits for the header of the next payload
+ *
+ * Payloads (header.type), each one has its own load address so they can be sent in any order :
+ *      BOOT_PAYLOAD_KERNEL     at KERNEL_LOAD_ADDR, required before the last payload
+ *      BOOT_PAYLOAD_INITRAMFS  at INITRAMFS_LOAD_ADDR, linux,initrd-start / end of /chosen are set to it
+ *      BOOT_PAYLOAD_DTB        at DTB_LOAD_ADDR, replaces the device tree from the firmware
+ * When an initramfs or a device tree is received, the kernel gets the device tree copied at DTB_LOAD_ADDR,
+ * with the initrd of the firmware kept if no initramfs was sent
+ * A payload which fails can be sent again, the ones received before are kept
+ *
+ * Baud rate negotiation, before the header (the bootloader always starts at BOOT_DEFAULT_BAUD) :
+ * 1. Host sends baud_req_t, bootloader answers BOOT_RESP_BAUD_BAD (rate not reachable) or BOOT_RESP_BAUD_OK 0,
+ *    then both sides switch to the new rate
+ * 2. Host sends BOOT_BAUD_TEST_LEN bytes 0x00, 0x01, ... 0xFF, bootloader answers BOOT_RESP_BAUD_OK 1 if they all arrived intact
+ * 3. Host confirms with BOOT_RESP_BAUD_OK 2 (same 4-byte format)
+ *    If the pattern or the confirmation doesn't arrive within BOOT_BAUD_TIMEOUT_MS, the bootloader goes back to
+ *    BOOT_DEFAULT_BAUD (and answers BOOT_RESP_BAUD_BAD there if the pattern was wrong)
+ * During the transfer, a frame with seq BOOT_SEQ_ABORT and no payload makes the bootloader answer BOOT_RESP_FAIL,
+ * go back to BOOT_DEFAULT_BAUD and wait for a new request, the host uses it to retry at a lower rate
+ *
+ * Every response is 4 bytes : code, seq low, seq high, code ^ seq low ^ seq high
+ * The codes are >= 0xF0 so the host can tell them apart from the ASCII messages of the bootloader
+ * All fields are little endian
+ */
+#define BOOT_FLAG_LZ4           0x1         // The image is LZ4 block compressed
+#define BOOT_FLAG_MORE          0x2         // Another payload follows this one
+
+#define BOOT_PAYLOAD_KERNEL     0
+#define BOOT_PAYLOAD_INITRAMFS  1
+#define BOOT_PAYLOAD_DTB        2
+#define BOOT_PAYLOAD_NUM        3
+
+#define BOOT_BLOCK_SIZE_MAX     4096
+#define BOOT_FRAME_SYNC0        0x5A
+#define BOOT_FRAME_SYNC1        0xA5
+
+#define BOOT_RESP_ACK           0xF1
+#define BOOT_RESP_NAK           0xF2
+#define BOOT_RESP_HDR_OK        0xF3
+#define BOOT_RESP_HDR_BAD       0xF4
+#define BOOT_RESP_DONE          0xF5
+#define BOOT_RESP_FAIL          0xF6
+#define BOOT_RESP_BAUD_OK       0xF7
+#define BOOT_RESP_BAUD_BAD      0xF8
+
+#define BOOT_SEQ_ABORT          0xFFFF      // Seqs are 16 bits, a payload has at most BOOT_SEQ_ABORT blocks (0 ~ 0xFFFE)
+
+#define BOOT_BAUD_SIGNATURE     0x44554142  // "BAUD" in ASCII (little endian)
+#define BOOT_DEFAULT_BAUD       115200
+#define BOOT_BAUD_TEST_LEN      256
+#define BOOT_BAUD_TIMEOUT_MS    1000
+
 typedef struct header_t{
-    unsigned int signature;    // 0x544F4F42
-    unsigned int size;         // Kernel size in bytes
-    unsigned int checksum;     // For verification
+    unsigned int signature;     // 0x544F4F42
+    unsigned int size;          // Bytes transmitted (compressed size if BOOT_FLAG_LZ4)
+    unsigned int checksum;      // CRC32 of the image (after decompression)
+    unsigned int raw_size;      // Image size in bytes (after decompression)
+    unsigned short block_size;  // Payload bytes per frame
+    unsigned char flags;        // BOOT_FLAG_*
+    unsigned char type;         // BOOT_PAYLOAD_*
+    unsigned int header_crc;    // CRC32 of the fields above
 } header_t;
 
+typedef struct baud_req_t{
+    unsigned int signature;     // 0x44554142
+    unsigned int baud;          // Requested baud rate
+    unsigned int crc;           // CRC32 of the fields above
+} baud_req_t;
+
 
 void bootloader_main();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,40 @@
+#ifndef _CHARDEV_H
+#define _CHARDEV_H
+
+#include "types.h"
+
+/*
+ * Character device used as the kernel console (mini UART or PL011)
+ * The console and the uart system calls only go through these operations, so the UART behind them can be swapped
+ */
+struct char_device {
+    const char* name;
+
+    /* Take over the pins and enable the interrupt-driven TX path */
+    void (*init)(void);
+
+    /* Non-blocking write into the TX buffer, return the bytes accepted */
+    size_t (*write)(const char* buf, size_t size);
+
+    /* Free space in the TX buffer */
+    size_t (*tx_space)(void);
+
+    /* Blocking read / write for the uartread / uartwrite system calls, -1 if interrupted by a signal */
+    long (*read_wait)(char* buf, size_t size);
+    long (*write_wait)(const char* buf, size_t size);
+
+    /* Polling I/O, usable with interrupts disabled (shell input, panic) */
+    size_t (*write_sync)(const char* buf, size_t size);
+    char (*getc_sync)(void);
+
+    /* Transmit everything left in the TX buffer by polling */
+    void (*flush_sync)(void);
+};
+
+/* Mini UART (async_uart.c) */
+extern struct char_device muart_device;
+
+/* PL011 UART (pl011.c) */
+extern struct char_device pl011_device;
+
+#endif
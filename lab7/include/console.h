@@ -0,0 +1,25 @@
+#ifndef _CONSOLE_H
+#define _CONSOLE_H
+
+/*
+ * Kernel console : muart_puts / muart_send_hex / muart_send_dec are copied into the TX ring of the console device
+ * (mini UART, or PL011 with `make CONSOLE=pl011`) and transmitted by interrupts / DMA, printing no longer waits for the UART
+ * When the ring is full the rest of the message is dropped and counted, a "[N bytes dropped]" mark replaces it
+ *
+ * Until console_init() everything is printed by polling the mini UART, whatever CONSOLE is : the PL011 needs its clock
+ * set through the mailbox and its IRQ from the device tree first, so with CONSOLE=pl011 the early boot log is only on
+ * the mini UART pins (GPIO 14 / 15 with ALT5) and the console moves to the PL011 (same pins, ALT0) at console_init()
+ */
+
+struct char_device;
+
+/* The UART behind the console, also used by the uartread / uartwrite system calls */
+struct char_device* console_device(void);
+
+/* Switch the kernel output from polling to the TX ring */
+void console_init(void);
+
+/* Flush the ring by polling and go back to polling, the interrupts may never come again (nothing to do before console_init()) */
+void console_panic(void);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include "types.h"
+
+/*
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320), the same value as Python's zlib.crc32()
+ * The running state starts at CRC32_INIT and is inverted at the end :
+ *     crc = CRC32_INIT; crc = crc32_update(crc, buf, len); ...; value = crc32_final(crc);
+ */
+#define CRC32_INIT          0xFFFFFFFF
+#define crc32_final(crc)    (~(crc))
+
+extern unsigned int crc32_table[256];
+
+/* Build crc32_table, must be called once before anything else (the bootloader's .bss is not cleared) */
+void crc32_init(void);
+
+/* Feed one byte into the running state */
+static inline unsigned int crc32_byte(unsigned int crc, unsigned char c) {
+    return crc32_table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+}
+
+/* Feed len bytes into the running state */
+unsigned int crc32_update(unsigned int crc, const void* buf, size_t len);
+
+/* CRC-32 of a whole buffer */
+unsigned int crc32(const void* buf, size_t len);
+
+#endif
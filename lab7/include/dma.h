@@ -0,0 +1,74 @@
+#ifndef _DMA_H
+#define _DMA_H
+
+#include "registers.h"
+#include "irq.h"
+
+/*
+ ****************************
+ *      BCM2837 DMA engine  *
+ ****************************
+ * A channel fetches a control block (CB) from memory and copies TXFR_LEN bytes from SOURCE_AD to DEST_AD,
+ * every address in the CB is a VideoCore bus address, not an ARM physical address
+ * The engine always moves 32-bit words (or 128-bit bursts), there is no byte-wide transfer
+ */
+
+/* Transfer Information (TI) bits of a control block */
+#define DMA_TI_INTEN            (1 << 0)    // Interrupt when the transfer is done
+#define DMA_TI_WAIT_RESP        (1 << 3)    // Wait for the write response before the next write
+#define DMA_TI_DEST_INC         (1 << 4)
+#define DMA_TI_DEST_DREQ        (1 << 6)    // Pace the writes with the DREQ of the peripheral
+#define DMA_TI_SRC_INC          (1 << 8)
+#define DMA_TI_SRC_DREQ         (1 << 10)   // Pace the reads with the DREQ of the peripheral
+#define DMA_TI_PERMAP(p)        ((p) << 16) // Peripheral whose DREQ is used
+#define DMA_TI_NO_WIDE_BURSTS   (1 << 26)
+
+/* Peripheral DREQ numbers (PERMAP) */
+#define DMA_DREQ_UART_TX        12
+#define DMA_DREQ_UART_RX        14
+
+/* CS register bits */
+#define DMA_CS_ACTIVE           (1 << 0)
+#define DMA_CS_END              (1 << 1)    // Write 1 to clear
+#define DMA_CS_INT              (1 << 2)    // Write 1 to clear
+#define DMA_CS_ERROR            (1 << 8)
+#define DMA_CS_RESET            (1 << 31)
+
+/* Each channel raises GPU IRQ 16 + ch unless the device tree says otherwise, see dma_channel_irq() */
+#define DMA_DEFAULT_IRQ(ch)     IRQ_GPU(16 + (ch))
+
+/*
+ * ARM physical address -> bus address seen by the DMA engine
+ * RAM goes through the 0xC0000000 alias (L2 uncached), peripherals are at 0x7E000000 on the bus
+ * The MMU is off here, so the CPU doesn't cache data either and no cache maintenance is needed
+ */
+#define DMA_BUS_ADDR(pa)        ((unsigned int)((unsigned long)(pa) | 0xC0000000))
+#define DMA_BUS_PERIPHERAL(pa)  ((unsigned int)((unsigned long)(pa) - MMIO_BASE + 0x7E000000))
+
+/* Control block, must be 32-byte aligned */
+struct dma_cb {
+    unsigned int ti;            // Transfer information
+    unsigned int source_ad;     // Source bus address
+    unsigned int dest_ad;       // Destination bus address
+    unsigned int txfr_len;      // Length in bytes
+    unsigned int stride;        // 2D mode only
+    unsigned int nextconbk;     // Bus address of the next CB, 0 : stop after this one
+    unsigned int reserved[2];
+} __attribute__((aligned(32)));
+
+/* Reset the channel and set its global enable bit */
+void dma_init_channel(int ch);
+
+/* Start the transfer described by cb on the channel, the channel must be idle */
+void dma_start(int ch, volatile struct dma_cb* cb);
+
+/* 1 while the channel is still transferring */
+int dma_busy(int ch);
+
+/* Acknowledge the END / INT of a finished transfer, return -1 if the channel stopped on an error */
+int dma_ack(int ch);
+
+/* Linear IRQ number of a channel (the interrupts of the DMA node are listed by channel) */
+int dma_channel_irq(int ch);
+
+#endif
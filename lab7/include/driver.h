@@ -0,0 +1,65 @@
+#ifndef _DRIVER_H
+#define _DRIVER_H
+
+#include "fdt_cache.h"
+
+/*
+ ****************************
+ *       Driver model       *
+ ****************************
+ * A driver lists the compatible strings it supports, driver_probe_all() calls its probe() for every
+ * enabled node of the device tree matching one of them, with reg translated to an ARM physical address
+ * and the first interrupt translated to a linear IRQ number (see irq.h)
+ * When the device tree has no such node, probe() is called once with the default resources of the driver
+ */
+
+/* Print log message */
+#define LOG_DRIVER 0
+
+#define FDT_BAD_ADDR            (~0UL)
+
+struct device{
+    const char* name;               // Name of the node, or of the driver with the default resources
+    fdt_node_t* node;               // NULL with the default resources
+    unsigned long base;             // First reg range, ARM physical address
+    unsigned long size;
+    int irq;                        // First interrupt, -1 if the device has none
+};
+
+struct driver{
+    const char* name;
+    const char* const* compatible;  // NULL-terminated list
+    int (*probe)(struct device* dev);
+
+    // Resources used without a matching node
+    unsigned long default_base;
+    unsigned long default_size;
+    int default_irq;
+};
+
+/* Drivers probed by driver_probe_all(), in this order (the interrupt controllers first) */
+extern struct driver local_intc_driver;
+extern struct driver armctrl_driver;
+extern struct driver arm_timer_driver;
+extern struct driver dma_driver;
+extern struct driver muart_driver;
+extern struct driver pl011_driver;
+extern struct driver mailbox_driver;
+
+/**
+ * Probe every driver against the unflattened device tree
+ *
+ * @return Number of devices whose probe() failed
+ */
+int driver_probe_all(void);
+
+/* Translate an address of the bus of node through the ranges of its ancestors, FDT_BAD_ADDR if it is not mapped */
+unsigned long fdt_translate_address(const fdt_node_t* node, unsigned long addr);
+
+/* Linear IRQ number of the index-th interrupt of a node, -1 if there is none or its controller is unknown */
+int fdt_node_get_irq(const fdt_node_t* node, unsigned int index);
+
+/* Linear IRQ number of the index-th interrupt of a device, the default IRQ is the only one without a node */
+int device_get_irq(const struct device* dev, unsigned int index);
+
+#endif
@@ -51,6 +51,21 @@ extern unsigned long get_current_el(void);
 extern void enable_irq_in_el1(void);
 extern void disable_irq_in_el1(void);
 
+/* 
+ * Disable interrupts and return the previous DAIF, for code that may be called with interrupts either enabled or disabled
+ * (enable_irq_in_el1() would enable them even if the caller had disabled them)
+ */
+static inline unsigned long irq_save(void) {
+    unsigned long flags;
+    __asm__ volatile("mrs %0, daif\n\tmsr daifset, #0xf" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+/* Restore the DAIF returned by irq_save() */
+static inline void irq_restore(unsigned long flags) {
+    __asm__ volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
 /* Entry point of return the system call */
 void ret_from_syscall(void);
 
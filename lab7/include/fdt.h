@@ -1,6 +1,8 @@
 #ifndef _FDT_H
 #define _FDT_H
 
+#include "types.h"
+
 #define FDT_MAGIC        0xd00dfeed     // big-endian
 #define FDT_BEGIN_NODE   0x1            // marks the beginning of a node’s representation
 #define FDT_END_NODE     0x2            // marks the end of a node’s representation.
@@ -42,4 +44,19 @@ int initramfs_callback(const void *fdt, const void *node_ptr, const char *node_n
 /* The API for getting the initramfs address from the device tree, return the address of initramfs */
 unsigned long get_initramfs_address(const void* fdt);
 
+/**
+ * Read linux,initrd-start / linux,initrd-end of the /chosen node
+ *
+ * @return 0 if both are found, -1 otherwise
+ */
+int fdt_get_initrd(const void* fdt, unsigned long* start, unsigned long* end);
+
+/**
+ * Set linux,initrd-start / linux,initrd-end of the /chosen node, the properties are added if they don't exist yet
+ * Adding a property grows the blob in place, so fdt must point to a buffer of bufsize bytes (>= totalsize)
+ *
+ * @return 0 on success, -1 if there is no /chosen node or the buffer is too small
+ */
+int fdt_set_initrd(void* fdt, size_t bufsize, unsigned long start, unsigned long end);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+#ifndef _FDT_CACHE_H
+#define _FDT_CACHE_H
+
+#include "types.h"
+#include "list.h"
+
+/*
+ ****************************
+ *  Unflattened device tree *
+ ****************************
+ * fdt_unflatten() walks the blob once and builds a tree of fdt_node / fdt_property,
+ * the property values are not copied and still point into the blob (big-endian cells)
+ * Every lookup then goes through a hash table instead of rescanning the struct block :
+ *      path        "/soc/serial@7e215000"  -> node
+ *      compatible  "brcm,bcm2835-aux-uart" -> nodes, in the order of the tree
+ *      phandle                             -> node
+ *      (node, property name)               -> property
+ * The nodes are allocated with simple_alloc and never freed, the blob must stay where it is
+ */
+
+/* Print log message */
+#define LOG_FDT_CACHE 0
+
+#define FDT_PATH_HASH_BITS      8
+#define FDT_COMPAT_HASH_BITS    7
+#define FDT_PHANDLE_HASH_BITS   6
+#define FDT_PROP_HASH_BITS      10
+
+struct fdt_node;
+
+typedef struct fdt_property{
+    const char* name;               // In the strings block
+    const void* value;              // In the struct block
+    unsigned int len;               // Length of the value in bytes
+    struct fdt_node* node;          // Node which owns the property
+    struct fdt_property* next;      // Next property of the same node, in the order of the blob
+    struct list_head hash_link;     // Linked in the bucket of (node, name)
+}fdt_property_t;
+
+typedef struct fdt_node{
+    const char* name;               // "serial@7e215000", "" for the root, in the struct block
+    const char* path;               // "/soc/serial@7e215000"
+    struct fdt_node* parent;
+    struct list_head children;      // Child nodes, linked by sibling
+    struct list_head sibling;
+    fdt_property_t* properties;
+    unsigned int phandle;           // 0 if the node has none
+    unsigned int address_cells;     // #address-cells of the node, for the reg of its children
+    unsigned int size_cells;        // #size-cells of the node, for the reg of its children
+    struct list_head path_link;     // Linked in the bucket of its path
+    struct list_head phandle_link;  // Linked in the bucket of its phandle
+}fdt_node_t;
+
+/**
+ * Build the tree from the blob, a later call replaces the tree (the old nodes are not freed)
+ *
+ * @return 0 on success, -1 if the blob is invalid or the heap is full
+ */
+int fdt_unflatten(const void* fdt);
+
+/* Root node, NULL before fdt_unflatten */
+fdt_node_t* fdt_root(void);
+
+/* Node of a full path, NULL if there is none */
+fdt_node_t* fdt_find_node_by_path(const char* path);
+
+/**
+ * Next node whose compatible list contains compat
+ *
+ * @param from  Node returned by the previous call, NULL to start from the first one
+ */
+fdt_node_t* fdt_find_compatible(const char* compat, fdt_node_t* from);
+
+/* Node of a phandle, NULL if there is none */
+fdt_node_t* fdt_find_node_by_phandle(unsigned int phandle);
+
+/**
+ * Property of a node
+ *
+ * @param len   Filled with the length of the value if not NULL
+ * @return      Pointer to the value (big-endian cells), NULL if the node has no such property
+ */
+const void* fdt_node_get_property(const fdt_node_t* node, const char* name, unsigned int* len);
+
+/* Read the index-th cell of a property, return 0 on success */
+int fdt_node_read_u32(const fdt_node_t* node, const char* name, unsigned int index, unsigned int* value);
+
+/* Read a property of one or two cells (e.g. linux,initrd-start), return 0 on success */
+int fdt_node_read_number(const fdt_node_t* node, const char* name, unsigned long* value);
+
+/* Check if a string of the compatible list of the node is compat */
+int fdt_node_is_compatible(const fdt_node_t* node, const char* compat);
+
+/* Node referenced by the index-th cell of a property (e.g. interrupt-parent), NULL if there is none */
+fdt_node_t* fdt_node_parse_phandle(const fdt_node_t* node, const char* name, unsigned int index);
+
+/**
+ * Read the index-th (address, size) pair of reg, with #address-cells / #size-cells of the parent
+ * The address is the one on the bus of the parent, it is not translated through ranges
+ *
+ * @return 0 on success, -1 if there is no such pair
+ */
+int fdt_node_read_reg(const fdt_node_t* node, unsigned int index, unsigned long* addr, unsigned long* size);
+
+/* Address of the initramfs (linux,initrd-start of /chosen), 0 if not found */
+unsigned long fdt_initrd_start(void);
+
+/* Compare a lookup in the tree with a scan of the blob (fdt_traverse) */
+void fdt_cache_benchmark(const void* fdt);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _IRQ_H
+#define _IRQ_H
+
+#include "types.h"
+#include "registers.h"
+
+/*
+ ****************************
+ *     Interrupt numbers    *
+ ****************************
+ * Every source gets a linear number, the handler table is indexed by it :
+ *      0 ~ 63      GPU interrupts of the BCM2837 controller, IRQ_PEND1 bits 0 ~ 31 then IRQ_PEND2 bits 0 ~ 31
+ *                  (the <bank irq> specifier of brcm,bcm2836-armctrl-ic with bank 1 / 2)
+ *      64 ~ 71     ARM basic interrupts (ARM timer, ARM mailbox, doorbells ...), bank 0 of the specifier
+ *      96 ~ 127    Core 0 local interrupts, the bits of CORE0_IRQ_SRC (brcm,bcm2836-l1-intc)
+ * The GPU interrupts reach the core through bit 8 of CORE0_IRQ_SRC, irq_dispatch() looks into the second level then
+ */
+#define IRQ_GPU(n)              (n)
+#define IRQ_BASIC(n)            (64 + (n))
+#define IRQ_LOCAL(n)            (96 + (n))
+#define NR_IRQS                 128
+
+/* Bits of CORE0_IRQ_SRC */
+#define LOCAL_IRQ_CNTPNS        1           // Non-secure physical timer, the scheduler tick
+#define LOCAL_IRQ_GPU           8           // Any enabled GPU interrupt
+
+/* BCM2837 interrupt controller, offsets from the base of brcm,bcm2836-armctrl-ic (INTERRUPT_BASE + 0x200) */
+#define ARMCTRL_DEFAULT_BASE    (INTERRUPT_BASE + 0x200)
+#define ARMCTRL_BASIC_PEND      0x00
+#define ARMCTRL_PEND1           0x04
+#define ARMCTRL_PEND2           0x08
+#define ARMCTRL_ENABLE1         0x10
+#define ARMCTRL_ENABLE2         0x14
+#define ARMCTRL_ENABLE_BASIC    0x18
+#define ARMCTRL_DISABLE1        0x1C
+#define ARMCTRL_DISABLE2        0x20
+#define ARMCTRL_DISABLE_BASIC   0x24
+
+/* Local interrupt controller of the cores, offsets from the base of brcm,bcm2836-l1-intc */
+#define LOCAL_INTC_DEFAULT_BASE 0x40000000
+#define LOCAL_IRQ_SRC0          0x60        // CORE0_IRQ_SRC
+
+/* Print log message */
+#define LOG_IRQ 0
+
+/* Flags of request_irq() */
+#define IRQF_NO_AUTOEN          0x1         // Don't enable the source, the driver calls irq_enable() once the device is ready
+
+typedef void (*irq_handler_t)(void* data);
+
+/* Descriptor of an interrupt, the handler and its statistics (in CNTPCT ticks) */
+struct irq_desc{
+    irq_handler_t handler;
+    void* data;
+    const char* name;
+    unsigned int flags;
+
+    unsigned long count;            // Times the handler was called
+    unsigned long unhandled;        // Times the source was pending without a handler
+    unsigned long total_ticks;      // Time spent in the handler
+    unsigned long max_ticks;
+    unsigned long max_latency;      // From the entry of irq_dispatch() to the call of the handler
+};
+
+/**
+ * Install the handler of an interrupt and enable the source (GPU / basic, unless IRQF_NO_AUTOEN)
+ * Local sources are enabled by their own control registers (e.g. enable_core_timer_int)
+ *
+ * @return 0 on success, -1 if the number is out of range or the interrupt already has a handler
+ */
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned int flags, const char* name, void* data);
+
+/* Disable the source and remove the handler installed with the same data */
+void free_irq(unsigned int irq, void* data);
+
+/* Enable / disable a GPU or basic interrupt at the BCM2837 controller, nothing for the local ones */
+void irq_enable(unsigned int irq);
+void irq_disable(unsigned int irq);
+
+/* Handle every pending interrupt, called by irq_entry */
+void irq_dispatch(void);
+
+/* Print the counters and the handler time of every interrupt which has fired */
+void irq_show_stats(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _LZ4_H
+#define _LZ4_H
+
+#include "types.h"
+
+/*
+ * Decoder of the LZ4 block format (no frame header), as produced by Python's lz4.block.compress(data, store_size=False)
+ *
+ * In-place decompression : put the compressed data at the end of a buffer of dst_size + LZ4_INPLACE_MARGIN(src_size) bytes
+ * and decompress to the start of the same buffer, the output never catches up with the input still to be read
+ */
+#define LZ4_INPLACE_MARGIN(src_size)    (((src_size) >> 8) + 32)
+
+/**
+ * Decompress src_size bytes of src into dst
+ *
+ * @param dst_size  Capacity of dst
+ * @return          Bytes written to dst, -1 if the data is malformed or doesn't fit in dst
+ */
+long lz4_decompress(const unsigned char* src, size_t src_size, unsigned char* dst, size_t dst_size);
+
+#endif
@@ -1,7 +1,31 @@
 #ifndef _MAILBOX_H
 #define _MAILBOX_H
 
-void mailbox_call(unsigned int channel, volatile unsigned int* msg);
+/* Offsets from the base of brcm,bcm2835-mbox */
+#define MBOX_READ               0x00        // Mailbox 0 Read/Write register
+#define MBOX_STATUS             0x18        // Mailbox 0 status register
+#define MBOX_CONFIG             0x1C        // Mailbox 0 configuration register
+#define MBOX_WRITE              0x20        // Mailbox 1 Read/Write register
+#define MBOX_WRITE_STATUS       0x38        // Mailbox 1 status register
+
+#define MBOX_CONFIG_IRQ_DATA    (1 << 0)    // Interrupt while mailbox 0 holds an answer
+
+#define MBOX_CH_PROP            8           // Property tags (ARM to VC), answered with the address of the buffer
+
+/* Mailbox 1 holds 8 messages, if it stays full this long the firmware is not reading it anymore */
+#define MBOX_WRITE_TIMEOUT_MS   100
+
+/* Print log message */
+#define LOG_MAILBOX 0
+
+/**
+ * Send the message (16-byte aligned) to the channel and wait until the firmware answers
+ * A task sleeps until the mailbox interrupt completes its request, the idle task waits with interrupts enabled,
+ * and polling is only used before the mailbox interrupt is set up
+ *
+ * @return 0 when the answer is in the buffer, -1 if mailbox 1 stayed full for MBOX_WRITE_TIMEOUT_MS (the message is not sent)
+ */
+int mailbox_call(unsigned int channel, volatile unsigned int* msg);
 
 void get_board_revision();
 
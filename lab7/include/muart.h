@@ -1,6 +1,28 @@
 #ifndef _MUART_H
 #define _MUART_H
 
+#include "types.h"
+
+/* 
+ * Output backend of muart_send / muart_puts / muart_send_hex / muart_send_dec
+ * NULL (default) : poll the mini UART, used by the bootloader, the early boot of the kernel and after a panic
+ */
+typedef size_t (*muart_output_t)(const char* buf, size_t size);
+void muart_set_output(muart_output_t output);
+
+/*
+ * Input backend of muart_receive
+ * NULL (default) : poll the mini UART
+ */
+typedef char (*muart_input_t)(void);
+void muart_set_input(muart_input_t input);
+
+/* Transmit the char data to host by polling, never goes through the output backend */
+void muart_send_sync(const char);
+
+/* Receive the char data from host by polling, never goes through the input backend */
+char muart_receive_sync();
+
 /* Receive the cahr data transmitted from host */ 
 char muart_receive();
 
@@ -19,4 +41,7 @@ void muart_send_hex(unsigned int);
 /* Transmit the int data to host in decimal */
 void muart_send_dec(int);
 
+/* Transmit the unsigned 64-bit data to host in decimal (counters, nanoseconds) */
+void muart_send_udec(unsigned long);
+
 #endif
\ No newline at end of file
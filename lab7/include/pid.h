@@ -3,22 +3,35 @@
 
 #include "types.h"
 #include "bitmap.h"
+#include "list.h"
 
 
 #define MIN_PID 2
 #define MAX_PID 32768
 
+/* PID hash table : pid -> task_struct, tasks are chained by task->pid_link */
+#define PID_HASH_BITS 8
+#define PID_HASH_SIZE (1 << PID_HASH_BITS)
+#define pid_hashfn(pid) ((unsigned int)(pid) & (PID_HASH_SIZE - 1))
+
+struct task_struct;
+
+/* Two level bitmap : every bit of the summary stands for one word of pid_bitmap */
+#define PID_MAP_WORDS       BITS_TO_LONGS(MAX_PID + 1)      // 513 words of 64 PIDs
+#define PID_SUMMARY_WORDS   BITS_TO_LONGS(PID_MAP_WORDS)    // 9 words
+
 /* PID bitmap structure */
 typedef struct {
-    DECLARE_BITMAP(pid_bitmap, MAX_PID + 1);
+    DECLARE_BITMAP(pid_bitmap, MAX_PID + 1);            // 1 : PID in use
+    DECLARE_BITMAP(free_summary, PID_MAP_WORDS);        // 1 : pid_bitmap[word] still has a free PID
     int last_pid;
 } pid_bitmap_t;
 
 /* PID management functions */
 void pid_bitmap_init(void);
-pid_t pid_alloc(void);
+pid_t pid_alloc(struct task_struct* task);   // Allocate a PID for the task and make it visible to find_task_by_pid()
 void pid_free(pid_t pid);
-unsigned int find_next_zero_bit(const unsigned long *bitmap, unsigned int size, unsigned int offset);
-unsigned int find_first_zero_bit(const unsigned long *bitmap, unsigned int size);
+struct task_struct* find_task_by_pid(pid_t pid);   // O(1) lookup, NULL if no task has this PID
+void pid_alloc_benchmark(void);   // Measure alloc / free throughput on a private, almost full bitmap
 
 #endif 
\ No newline at end of file
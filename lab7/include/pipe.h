@@ -0,0 +1,30 @@
+#ifndef _PIPE_H
+#define _PIPE_H
+
+#include "vfs.h"
+#include "sched.h"
+
+// One page ring buffer, the size must be a power of 2 so that the index can be masked
+#define PIPE_BUF_SIZE   4096
+#define PIPE_BUF_MASK   (PIPE_BUF_SIZE - 1)
+
+/*
+ * Pipe : single-producer single-consumer ring buffer
+ * `head` is only advanced by the writer and `tail` only by the reader, both are free-running counters,
+ * the number of bytes in the buffer is (head - tail) and the slot of a counter is (counter & PIPE_BUF_MASK)
+ */
+struct pipe_inode {
+    char* buf;
+    unsigned int head;                  // Total bytes written
+    unsigned int tail;                  // Total bytes read
+    int readers;                        // Open read ends
+    int writers;                        // Open write ends
+    struct wait_queue_head rd_wait;     // Readers waiting for data
+    struct wait_queue_head wr_wait;     // Writers waiting for space
+    struct vnode* vnode;                // Back reference to vnode
+};
+
+/* Create a pipe, return the read end in files[0] and the write end in files[1] */
+int pipe_create(struct file* files[2]);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _PL011_H
+#define _PL011_H
+
+#include "types.h"
+#include "irq.h"
+
+/*
+ ****************************
+ *        PL011 UART        *
+ ****************************
+ * Unlike the mini UART, the PL011 has its own reference clock (set through the mailbox), 16-byte FIFOs with
+ * programmable interrupt levels and DREQ lines to the DMA engine, so it can run at high baud rates
+ * On RPi3 the PL011 is wired to Bluetooth by default, add `dtoverlay=disable-bt` to config.txt to get it on GPIO 14 / 15
+ */
+
+/* Baud rate, can be overridden with -DPL011_BAUD=... (at most PL011_CLOCK / 16) */
+#ifndef PL011_BAUD
+#define PL011_BAUD              921600
+#endif
+
+/* UART reference clock requested from the firmware */
+#define PL011_CLOCK             48000000
+
+/* Flag register bits */
+#define PL011_FR_BUSY           (1 << 3)
+#define PL011_FR_RXFE           (1 << 4)    // RX FIFO empty
+#define PL011_FR_TXFF           (1 << 5)    // TX FIFO full
+#define PL011_FR_TXFE           (1 << 7)    // TX FIFO empty
+
+/* Interrupt bits of IMSC / MIS / ICR */
+#define PL011_INT_RX            (1 << 4)    // RX FIFO reached its level
+#define PL011_INT_TX            (1 << 5)    // TX FIFO drained to its level
+#define PL011_INT_RT            (1 << 6)    // RX timeout : data left in the RX FIFO below the level
+#define PL011_INT_ALL           0x7FF
+
+/* PL011 is GPU IRQ 57 unless the device tree says otherwise */
+#define PL011_DEFAULT_IRQ       IRQ_GPU(57)
+
+/* DMA channel used for bulk TX (not claimed by the firmware) */
+#define PL011_TX_DMA_CHANNEL    4
+
+/* Set up the PL011 on GPIO 14 / 15, enable its TX interrupt and the TX DMA channel */
+void pl011_init(void);
+
+/* Non-blocking write : copy the data into the TX buffer, return the bytes accepted */
+size_t pl011_write(const char* buffer, size_t size);
+
+/* Free space in the TX buffer */
+size_t pl011_tx_space(void);
+
+/* Blocking read : sleep until some data is received, return a short count if less than size bytes are buffered */
+long pl011_read_wait(char* buffer, size_t size);
+
+/* Blocking write : sleep while the TX buffer is full, return size unless interrupted by a signal */
+long pl011_write_wait(const char* buffer, size_t size);
+
+/* Polling I/O */
+size_t pl011_write_sync(const char* buffer, size_t size);
+char pl011_getc_sync(void);
+
+/* Transmit everything left in the TX buffer by polling */
+void pl011_flush_sync(void);
+
+/* Interrupt handlers of the UART and of the TX DMA channel */
+void pl011_irq_handler(void);
+void pl011_dma_irq_handler(void);
+
+#endif
@@ -20,12 +20,39 @@
 #define AUX_MU_IIR_REG          (MMIO_BASE+0x00215048)
 #define AUX_MU_LSR_REG          (MMIO_BASE+0x00215054)
 #define AUX_MU_IO_REG           (MMIO_BASE+0x00215040)
+#define AUX_MU_STAT_REG         (MMIO_BASE+0x00215064)  // Bits[27:24] TX FIFO fill level, Bits[19:16] RX FIFO fill level
+
+/* PL011 UART registers */
+#define PL011_BASE              (MMIO_BASE+0x00201000)
+#define PL011_DR                (PL011_BASE+0x00)       // Data register, Bits[11:8] error flags of the received char
+#define PL011_FR                (PL011_BASE+0x18)       // Flag register
+#define PL011_IBRD              (PL011_BASE+0x24)       // Integer baud rate divisor
+#define PL011_FBRD              (PL011_BASE+0x28)       // Fractional baud rate divisor
+#define PL011_LCRH              (PL011_BASE+0x2C)       // Line control register
+#define PL011_CR                (PL011_BASE+0x30)       // Control register
+#define PL011_IFLS              (PL011_BASE+0x34)       // Interrupt FIFO level select register
+#define PL011_IMSC              (PL011_BASE+0x38)       // Interrupt mask set/clear register
+#define PL011_MIS               (PL011_BASE+0x40)       // Masked interrupt status register
+#define PL011_ICR               (PL011_BASE+0x44)       // Interrupt clear register
+#define PL011_DMACR             (PL011_BASE+0x48)       // DMA control register
+
+/* DMA controller registers (channel 0 ~ 14, 0x100 apart) */
+#define DMA_BASE                (MMIO_BASE+0x00007000)
+#define DMA_CHAN(ch)            (DMA_BASE+(ch)*0x100)
+#define DMA_CS(ch)              (DMA_CHAN(ch)+0x00)     // Control and status
+#define DMA_CONBLK_AD(ch)       (DMA_CHAN(ch)+0x04)     // Control block address (bus address)
+#define DMA_DEBUG(ch)           (DMA_CHAN(ch)+0x20)     // Debug, write 1 to clear the error bits
+#define DMA_INT_STATUS          (DMA_BASE+0xFE0)        // Interrupt status of every channel
+#define DMA_ENABLE              (DMA_BASE+0xFF0)        // Global enable bit of every channel
 
 /* Interrupt registers */
 #define INTERRUPT_BASE          (MMIO_BASE+0x0000B000)
 #define IRQ_PEND1               (INTERRUPT_BASE+0x204)  // IRQ pending 1 register
+#define IRQ_PEND2               (INTERRUPT_BASE+0x208)  // IRQ pending 2 register
 #define ENABLE_IRQS1            (INTERRUPT_BASE+0x210)  // Enable IRQs 1 register
+#define ENABLE_IRQS2            (INTERRUPT_BASE+0x214)  // Enable IRQs 2 register
 #define DISABLE_IRQS1           (INTERRUPT_BASE+0x21C)  // Disable IRQs 1 register
+#define DISABLE_IRQS2           (INTERRUPT_BASE+0x220)  // Disable IRQs 2 register
 
 /* Mailbox registers */
 #define MAILBOX_BASE            (MMIO_BASE+0xB880)
@@ -5,6 +5,7 @@
 #include "list.h"
 #include "pid.h"
 #include "vfs.h"
+#include "signal.h"
 
 #define THREAD_STACK_SIZE 4096
 
@@ -12,6 +13,7 @@
 #define TASK_RUNNING    0
 #define TASK_ZOMBIE     1
 #define TASK_DEAD       2
+#define TASK_WAITING    3   // Sleeping on a wait queue, not in the run queue
 
 /* VFS */
 #define MAX_OPEN_FILES  16
@@ -37,6 +39,14 @@ struct cpu_context {
     unsigned long sp;
 };
 
+/* 
+ * Wait queue : tasks blocked until some condition becomes true
+ * A waiting task is not in the run queue, so its `list` node links it into the wait queue instead
+ */
+struct wait_queue_head {
+    struct list_head task_list;
+};
+
 /* Task structure */
 struct task_struct {
     struct cpu_context cpu_context; 
@@ -47,12 +57,23 @@ struct task_struct {
     void* user_stack;
     void* user_program;           // Pointer to allocated user program memory
     size_t user_program_size;     // Size of user program for cleanup
-    struct list_head list;    // For run queue
+    struct list_head list;    // For run queue (or the wait queue while TASK_WAITING, or zombie_list while waiting to be reaped by the idle task)
     struct list_head task;    // For task list
+    struct list_head pid_link;  // Linked in the PID hash table bucket of pid
+    struct list_head children;  // Children of this task, linked by their `sibling`
+    struct list_head sibling;   // Linked in parent->children
+    int exit_code;              // (status & 0xff) << 8 after exit(status), or the signal number if killed by a signal
 
     // Virtual File System
     char cwd[MAX_PATH_LENGTH]; // Current working directory
     struct file* fd_table[MAX_OPEN_FILES];  // File descriptor table
+
+    // Signals
+    unsigned long sig_pending;              // Bit n set : signal n is waiting to be delivered
+    unsigned long sig_blocked;              // Bit n set : delivery of signal n is postponed
+    sighandler_t sig_handlers[NSIG];        // SIG_DFL, SIG_IGN or a user handler
+
+    struct wait_queue_head wait_chldexit;   // The task sleeps here in waitpid() until a child exits
 };
 
 /* Pass initramfs address through task structure */
@@ -65,6 +86,7 @@ struct task_init_data {
 // External variables (defined in sched.c and will be used in other files) 
 extern struct list_head task_lists;
 extern struct list_head rq;
+extern volatile int need_resched;   // Set by the timer interrupt, irq_entry() calls schedule() once every handler is done
 
 
 /* Initialize the thread mechanism */
@@ -87,6 +109,36 @@ void schedule(void);
 /* When a thread exit, set the state to ZOMBIE and remove it from the run queue */
 void thread_exit(void);
 
+/* 
+ * Turn the task into a zombie : remove it from the run queue (or wait queue), give its children away and notify its parent
+ * The zombie is reaped by the parent's waitpid(), or by the idle task if nobody can wait for it
+ */
+void exit_task(struct task_struct* task, int exit_code);
+
+/* Wait for a child (pid, or any child if pid is -1) to exit, return its pid, 0 if WNOHANG and no child has exited, -1 on error */
+pid_t do_waitpid(pid_t pid, int* status, int options);
+
+#define WNOHANG     1       // waitpid() returns immediately if no child has exited
+
+/* Initialize an empty wait queue */
+void init_waitqueue_head(struct wait_queue_head* wq);
+
+/* 
+ * Put the current task to sleep on the wait queue and run another task
+ * Must be called with interrupt disabled, returns with interrupt still disabled after being woken up,
+ * so the caller can re-check its condition without racing with the waker
+ */
+void sleep_on(struct wait_queue_head* wq);
+
+/* 1 if the current context may call sleep_on() : the scheduler is running and it is not the idle task */
+int task_can_sleep(void);
+
+/* Move a task sleeping on a wait queue back to the run queue */
+void wake_up_process(struct task_struct* task);
+
+/* Move every task sleeping on the wait queue back to the run queue */
+void wake_up(struct wait_queue_head* wq);
+
 
 /* --- Function defined in sched.S --- */
 /* Jump to the address in x19, with the argument in x20 */
@@ -0,0 +1,73 @@
+#ifndef _SIGNAL_H
+#define _SIGNAL_H
+
+#define NSIG            32      // Signals 1 ~ 31, bit n of the pending / blocked bitmap is signal n
+
+/* Signal numbers */
+#define SIGHUP          1
+#define SIGINT          2
+#define SIGQUIT         3
+#define SIGKILL         9       // Can't be caught, blocked or ignored
+#define SIGUSR1         10
+#define SIGSEGV         11
+#define SIGUSR2         12
+#define SIGPIPE         13
+#define SIGALRM         14
+#define SIGTERM         15
+#define SIGCHLD         17      // Ignored by default
+
+/* Special handlers */
+#define SIG_DFL         ((sighandler_t)0)   // Default action
+#define SIG_IGN         ((sighandler_t)1)   // Ignore the signal
+
+/* how of sigprocmask() */
+#define SIG_BLOCK       0
+#define SIG_UNBLOCK     1
+#define SIG_SETMASK     2
+
+#define sigmask(sig)    (1UL << (sig))
+
+#ifndef __ASSEMBLER__
+
+#include "exception.h"
+
+typedef void (*sighandler_t)(int);
+
+struct task_struct;
+
+/*
+ * Signal frame, pushed on the user stack before running a handler
+ * The handler returns to sigreturn_trampoline (set in x30), which calls sigreturn() to restore the interrupted context from this frame
+ */
+struct sigframe {
+    struct trap_frame tf;       // User context when the signal was delivered
+    unsigned long blocked;      // Blocked signals before the handler ran
+};
+
+/* Mark the signal pending on the task and wake it up if it's waiting, return 0 on success, -1 on failure */
+int send_signal(struct task_struct* task, int sig);
+
+/* Check if the task has any pending signal which is not blocked */
+int signal_pending(struct task_struct* task);
+
+/* Deliver the pending signals of the current task before returning to user space (called right before kernel_exit 0) */
+void do_signal(struct trap_frame* tf);
+
+/* Reset the handlers to default and forget pending signals (new task / exec) */
+void signal_init(struct task_struct* task);
+
+/* Register a handler, return the previous handler or SIG_DFL on failure */
+sighandler_t do_sigaction(int sig, sighandler_t handler);
+
+/* Change the blocked signals of the current task, return the previous mask */
+unsigned long do_sigprocmask(int how, unsigned long set);
+
+/* Restore the user context saved by do_signal(), return the restored x0 */
+unsigned long do_sigreturn(struct trap_frame* tf);
+
+/* Defined in exception.S : the return address of every handler, calls sigreturn() */
+void sigreturn_trampoline(void);
+
+#endif
+
+#endif
@@ -3,8 +3,9 @@
 
 #include "types.h"
 #include "exception.h"
+#include "signal.h"
 
-#define NR_SYS_CALLS 8
+#define NR_SYS_CALLS 21
 
 /* System call numbers */
 #define SYS_GETPID      0
@@ -15,6 +16,9 @@
 #define SYS_EXIT        5
 #define SYS_MBOX_CALL   6
 #define SYS_KILL        7
+#define SYS_SIGNAL      8
+#define SYS_SIGKILL     9
+#define SYS_SIGRETURN   10
 #define SYS_OPEN        11
 #define SYS_CLOSE       12
 #define SYS_WRITE       13
@@ -22,6 +26,9 @@
 #define SYS_MKDIR       15
 #define SYS_MOUNT       16
 #define SYS_CHDIR       17
+#define SYS_PIPE        18
+#define SYS_SIGPROCMASK 19
+#define SYS_WAITPID     20
 
 
 #ifndef __ASSEMBLER__
@@ -31,9 +38,14 @@ size_t sys_uartread(char buf[], size_t size);
 size_t sys_uartwrite(const char buf[], size_t size);
 int sys_exec(const char* name, char *const argv[]);
 int sys_fork(void);
-void sys_exit(void);
+void sys_exit(int status);
 int sys_mbox_call(unsigned int ch, unsigned int *mbox);
 void sys_kill(int pid);
+sighandler_t sys_signal(int sig, sighandler_t handler);
+int sys_sigkill(int pid, int sig);
+unsigned long sys_sigreturn(struct trap_frame* tf);
+unsigned long sys_sigprocmask(int how, unsigned long set);
+int sys_waitpid(int pid, int* status, int options);
 
 int open(const char *pathname, int flags);
 int close(int fd);
@@ -42,6 +54,7 @@ long read(int fd, void *buf, unsigned long count);
 int mkdir(const char *pathname, unsigned mode);
 int mount(const char *src, const char *target, const char *filesystem, unsigned long flags, const void *data);
 int chdir(const char *path);
+int pipe(int pipefd[2]);
 
 /* System call handler */
 // void syscall_handler(void);
@@ -56,6 +69,8 @@ int call_sys_fork(void);
 void call_sys_exit(void);
 int call_sys_mbox_call(unsigned char ch, unsigned int *mbox);
 void call_sys_kill(int pid);
+sighandler_t call_sys_signal(int sig, sighandler_t handler);
+int call_sys_sigkill(int pid, int sig);
 #endif
 
 #endif
\ No newline at end of file
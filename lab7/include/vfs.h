@@ -17,6 +17,7 @@ struct file {
     size_t f_pos;  // RW position of this file handle
     struct file_operations* f_ops;
     int flags;
+    int f_count;    // Number of fd_table entries referring to this handle (shared by fork), released when it drops to 0
 };
 
 // Represent a mounted file system
@@ -54,6 +55,9 @@ struct task_struct;
 #define VFS_EINVAL  -4  // Invalid argument
 #define VFS_ENOMEM  -5  // Out of memory
 #define VFS_ENDOFPATH -6  // End of path reached
+#define VFS_EPIPE   -7  // Write to a pipe with no reader
+#define VFS_EMFILE  -8  // Too many open files
+#define VFS_EINTR   -9  // Interrupted by a signal before any data was transferred
 
 // File open flags
 #define O_RDONLY    00000000    // Read only
@@ -1,56 +1,380 @@
+import argparse
 import struct
 import serial
-import time
 import sys
+import time
+import zlib
+
+# Protocol constants, see include/bootloader.h
+BOOT_SIGNATURE = 0x544F4F42         # "BOOT" in hex (little edian)
+BOOT_BAUD_SIGNATURE = 0x44554142    # "BAUD"
+BOOT_FLAG_LZ4 = 0x1
+BOOT_FLAG_MORE = 0x2
+BOOT_PAYLOAD_KERNEL, BOOT_PAYLOAD_INITRAMFS, BOOT_PAYLOAD_DTB = range(3)
+BOOT_BLOCK_SIZE_MAX = 4096
+FRAME_SYNC = b'\x5A\xA5'
+
+RESP_ACK = 0xF1
+RESP_NAK = 0xF2
+RESP_HDR_OK = 0xF3
+RESP_HDR_BAD = 0xF4
+RESP_DONE = 0xF5
+RESP_FAIL = 0xF6
+RESP_BAUD_OK = 0xF7
+RESP_BAUD_BAD = 0xF8
+RESP_CODES = (RESP_ACK, RESP_NAK, RESP_HDR_OK, RESP_HDR_BAD, RESP_DONE, RESP_FAIL, RESP_BAUD_OK, RESP_BAUD_BAD)
+
+SEQ_ABORT = 0xFFFF
+
+DEFAULT_BAUD = 115200           # The bootloader (and the kernel) always start at this rate
+BAUD_RATES = (1500000, 921600, 460800, 230400)     # Tried from the highest, all within 1.5% of a mini UART divisor
+BAUD_TEST_LEN = 256
+BAUD_TIMEOUT = 1.0              # The bootloader goes back to DEFAULT_BAUD after this long without the test pattern
+
+HEADER_TIMEOUT = 0.5    # Resend the header if it is not answered in time
+ACK_TIMEOUT = 0.5       # Go back to the last ACK if nothing is answered in time (on top of the time to send a window)
+
+# Result of send_blocks()
+SEND_OK, SEND_FAIL, SEND_SLOW = range(3)
+
+
+class ResponseReader:
+    """
+    Split what the bootloader sends into 4-byte responses (code >= 0xF0, seq, check byte)
+    and its ASCII messages, which are echoed to stdout
+    """
+    def __init__(self, s, echo=True):
+        self.s = s
+        self.echo = echo
+        self.buf = bytearray()
+
+    def reset(self):
+        """Forget what was received, e.g. at a wrong baud rate"""
+        self.s.reset_input_buffer()
+        self.buf.clear()
+
+    def read(self, timeout):
+        """Return (code, seq) of the next response, or None if none arrives before the timeout"""
+        deadline = time.monotonic() + timeout
+        while True:
+            resp = self._parse()
+            if resp is not None:
+                return resp
+            remaining = deadline - time.monotonic()
+            if remaining <= 0 and not self.s.in_waiting:
+                return None
+            self.s.timeout = min(max(remaining, 0), 0.05)
+            self.buf += self.s.read(max(1, self.s.in_waiting))
+
+    def _parse(self):
+        while self.buf:
+            if self.buf[0] not in RESP_CODES:
+                # Part of a message
+                if self.echo and (self.buf[0] < 0x80):
+                    sys.stdout.write(chr(self.buf[0]))
+                    sys.stdout.flush()
+                del self.buf[0]
+                continue
+            if len(self.buf) < 4:
+                return None
+            code, lo, hi, check = self.buf[:4]
+            if code ^ lo ^ hi != check:
+                del self.buf[0]
+                continue
+            del self.buf[:4]
+            return code, lo | (hi << 8)
+        return None
+
+
+def make_response(code, seq):
+    lo, hi = seq & 0xFF, (seq >> 8) & 0xFF
+    return bytes((code, lo, hi, code ^ lo ^ hi))
+
+
+def make_header(payload_size, checksum, raw_size, block_size, flags, payload_type):
+    # Pack the data in little endian, the last field is the CRC32 of the others
+    fields = struct.pack('<IIIIHBB', BOOT_SIGNATURE, payload_size, checksum, raw_size, block_size, flags, payload_type)
+    return fields + struct.pack('<I', zlib.crc32(fields))
+
+
+def fit_block_size(payload_size, block_size):
+    """The smallest block size (at least block_size) that keeps the last seq below SEQ_ABORT, None if even
+    BOOT_BLOCK_SIZE_MAX is too small"""
+    min_size = (payload_size + SEQ_ABORT - 2) // (SEQ_ABORT - 1)
+    size = max(block_size, min_size)
+    return size if size <= BOOT_BLOCK_SIZE_MAX else None
+
+
+def make_frame(seq, payload):
+    body = struct.pack('<HH', seq, len(payload)) + payload
+    return FRAME_SYNC + body + struct.pack('<I', zlib.crc32(body))
+
+
+def switch_baud(s, reader, baud):
+    s.flush()           # What is already written goes out at the old rate
+    s.baudrate = baud
+    reader.reset()
+
+
+def negotiate_baud(s, reader, baud, retries):
+    """
+    Ask the bootloader to switch to baud and check the link with the test pattern
+    Return True if both sides run at baud, False if they are back at DEFAULT_BAUD, None if the bootloader doesn't answer
+    """
+    req = struct.pack('<II', BOOT_BAUD_SIGNATURE, baud)
+    req += struct.pack('<I', zlib.crc32(req))
+    for _ in range(retries):
+        s.write(req)
+        s.flush()
+        resp = reader.read(HEADER_TIMEOUT)
+        if resp == (RESP_BAUD_OK, 0):
+            break
+        if resp is not None and resp[0] == RESP_BAUD_BAD:
+            return False
+    else:
+        return None
+
+    # The bootloader switches as soon as its answer has left the UART
+    switch_baud(s, reader, baud)
+    time.sleep(0.02)
+    s.write(bytes(i & 0xFF for i in range(BAUD_TEST_LEN)))
+    s.flush()
+    if reader.read(BAUD_TIMEOUT) == (RESP_BAUD_OK, 1):
+        s.write(make_response(RESP_BAUD_OK, 2))
+        s.flush()
+        return True
+
+    # The bootloader is back at the default rate, or will be when it gives up waiting
+    switch_baud(s, reader, DEFAULT_BAUD)
+    time.sleep(BAUD_TIMEOUT)
+    reader.reset()
+    return False
+
+
+def raise_baud(s, reader, rates, retries):
+    """Try the rates from the highest, return the rates left (the one in use first), or None if the bootloader doesn't answer"""
+    while rates:
+        rate = rates[0]
+        print(f"Trying {rate} baud...")
+        ok = negotiate_baud(s, reader, rate, retries)
+        if ok is None:
+            return None
+        if ok:
+            print(f"Link running at {rate} baud")
+            return rates
+        rates = rates[1:]
+    print(f"Link running at {DEFAULT_BAUD} baud")
+    return rates
+
+
+def fall_back(s, reader, rates):
+    """The current rate is not reliable : go back to DEFAULT_BAUD (where the bootloader returns too) and drop the rate"""
+    print(f"\n{s.baudrate} baud is not reliable, falling back")
+    switch_baud(s, reader, DEFAULT_BAUD)
+    time.sleep(0.1)
+    reader.reset()
+    return rates[1:]
+
+
+def abort_transfer(s, reader):
+    """Make the bootloader leave the transfer and go back to DEFAULT_BAUD"""
+    frame = make_frame(SEQ_ABORT, b'')
+    for _ in range(3):
+        s.write(frame)
+        s.flush()
+        while True:
+            resp = reader.read(HEADER_TIMEOUT)
+            if resp is None:
+                break
+            if resp[0] == RESP_FAIL:
+                return True
+    return False
+
+
+def send_header(s, reader, header, retries):
+    for _ in range(retries):
+        s.write(header)
+        s.flush()
+        resp = reader.read(HEADER_TIMEOUT)
+        if resp is None:
+            continue
+        if resp[0] == RESP_HDR_OK:
+            return True
+        if resp[0] == RESP_HDR_BAD:
+            print("\nHeader rejected, resending")
+    return False
+
+
+def send_blocks(s, reader, payload, block_size, window, baud_rate):
+    """
+    Go-back-N : keep up to window frames ahead of the last ACK, restart from the NAKed / last ACKed block
+    Above DEFAULT_BAUD, give up with SEND_SLOW when too many frames are lost, a lower rate will be faster
+    """
+    nblocks = (len(payload) + block_size - 1) // block_size
+    # The frames may still be in the buffers of the serial port, give them time to go out (10 bits per byte)
+    ack_timeout = ACK_TIMEOUT + window * (block_size + 10) * 10 / baud_rate
+    max_retransmits = 16 + nblocks // 4 if baud_rate > DEFAULT_BAUD else None
+    frames = [make_frame(i, payload[i * block_size:(i + 1) * block_size]) for i in range(nblocks)]
+    base = 0        # First block not acknowledged
+    next_seq = 0    # Next block to send
+    retransmits = 0
+
+    while base < nblocks:
+        if max_retransmits is not None and retransmits > max_retransmits:
+            return SEND_SLOW
+
+        while next_seq < nblocks and next_seq < base + window:
+            s.write(frames[next_seq])
+            next_seq += 1
+
+        resp = reader.read(ack_timeout if next_seq == base + window or next_seq == nblocks else 0)
+        if resp is None:
+            if next_seq == base + window or next_seq == nblocks:
+                # Nothing came back, the frames or their ACK were lost
+                retransmits += next_seq - base
+                next_seq = base
+            continue
+
+        code, seq = resp
+        if code == RESP_ACK and seq > base:
+            base = seq
+            print(f"\rSent {min(base * block_size, len(payload))} / {len(payload)} bytes", end='')
+        elif code == RESP_NAK and seq >= base:
+            retransmits += next_seq - seq
+            base = seq
+            next_seq = seq
+        elif code == RESP_FAIL:
+            return SEND_FAIL
+
+    print(f"\nAll blocks acknowledged, {retransmits} frames retransmitted")
+    return SEND_OK
+
+
+class Payload:
+    """One image to upload, the bootloader puts each type at its own load address"""
+    def __init__(self, name, path, payload_type, compress):
+        self.name = name
+        self.type = payload_type
+        # "rb" means open file mode ( read in binary ), the bytes object will store the full content of the image
+        with open(path, "rb") as f:
+            self.data = f.read()
+        self.checksum = zlib.crc32(self.data)
+        self.payload = self.data
+        self.flags = 0
+        if compress:
+            import lz4.block
+            # Raw LZ4 block, the bootloader gets the decompressed size from the header
+            self.payload = lz4.block.compress(self.data, mode='high_compression', store_size=False)
+            self.flags |= BOOT_FLAG_LZ4
+
+        print(f"{self.name} size: {len(self.data)} bytes")
+        if compress:
+            print(f"Compressed size: {len(self.payload)} bytes")
+        print(f"CRC32: 0x{self.checksum:08X}")
+
+    def header(self, block_size, more):
+        flags = self.flags | (BOOT_FLAG_MORE if more else 0)
+        return make_header(len(self.payload), self.checksum, len(self.data), block_size, flags, self.type)
+
+
+def send_kernel(kernel_path, serial_port, max_baud=921600, block_size=1024, window=8, compress=False, retries=60,
+                initramfs_path=None, dtb_path=None):
+    # The kernel goes last, the bootloader boots after the payload sent without BOOT_FLAG_MORE
+    payloads = []
+    if initramfs_path:
+        payloads.append(Payload("Initramfs", initramfs_path, BOOT_PAYLOAD_INITRAMFS, compress))
+    if dtb_path:
+        payloads.append(Payload("Device tree", dtb_path, BOOT_PAYLOAD_DTB, compress))
+    payloads.append(Payload("Kernel", kernel_path, BOOT_PAYLOAD_KERNEL, compress))
+    total_size = sum(len(p.data) for p in payloads)
+
+    rates = [r for r in BAUD_RATES if DEFAULT_BAUD < r <= max_baud]
 
-def calculate_checksum(data):
-    # Sum in units of the 8 bits (the input type is a byte object) and use the lower 8 bits to be the checksum
-    return sum(data) & 0xFF  
-
-def send_kernel(kernel_path, serial_port, baud_rate = 115200):
-    # Read the binary data from the kernel image and store it into kernel_data
-    with open(kernel_path, "rb") as f:  # "rb" means open file mode ( read in binary ), it will return bytes object
-        kernel_data = f.read()          # The bytes object `kernel_data` will store the full content of kernel8.img in binary, each element is a byte 
-
-    # Calculate checksum
-    checksum = calculate_checksum(kernel_data)
-    
-    print(f"Kernel size: {len(kernel_data)} bytes")
-    print(f"Checksum: 0x{checksum:08X}")
-    
-    # Pack the data in little endian
-    header = struct.pack('<III',               # data type is unsinged int
-                         0x544F4F42,           # "BOOT" in hex (little edian)
-                         len(kernel_data),     # kerenl size
-                         checksum              # checksum
-                        )              
-    
     try:
         # Write to the serial port
-        with serial.Serial(serial_port, baud_rate, write_timeout=None) as s:
-            print("Sending header...")
-            bytes_written = s.write(header)
-            time.sleep(1)       # 不加傳不過去 ?
-            s.flush()
-            print(f"Header sent {bytes_written} bytes successfully!")
-            
-            time.sleep(1)
-            print("Sending kernel...")
-            bytes_written = s.write(kernel_data)
-            s.flush()
-        
-            print(f"Kernel sent {bytes_written} bytes successfully!")
-            
+        with serial.Serial(serial_port, DEFAULT_BAUD, write_timeout=None) as s:
+            reader = ResponseReader(s)
+            start = time.monotonic()
+
+            # Every failure above DEFAULT_BAUD brings both sides back to DEFAULT_BAUD, then a lower rate is tried
+            # The payloads already received are kept by the bootloader, only the failed one is sent again
+            index = 0
+            while index < len(payloads):
+                payload = payloads[index]
+                if rates and s.baudrate == DEFAULT_BAUD:
+                    rates = raise_baud(s, reader, rates, retries)
+                    if rates is None:
+                        print("Error: the bootloader doesn't answer")
+                        return False
+
+                payload_block_size = fit_block_size(len(payload.payload), block_size)
+                if payload_block_size is None:
+                    print(f"Error: the {payload.name.lower()} is too large to be sent in {SEQ_ABORT - 1} blocks")
+                    return False
+                if payload_block_size != block_size:
+                    print(f"Using {payload_block_size}-byte blocks for the {payload.name.lower()}")
+
+                print(f"Sending {payload.name.lower()} header...")
+                header = payload.header(payload_block_size, index < len(payloads) - 1)
+                if not send_header(s, reader, header, retries if s.baudrate == DEFAULT_BAUD else 4):
+                    if s.baudrate != DEFAULT_BAUD:
+                        rates = fall_back(s, reader, rates)
+                        continue
+                    print("Error: the bootloader doesn't answer")
+                    return False
+
+                print(f"Sending {payload.name.lower()}...")
+                result = send_blocks(s, reader, payload.payload, payload_block_size, window, s.baudrate)
+                if result == SEND_SLOW:
+                    abort_transfer(s, reader)
+                if result != SEND_OK:
+                    if s.baudrate != DEFAULT_BAUD:
+                        rates = fall_back(s, reader, rates)
+                        continue
+                    print(f"Error: the bootloader failed to receive the {payload.name.lower()}")
+                    return False
+
+                resp = reader.read(30)      # Decompression and the final CRC32 run on the Pi
+                if resp is not None and resp[0] == RESP_DONE:
+                    index += 1
+                    continue
+                if s.baudrate != DEFAULT_BAUD:
+                    rates = fall_back(s, reader, rates)
+                    continue
+                print(f"Error: the {payload.name.lower()} image is corrupted, run again to retry")
+                return False
+
+            elapsed = time.monotonic() - start
+            print(f"{len(payloads)} images sent in {elapsed:.2f} s ({total_size / elapsed / 1024:.1f} KB/s)")
+
+            # The kernel starts at DEFAULT_BAUD again, show its first messages
+            reader.read(0.2)
+            switch_baud(s, reader, DEFAULT_BAUD)
+            reader.read(0.5)
+            return True
+
+    except serial.SerialTimeoutException:
+        print("Error: write operation time out")
     except Exception as e:
         print(f"Error sending data: {e}")
-    except serial.SerialTimeoutException:
-        print("Error: write operation time out")      
-        
+    return False
+
+
 if __name__ == "__main__":
-    if len(sys.argv) < 3:
-        print(f"Usage: {sys.argv[0]} <kernel_file> <serial_device>")
-        sys.exit(1)
-    
-    kernel_path = sys.argv[1]
-    serial_device = sys.argv[2]
-    send_kernel(kernel_path, serial_device)
\ No newline at end of file
+    parser = argparse.ArgumentParser(description="Upload a kernel image (and an initramfs / a device tree) to the UART bootloader")
+    parser.add_argument("kernel_file")
+    parser.add_argument("serial_device")
+    parser.add_argument("--initramfs", help="cpio archive to load at the initrd address (set in the device tree by the bootloader)")
+    parser.add_argument("--dtb", help="device tree blob to use instead of the one from the firmware")
+    parser.add_argument("--baud", type=int, default=921600, help=f"highest rate to negotiate ({DEFAULT_BAUD} : no negotiation)")
+    parser.add_argument("--block-size", type=int, default=1024, help=f"payload bytes per frame (at most {BOOT_BLOCK_SIZE_MAX})")
+    parser.add_argument("--window", type=int, default=8, help="frames sent ahead of the last ACK")
+    parser.add_argument("--lz4", action="store_true", help="send LZ4 compressed images (needs `pip install lz4`)")
+    args = parser.parse_args()
+
+    if not 0 < args.block_size <= BOOT_BLOCK_SIZE_MAX:
+        parser.error(f"block size must be in 1 .. {BOOT_BLOCK_SIZE_MAX}")
+
+    ok = send_kernel(args.kernel_file, args.serial_device, args.baud, args.block_size, args.window, args.lz4,
+                     initramfs_path=args.initramfs, dtb_path=args.dtb)
+    sys.exit(0 if ok else 1)
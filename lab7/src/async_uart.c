@@ -5,13 +5,28 @@
 #include "string.h"
 #include "exception.h"
 #include "timer.h"
+#include "mm.h"
+#include "sched.h"
+#include "signal.h"
+#include "chardev.h"
+#include "irq.h"
+#include "driver.h"
 
 /*
  ****************************
  *      Async mini UART     *
  ****************************
  */
-#define UART_BUFFER_SIZE 256
+// Size of the RX / TX buffer is 2^UART_BUFFER_SHIFT bytes, can be overridden with -DUART_BUFFER_SHIFT=...
+#ifndef UART_BUFFER_SHIFT
+#define UART_BUFFER_SHIFT 12
+#endif
+#define UART_BUFFER_SIZE (1 << UART_BUFFER_SHIFT)
+#define UART_BUFFER_MASK (UART_BUFFER_SIZE - 1)     // Power of two : wrap the index with a mask instead of %
+
+// The mini UART TX FIFO holds 8 bytes
+#define MUART_TX_FIFO_SIZE 8
+#define MUART_TX_FIFO_LEVEL(stat) (((stat) >> 24) & 0xF)
 
 // Use queue (circular array) to implement the RX and TX buffer
 static char rx_buffer[UART_BUFFER_SIZE];    // Receive Buffer
@@ -22,29 +37,53 @@ static char tx_buffer[UART_BUFFER_SIZE];    // Transmit Buffer
 static volatile int tx_head = 0;            // Point to the index can write
 static volatile int tx_tail = 0;            // Point to the index can read
 
+// Tasks blocked in async_uart_read_wait() / async_uart_write_wait()
+static struct wait_queue_head rx_wait;
+static struct wait_queue_head tx_wait;
+
+// IRQ of the mini UART (the AUX interrupt, shared with SPI1 / SPI2), from the device tree once probed
+static int muart_irq = IRQ_GPU(29);
+
 // Check if RX buffer is full : return value 1 means RX buffer is full
 static inline int rx_buffer_is_full(){
-    return ( (rx_head + 1) % UART_BUFFER_SIZE ) == rx_tail;
+    return ( (rx_head + 1) & UART_BUFFER_MASK ) == rx_tail;
 }
 
 // Check if TX buffer is full : return value 1 means TX buffer is full
 static inline int tx_buffer_is_full(){
-    return ( (tx_head + 1) % UART_BUFFER_SIZE ) == tx_tail;
+    return ( (tx_head + 1) & UART_BUFFER_MASK ) == tx_tail;
+}
+
+// The wait queues must be ready before the UART interrupt is enabled, uart_irq_handler() wakes them up
+static void async_uart_wait_init(){
+    if( rx_wait.task_list.next == NULL ){
+        init_waitqueue_head(&rx_wait);
+        init_waitqueue_head(&tx_wait);
+    }
+}
+
+/* Enable the mini UART interrupt for transmitting only, TX interrupt is enabled by async_uart_write() when there is data */
+void async_uart_tx_init(){
+    async_uart_wait_init();
+    regWrite(AUX_MU_IER_REG, 0);
+    
+    // Enable UART interrupt at the second-level controller
+    irq_enable(muart_irq);
 }
 
 /* Initialize asynchronous UART with interrupt support */
 void async_uart_init(){
-    // Reset buffer indices
+    // Reset RX buffer indices, the TX buffer may still hold console output
     rx_head = rx_tail = 0;
-    tx_head = tx_tail = 0;
+    async_uart_wait_init();
     
     // Enable UART RX interrupts
     // Bit 0 enables RX interrupts, Bit 1 enables TX interrupts
-    // Initially only enable RX interrupts
-    regWrite(AUX_MU_IER_REG, 1);
+    // Keep the TX interrupt as it is, it may be draining console output
+    regWrite(AUX_MU_IER_REG, regRead(AUX_MU_IER_REG) | 1);
     
-    // Enable UART interrupt at the second-level controller (bit 29)
-    regWrite(ENABLE_IRQS1, (1 << 29));
+    // Enable UART interrupt at the second-level controller
+    irq_enable(muart_irq);
 }
 
 void disable_uart_int() {
@@ -54,8 +93,8 @@ void disable_uart_int() {
     // Flush the RX and TX FIFO
     regWrite(AUX_MU_IIR_REG, 6);        // Set AUX_MU_IIR_REG to 6, clear the rx and tx FIFO
 
-    // Disable UART interrupt at the second-level controller (bit 29)
-    regWrite(DISABLE_IRQS1, (1 << 29));
+    // Disable UART interrupt at the second-level controller
+    irq_disable(muart_irq);
 }
 
 /* The UART-specific handler, it will determine the interrupt type and read the data into RX buffer or transmit the data from TX buffer */
@@ -63,27 +102,30 @@ void uart_irq_handler(void){
     // Determine interrupt type : On read this register bits[2:1] shows the interrupt ID bit
     unsigned int interrupt_id = ( regRead(AUX_MU_IIR_REG) >> 1) & 3;
     
-    // Receiver holds valid byte (interrupt ID : 0b10) i.e, UART Receive FIFO has some data
-    if (interrupt_id == 2){
-        // Read the datas until RX FIFO is empty and store them into RX buffer if RX buffer has enough space
-        while( regRead(AUX_MU_LSR_REG) & 0x1 ){ // Check if RX FIFO is empty
-            // Read the data from RX FIFO
-            char data = regRead(AUX_MU_IO_REG) & 0xFF;
-            
-            // Store the data into RX buffer if RX buffer has enough space
-            if( !rx_buffer_is_full() ){
-                rx_buffer[rx_head] = data;
-                rx_head = (rx_head + 1) % UART_BUFFER_SIZE; // Advance the head in RX buffer
-            }
+    int rx_old_head = rx_head;
+    int tx_old_tail = tx_tail;
+
+    // Always drain the RX FIFO, bytes may arrive while a TX interrupt is being served
+    // Read the datas until RX FIFO is empty and store them into RX buffer if RX buffer has enough space
+    while( regRead(AUX_MU_LSR_REG) & 0x1 ){ // Check if RX FIFO is empty
+        // Read the data from RX FIFO
+        char data = regRead(AUX_MU_IO_REG) & 0xFF;
+        
+        // Store the data into RX buffer if RX buffer has enough space
+        if( !rx_buffer_is_full() ){
+            rx_buffer[rx_head] = data;
+            rx_head = (rx_head + 1) & UART_BUFFER_MASK; // Advance the head in RX buffer
         }
     }
     
     // Transmit holding register empty (interrupt ID : 0b01) i.e, UART Transmit FIFO is empty
-    else if( interrupt_id == 1 ){
-        // If the TX buffer has data need to be transmit, then write the data from TX buffer into UART TX FIFO  
-        if( tx_head != tx_tail ){
+    if( interrupt_id == 1 ){
+        // Refill the whole TX FIFO in one interrupt instead of one byte per interrupt
+        // 先讀一次 AUX_MU_STAT_REG 算出 FIFO 還有幾格空位，再連續寫進去
+        int room = MUART_TX_FIFO_SIZE - MUART_TX_FIFO_LEVEL(regRead(AUX_MU_STAT_REG));
+        while( room-- > 0 && tx_head != tx_tail ){
             regWrite(AUX_MU_IO_REG, tx_buffer[tx_tail]);    // Write the data from TX buffer into UART TX FIFO 
-            tx_tail = (tx_tail + 1) % UART_BUFFER_SIZE;     // Advance the tail in TX buffer
+            tx_tail = (tx_tail + 1) & UART_BUFFER_MASK;     // Advance the tail in TX buffer
         }
         
         // If TX buffer is empty, i.e, no data need to be transmitted, then disable TX interrupt (Enable TX interrupt when we need to transmit data)
@@ -92,8 +134,46 @@ void uart_irq_handler(void){
             regWrite(AUX_MU_IER_REG, ier & ~2);
         }
     }
+
+    // New input or free TX space : let the blocked readers / writers try again
+    if( rx_head != rx_old_head ){
+        wake_up(&rx_wait);
+    }
+    if( tx_tail != tx_old_tail ){
+        wake_up(&tx_wait);
+    }
+}
+
+/* The AUX interrupt is shared with SPI1 / SPI2, only take it when the mini UART has an interrupt pending */
+static void muart_irq_entry(void* data){
+    if (regRead(AUXIRQ) & 1){
+        uart_irq_handler();
+    }
+}
+
+/* The registers are still the fixed ones of registers.h, only accept the mini UART where they point to */
+static int muart_probe(struct device* dev){
+    if (dev->base != AUX_MU_IO_REG || dev->irq < 0){
+        muart_puts("Error: unsupported mini UART at ");
+        muart_send_hex(dev->base);
+        muart_puts("\r\n");
+        return -1;
+    }
+    muart_irq = dev->irq;
+    return request_irq(muart_irq, muart_irq_entry, IRQF_NO_AUTOEN, "muart", NULL);
 }
 
+static const char* const muart_compatible[] = { "brcm,bcm2835-aux-uart", NULL };
+
+struct driver muart_driver = {
+    .name = "muart",
+    .compatible = muart_compatible,
+    .probe = muart_probe,
+    .default_base = AUX_MU_IO_REG,
+    .default_size = 0x40,
+    .default_irq = IRQ_GPU(29),
+};
+
 /* Non-blocking read : Read the data from the Receive Buffer */
 size_t async_uart_read(char* buffer, size_t size){
     size_t count = 0;
@@ -101,7 +181,7 @@ size_t async_uart_read(char* buffer, size_t size){
     // Receive buffer is not empty, read the data from receive buffer and store into buffer
     while (count < size && rx_head != rx_tail ){
         buffer[count++] = rx_buffer[rx_tail];
-        rx_tail = (rx_tail + 1) % UART_BUFFER_SIZE;
+        rx_tail = (rx_tail + 1) & UART_BUFFER_MASK;
     }
     
     return count;   // How many bytes we read
@@ -114,7 +194,7 @@ size_t async_uart_write(const char* buffer, size_t size) {
 
     while(count < size && !tx_buffer_is_full()){
         tx_buffer[tx_head] = buffer[count++];
-        tx_head = (tx_head + 1) % UART_BUFFER_SIZE;
+        tx_head = (tx_head + 1) & UART_BUFFER_MASK;
     }
     
     // 如果 TX buffer 原本是 empty, 且現在放了 data 進去, 代表有資料要傳了, then enable TX interrupt
@@ -127,6 +207,134 @@ size_t async_uart_write(const char* buffer, size_t size) {
     return count;   // How many bytes we send
 }
 
+/**
+ * Blocking read : sleep until the RX buffer has data, then copy out what is there (at most size bytes)
+ * Returns a short count if less than size bytes are buffered, -1 if a signal arrives before any data
+ */
+long async_uart_read_wait(char* buffer, size_t size){
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    if( size == 0 ){
+        return 0;
+    }
+
+    disable_irq_in_el1();
+    while( rx_head == rx_tail ){
+        if( signal_pending(current) ){
+            enable_irq_in_el1();
+            return -1;
+        }
+        // The RX interrupt is only on while somebody waits for input, otherwise the polling shell owns the RX FIFO
+        regWrite(AUX_MU_IER_REG, regRead(AUX_MU_IER_REG) | 1);
+        sleep_on(&rx_wait);
+    }
+
+    // Copy in at most two pieces : up to the end of the buffer, then from the beginning
+    size_t used = (rx_head - rx_tail) & UART_BUFFER_MASK;
+    size_t count = (size < used) ? size : used;
+    size_t first = UART_BUFFER_SIZE - rx_tail;
+    if( first > count ){
+        first = count;
+    }
+    memcpy(buffer, &rx_buffer[rx_tail], first);
+    memcpy(buffer + first, rx_buffer, count - first);
+    rx_tail = (rx_tail + count) & UART_BUFFER_MASK;
+
+    if( list_empty(&rx_wait.task_list) ){
+        regWrite(AUX_MU_IER_REG, regRead(AUX_MU_IER_REG) & ~1);
+    }
+    enable_irq_in_el1();
+
+    return count;
+}
+
+/**
+ * Blocking write : copy the data into the TX buffer, sleep whenever it is full until the TX interrupt makes room
+ * Returns size, or the bytes written so far (-1 if none) when a signal arrives
+ */
+long async_uart_write_wait(const char* buffer, size_t size){
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    size_t written = 0;
+
+    disable_irq_in_el1();
+    while( written < size ){
+        size_t n = async_uart_write(buffer + written, size - written);
+        written += n;
+        if( written == size ){
+            break;
+        }
+        if( n == 0 ){
+            if( signal_pending(current) ){
+                break;
+            }
+            sleep_on(&tx_wait);
+        }
+    }
+    enable_irq_in_el1();
+
+    return written ? (long)written : -1;
+}
+
+/* Free space in the TX buffer */
+size_t async_uart_tx_space(void){
+    return (tx_tail - tx_head - 1) & UART_BUFFER_MASK;
+}
+
+/* Transmit everything left in the TX buffer by polling, for when interrupts can't be relied on anymore (panic) */
+void async_uart_flush_sync(void){
+    // No TX interrupt is needed anymore
+    regWrite(AUX_MU_IER_REG, regRead(AUX_MU_IER_REG) & ~2);
+
+    while( tx_head != tx_tail ){
+        muart_send_sync(tx_buffer[tx_tail]);
+        tx_tail = (tx_tail + 1) & UART_BUFFER_MASK;
+    }
+}
+
+/* Poll the bytes out, bypassing the TX buffer */
+static size_t async_uart_write_sync(const char* buffer, size_t size){
+    for( size_t i = 0; i < size; i++ ){
+        muart_send_sync(buffer[i]);
+    }
+    return size;
+}
+
+/*
+ * Polling read for the shell : the interrupt handler drains the RX FIFO whenever it runs (e.g. for TX after every print),
+ * so the bytes it took come first, then the ones still in the FIFO
+ */
+static char async_uart_getc_sync(void){
+    // Check both with the interrupt masked, a byte taken by the handler between the two checks would be missed until the next one
+    while( 1 ){
+        unsigned long flags = irq_save();
+        if( rx_head != rx_tail ){
+            char c = rx_buffer[rx_tail];
+            rx_tail = (rx_tail + 1) & UART_BUFFER_MASK;
+            irq_restore(flags);
+            return c;
+        }
+        if( regRead(AUX_MU_LSR_REG) & 0x1 ){
+            char c = regRead(AUX_MU_IO_REG) & 0xFF;
+            irq_restore(flags);
+            return c;
+        }
+        irq_restore(flags);
+    }
+}
+
+/* The mini UART as a console device */
+struct char_device muart_device = {
+    .name       = "mini UART",
+    .init       = async_uart_tx_init,
+    .write      = async_uart_write,
+    .tx_space   = async_uart_tx_space,
+    .read_wait  = async_uart_read_wait,
+    .write_wait = async_uart_write_wait,
+    .write_sync = async_uart_write_sync,
+    .getc_sync  = async_uart_getc_sync,
+    .flush_sync = async_uart_flush_sync,
+};
+
 /* Non-blocking puts for strings */
 size_t async_uart_puts(const char* str) {
     if (str == NULL) {
@@ -209,8 +417,8 @@ void async_uart_example(){
     // Disable EL1 interrupts
     disable_irq_in_el1();
 
-    // Disable muart interrupt
-    disable_uart_int();
+    // Disable muart RX interrupt, the kernel console still transmits through the TX interrupt
+    regWrite(AUX_MU_IER_REG, regRead(AUX_MU_IER_REG) & ~1);
     
     muart_puts("Exiting async UART example\r\n");
 }
\ No newline at end of file
@@ -1,61 +1,409 @@
 #include "bootloader.h"
 #include "muart.h"
 #include "utils.h"
+#include "registers.h"
+#include "timer.h"
+#include "crc32.h"
+#include "lz4.h"
+#include "fdt.h"
+
+/* The kernel image (plus the in-place margin) must end below the bootloader's stack (stack_top in linker.ld) */
+#define BOOT_IMAGE_MAX      0x380000
+
+/* Room kept behind a device tree for the properties added by fdt_set_initrd */
+#define BOOT_DTB_SLACK      0x1000
+
+/* Load address and room of each payload, indexed by BOOT_PAYLOAD_* */
+static const struct {
+    unsigned long addr;
+    unsigned long max;
+} boot_payloads[BOOT_PAYLOAD_NUM] = {
+    [BOOT_PAYLOAD_KERNEL]    = { KERNEL_LOAD_ADDR, BOOT_IMAGE_MAX },
+    [BOOT_PAYLOAD_INITRAMFS] = { INITRAMFS_LOAD_ADDR, INITRAMFS_MAX },
+    [BOOT_PAYLOAD_DTB]       = { DTB_LOAD_ADDR, DTB_MAX - BOOT_DTB_SLACK },
+};
+
+/* Clock of the mini UART : the VPU core clock, kept at 250MHz by core_freq=250 in config.txt */
+#define BOOT_CORE_CLOCK     250000000
+
+/* AUX_MU_BAUD value for the rate, 0 if the closest one is more than 1.5% off */
+static unsigned int muart_baud_reg(unsigned int baud){
+    if (baud == 0){
+        return 0;
+    }
+    // baud = core clock / (8 * (AUX_MU_BAUD + 1)), round to the closest divisor
+    unsigned long reg = (BOOT_CORE_CLOCK + 4UL * baud) / (8UL * baud) - 1;
+    if (reg == 0 || reg > 0xFFFF){
+        return 0;
+    }
+    unsigned long actual = BOOT_CORE_CLOCK / (8 * (reg + 1));
+    unsigned long error = (actual > baud) ? actual - baud : baud - actual;
+    if (error * 1000 > baud * 15UL){
+        return 0;
+    }
+    return reg;
+}
+
+/* Switch the mini UART to another AUX_MU_BAUD once the last response has left the transmitter */
+static void muart_set_baud(unsigned int reg){
+    while ( !(regRead(AUX_MU_LSR_REG) & 0x40) ){
+        // Wait for the transmitter to be idle
+    }
+    regWrite(AUX_MU_CNTL_REG, 0);
+    regWrite(AUX_MU_BAUD, reg);
+    regWrite(AUX_MU_IIR_REG, 6);        // Clear the rx and tx FIFO, what was received at the old rate is garbage
+    regWrite(AUX_MU_CNTL_REG, 3);
+}
+
+static void muart_reset_baud(void){
+    muart_set_baud(muart_baud_reg(BOOT_DEFAULT_BAUD));
+}
+
+/* Counter value ms milliseconds from now */
+static unsigned long boot_deadline(unsigned long ms){
+    return get_cntpct_el0() + get_cntfrq_el0() * ms / 1000;
+}
+
+/* Receive a byte, -1 if nothing arrives before the deadline */
+static int muart_receive_timeout(unsigned long deadline){
+    while ( !(regRead(AUX_MU_LSR_REG) & 1) ){
+        if (get_cntpct_el0() >= deadline){
+            return -1;
+        }
+    }
+    return regRead(AUX_MU_IO_REG) & 0xFF;
+}
+
+/* Send a 4-byte response, see bootloader.h */
+static void boot_respond(unsigned char code, unsigned int seq){
+    unsigned char lo = seq & 0xFF;
+    unsigned char hi = (seq >> 8) & 0xFF;
+    muart_send_sync(code);
+    muart_send_sync(lo);
+    muart_send_sync(hi);
+    muart_send_sync(code ^ lo ^ hi);
+}
+
+/*
+ * Skip everything until the signature of a header or of a baud rate request and return it
+ * The host resends its request until it is answered, so resync on the signature instead of trusting the first bytes
+ */
+static unsigned int wait_request(void){
+    unsigned int window = 0;
+    while (window != BOOT_SIGNATURE && window != BOOT_BAUD_SIGNATURE){
+        window = (window >> 8) | ((unsigned int)(unsigned char)muart_receive() << 24);
+    }
+    return window;
+}
+
+/* Handle a baud rate request whose signature has been received, see bootloader.h */
+static void negotiate_baud(void){
+    baud_req_t req;
+    unsigned char* req_ptr = (unsigned char*)&req;
+
+    req.signature = BOOT_BAUD_SIGNATURE;
+    for (int i = sizeof(req.signature); i < sizeof(baud_req_t); i++){
+        req_ptr[i] = muart_receive();
+    }
+
+    unsigned int reg = 0;
+    if (crc32(&req, sizeof(baud_req_t) - sizeof(req.crc)) == req.crc){
+        reg = muart_baud_reg(req.baud);
+    }
+    if (reg == 0){
+        boot_respond(BOOT_RESP_BAUD_BAD, 0);
+        return;
+    }
+    boot_respond(BOOT_RESP_BAUD_OK, 0);
+    muart_set_baud(reg);
+
+    // Test pattern at the new rate, every byte value once
+    unsigned long deadline = boot_deadline(BOOT_BAUD_TIMEOUT_MS);
+    for (int i = 0; i < BOOT_BAUD_TEST_LEN; i++){
+        if (muart_receive_timeout(deadline) != (i & 0xFF)){
+            muart_reset_baud();
+            boot_respond(BOOT_RESP_BAUD_BAD, 1);
+            return;
+        }
+    }
+    boot_respond(BOOT_RESP_BAUD_OK, 1);
+
+    // Stay at the new rate only if the host heard the answer, otherwise it is back at the default rate already
+    const unsigned char confirm[4] = {BOOT_RESP_BAUD_OK, 2, 0, BOOT_RESP_BAUD_OK ^ 2};
+    deadline = boot_deadline(BOOT_BAUD_TIMEOUT_MS);
+    for (int i = 0; i < 4; i++){
+        if (muart_receive_timeout(deadline) != confirm[i]){
+            muart_reset_baud();
+            return;
+        }
+    }
+}
+
+/*
+ * Read the rest of the header after its signature, return 0 if its CRC32 and fields are valid
+ * received is the bit mask of the payloads already received, the kernel must be there before the last payload
+ */
+static int receive_header(header_t* header, unsigned int received){
+    unsigned char* header_ptr = (unsigned char*)header;
+
+    header->signature = BOOT_SIGNATURE;
+    for (int i = sizeof(header->signature); i < sizeof(header_t); i++){
+        header_ptr[i] = muart_receive();
+    }
+
+    if (crc32(header, sizeof(header_t) - sizeof(header->header_crc)) != header->header_crc){
+        return -1;
+    }
+    if (header->block_size == 0 || header->block_size > BOOT_BLOCK_SIZE_MAX){
+        return -1;
+    }
+    if (header->type >= BOOT_PAYLOAD_NUM){
+        return -1;
+    }
+    if (!(header->flags & BOOT_FLAG_MORE) && header->type != BOOT_PAYLOAD_KERNEL && !(received & (1 << BOOT_PAYLOAD_KERNEL))){
+        return -1;
+    }
+    if (header->raw_size + LZ4_INPLACE_MARGIN(header->size) > boot_payloads[header->type].max){
+        return -1;
+    }
+    if (!(header->flags & BOOT_FLAG_LZ4) && header->size != header->raw_size){
+        return -1;
+    }
+    // The last seq must fit in 16 bits and stay below BOOT_SEQ_ABORT
+    if (((unsigned long)header->size + header->block_size - 1) / header->block_size >= BOOT_SEQ_ABORT){
+        return -1;
+    }
+    if (header->size > header->raw_size + LZ4_INPLACE_MARGIN(header->size)){
+        return -1;
+    }
+    return 0;
+}
+
+/* Check the header of a device tree of at most size bytes */
+static int boot_dtb_valid(const void* dtb, unsigned long size){
+    const fdt_header* header = dtb;
+    if (dtb == NULL || __builtin_bswap32(header->magic) != FDT_MAGIC){
+        return 0;
+    }
+    return __builtin_bswap32(header->totalsize) <= size;
+}
+
+/* Wait for the 2-byte sync which starts a frame */
+static void wait_frame_sync(void){
+    unsigned char prev = 0;
+    while (1){
+        unsigned char c = muart_receive();
+        if (prev == BOOT_FRAME_SYNC0 && c == BOOT_FRAME_SYNC1){
+            return;
+        }
+        prev = c;
+    }
+}
+
+/**
+ * Receive size bytes into dst with the framed go-back-N protocol
+ * The CRC32 is updated as each byte arrives, so checking a frame costs nothing after its last byte
+ * and the 8-byte RX FIFO never waits for a whole block to be processed
+ * Returns 0 when every block is received, -1 if the host aborts the transfer
+ */
+static int receive_image(unsigned char* dst, unsigned int size, unsigned int block_size){
+    unsigned int nblocks = (size + block_size - 1) / block_size;
+    unsigned int expected = 0;      // Next block to accept
+    int nak_sent = 0;               // Only one NAK per error, the frames already on the way are dropped quietly
+
+    while (expected < nblocks){
+        wait_frame_sync();
+
+        unsigned int crc = CRC32_INIT;
+        unsigned char hdr[4];
+        for (int i = 0; i < 4; i++){
+            hdr[i] = muart_receive();
+            crc = crc32_byte(crc, hdr[i]);
+        }
+        unsigned int seq = hdr[0] | (hdr[1] << 8);
+        unsigned int len = hdr[2] | (hdr[3] << 8);
+
+        if (len > block_size){
+            // Corrupted length, look for the next sync
+            if (!nak_sent){
+                boot_respond(BOOT_RESP_NAK, expected);
+                nak_sent = 1;
+            }
+            continue;
+        }
+
+        // The expected block is written straight to its place, a bad one is overwritten by its retransmission
+        unsigned int want = (expected == nblocks - 1) ? size - expected * block_size : block_size;
+        int accept = (seq == expected && len == want);
+        unsigned char* p = dst + expected * block_size;
+        for (unsigned int i = 0; i < len; i++){
+            unsigned char c = muart_receive();
+            crc = crc32_byte(crc, c);
+            if (accept){
+                p[i] = c;
+            }
+        }
+
+        unsigned int rec_crc = 0;
+        for (int i = 0; i < 4; i++){
+            rec_crc |= (unsigned int)(unsigned char)muart_receive() << (8 * i);
+        }
+
+        if (crc32_final(crc) != rec_crc){
+            // The retransmission of the expected block is bad again, don't wait for the host to time out
+            if (!nak_sent || seq == expected){
+                boot_respond(BOOT_RESP_NAK, expected);
+                nak_sent = 1;
+            }
+        }
+        else if (seq == BOOT_SEQ_ABORT){
+            boot_respond(BOOT_RESP_FAIL, expected);
+            return -1;
+        }
+        else if (accept){
+            expected++;
+            nak_sent = 0;
+            boot_respond(BOOT_RESP_ACK, expected);
+        }
+        else if (seq < expected){
+            // Retransmission of a block we already have, the ACK was lost
+            boot_respond(BOOT_RESP_ACK, expected);
+        }
+        else if (!nak_sent){
+            // A frame before this one was lost
+            boot_respond(BOOT_RESP_NAK, expected);
+            nak_sent = 1;
+        }
+    }
+    return 0;
+}
 
 void bootloader_main(void* fdt_addr){
     // Initialize mini UART
     muart_init();
-    
+    crc32_init();
+
     muart_puts("Hello from the bootloader ! \r\n");
     muart_puts("bootloader main function is relocated at ");
     muart_send_hex((unsigned long)bootloader_main);
     muart_puts("\r\n");
-    muart_puts("Waiting for kernel transmiting ... \r\n");
 
-    // Receive header first
-    header_t header;
-    
-    // Since muart_receive() receives data one byte at a time, casting to unsigned char pointer to enable byte-by-byte access 
-    unsigned char* header_ptr = (unsigned char*)&header;
-    for (int i = 0; i < sizeof(header_t); i++){
-        header_ptr[i] = muart_receive();
+    /* Keep the device tree and the initrd from the firmware before any payload is loaded over them,
+     * the copy at DTB_LOAD_ADDR gets the initrd of an initramfs sent later */
+    unsigned long fw_initrd_start = 0;
+    unsigned long fw_initrd_end = 0;
+    int fw_initrd = 0;
+    int fw_dtb = boot_dtb_valid(fdt_addr, DTB_MAX - BOOT_DTB_SLACK);
+    if (fw_dtb){
+        fw_initrd = (fdt_get_initrd(fdt_addr, &fw_initrd_start, &fw_initrd_end) == 0);
+        const unsigned char* src = fdt_addr;
+        unsigned char* dst = (unsigned char*)DTB_LOAD_ADDR;
+        for (unsigned int i = 0; i < __builtin_bswap32(((const fdt_header*)fdt_addr)->totalsize); i++){
+            dst[i] = src[i];
+        }
     }
 
-    // Validate the signature
-    if (header.signature != BOOT_SIGNATURE){
-        muart_puts("ERROR: Invalid signature!\r\n");
-        return;
-    }
-    
-    /* Receive kernel8.img
-     * Set a pointer to the memory location where the kernel will be loaded
-     * Cast the memory address to an unsigned char pointer to enable byte-by-byte access
-     * Write the kernel data (in bytes) to Raspi's starting address (0x80000) */
-    unsigned char* kernel_ptr = (unsigned char*)KERNEL_LOAD_ADDR;
-    for (int i = 0; i < header.size; i++) {
-        kernel_ptr[i] = muart_receive();
-    }
-    
-    muart_puts("Kernel transmit complete. Validating checksum...\r\n");
+    muart_puts("Waiting for kernel transmiting ... \r\n");
+
+    unsigned int received = 0;          // Bit mask of the payloads received
+    unsigned int initramfs_size = 0;
+    while (1){
+        unsigned int request = wait_request();
+        if (request == BOOT_BAUD_SIGNATURE){
+            negotiate_baud();
+            continue;
+        }
+
+        // Any failure below brings the link back to the default rate, where the host starts again
+        header_t header;
+        if (receive_header(&header, received) != 0){
+            boot_respond(BOOT_RESP_HDR_BAD, 0);
+            muart_reset_baud();
+            continue;
+        }
+        boot_respond(BOOT_RESP_HDR_OK, 0);
+
+        /* Receive the payload (kernel8.img to Raspi's starting address 0x80000)
+         * An uncompressed image is written to its load address directly,
+         * a compressed one to the end of the payload's area so it can be decompressed in place */
+        unsigned char* image_ptr = (unsigned char*)boot_payloads[header.type].addr;
+        unsigned char* recv_ptr = image_ptr;
+        if (header.flags & BOOT_FLAG_LZ4){
+            recv_ptr = image_ptr + header.raw_size + LZ4_INPLACE_MARGIN(header.size) - header.size;
+        }
+        received &= ~(1 << header.type);
+        if (header.type == BOOT_PAYLOAD_DTB){
+            // The copy of the firmware's device tree is overwritten from now on
+            fw_dtb = 0;
+        }
+        if (receive_image(recv_ptr, header.size, header.block_size) != 0){
+            // The host gives up on this rate and will negotiate a lower one
+            muart_reset_baud();
+            continue;
+        }
 
-    // Validate the checksum
-    unsigned long rec_checksum = 0;
-    for (int i = 0; i < header.size; i++) {
-        rec_checksum += kernel_ptr[i];
+        if (header.flags & BOOT_FLAG_LZ4){
+            long n = lz4_decompress(recv_ptr, header.size, image_ptr, header.raw_size);
+            if (n != header.raw_size){
+                boot_respond(BOOT_RESP_FAIL, 0);
+                muart_reset_baud();
+                muart_puts("ERROR: Failed to decompress the image!\r\n");
+                continue;
+            }
+        }
+
+        // Validate the checksum
+        if (crc32(image_ptr, header.raw_size) != header.checksum){
+            boot_respond(BOOT_RESP_FAIL, 0);
+            muart_reset_baud();
+            muart_puts("ERROR: Checksum verification failed!\r\n");
+            continue;
+        }
+        if (header.type == BOOT_PAYLOAD_DTB && !boot_dtb_valid(image_ptr, header.raw_size)){
+            boot_respond(BOOT_RESP_FAIL, 0);
+            muart_reset_baud();
+            muart_puts("ERROR: Not a device tree!\r\n");
+            continue;
+        }
+        boot_respond(BOOT_RESP_DONE, 0);
+
+        received |= 1 << header.type;
+        if (header.type == BOOT_PAYLOAD_INITRAMFS){
+            initramfs_size = header.raw_size;
+        }
+        if (!(header.flags & BOOT_FLAG_MORE)){
+            break;
+        }
     }
-    rec_checksum &= 0xFF;
-    
 
-    if (rec_checksum != header.checksum) {
-        muart_puts("ERROR: Checksum verification failed!\r\n");
-        return;
+    // Point the kernel at the initramfs through the device tree, the kernel reads it with get_initramfs_address
+    void* dtb = fdt_addr;
+    if (received & ((1 << BOOT_PAYLOAD_INITRAMFS) | (1 << BOOT_PAYLOAD_DTB))){
+        if ((received & (1 << BOOT_PAYLOAD_DTB)) || fw_dtb){
+            int err = 0;
+            dtb = (void*)DTB_LOAD_ADDR;
+            if (received & (1 << BOOT_PAYLOAD_INITRAMFS)){
+                err = fdt_set_initrd(dtb, DTB_MAX, INITRAMFS_LOAD_ADDR, INITRAMFS_LOAD_ADDR + initramfs_size);
+            }
+            else if (fw_initrd){
+                err = fdt_set_initrd(dtb, DTB_MAX, fw_initrd_start, fw_initrd_end);
+            }
+            if (err != 0){
+                muart_puts("WARNING: Failed to set the initrd in the device tree!\r\n");
+            }
+        }
+        else{
+            muart_puts("WARNING: No device tree to pass the initramfs to the kernel!\r\n");
+        }
     }
-    
+
     muart_puts("Checksum valid. Jumping to kernel at ");
     muart_send_hex(KERNEL_LOAD_ADDR);
+    muart_puts(", device tree at ");
+    muart_send_hex((unsigned long)dtb);
     muart_puts("...\r\n");
 
-    // Jump to kernel using function pointer, pass the fdt_addr as the parameter (will be stored in x0 reg in kernel/boot.S)
+    // Jump to kernel using function pointer, pass the device tree as the parameter (will be stored in x0 reg in kernel/boot.S)
     void (*kernel_entry)(void*) = (void (*)(void*))KERNEL_LOAD_ADDR;
-    kernel_entry(fdt_addr);
-}
\ No newline at end of file
+    kernel_entry(dtb);
+}
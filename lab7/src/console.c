@@ -0,0 +1,101 @@
+#include "console.h"
+#include "chardev.h"
+#include "muart.h"
+#include "exception.h"
+#include "types.h"
+
+// UART behind the console, the PL011 is selected with `make CONSOLE=pl011`
+#ifdef CONSOLE_PL011
+static struct char_device* console_dev = &pl011_device;
+#else
+static struct char_device* console_dev = &muart_device;
+#endif
+
+static unsigned long console_dropped;   // Bytes dropped because the TX ring was full, not reported yet
+static int console_ready;               // Set by console_init(), the output is still the polled mini UART before
+
+/* "\r\n[console: N bytes dropped]\r\n", return its length */
+static size_t console_format_dropped(char* mark, unsigned long dropped) {
+    const char* head = "\r\n[console: ";
+    const char* tail = " bytes dropped]\r\n";
+    char digits[20];
+    size_t n = 0;
+    int d = 0;
+
+    do {
+        digits[d++] = '0' + dropped % 10;
+        dropped /= 10;
+    } while (dropped);
+
+    while (*head) {
+        mark[n++] = *head++;
+    }
+    while (d > 0) {
+        mark[n++] = digits[--d];
+    }
+    while (*tail) {
+        mark[n++] = *tail++;
+    }
+    return n;
+}
+
+/**
+ * Output backend of muart : copy the bytes into the TX ring, never wait for the UART
+ * It is called from both tasks and interrupt handlers, so the ring is only touched with interrupts disabled
+ */
+static size_t console_write(const char* buf, size_t size) {
+    unsigned long flags = irq_save();
+
+    // Tell where output was lost as soon as the mark fits
+    if (console_dropped) {
+        char mark[64];
+        size_t len = console_format_dropped(mark, console_dropped);
+        if (console_dev->tx_space() >= len) {
+            console_dev->write(mark, len);
+            console_dropped = 0;
+        }
+    }
+
+    size_t written = 0;
+    if (!console_dropped) {     // Don't let a later message slip in before the mark
+        written = console_dev->write(buf, size);
+    }
+    console_dropped += size - written;
+
+    irq_restore(flags);
+    return written;
+}
+
+struct char_device* console_device(void) {
+    return console_dev;
+}
+
+void console_init(void) {
+    console_dev->init();
+    muart_set_input(console_dev->getc_sync);
+    muart_set_output(console_write);
+    console_ready = 1;
+    muart_puts("Console output is buffered by the ");
+    muart_puts(console_dev->name);
+    muart_puts("\r\n");
+}
+
+void console_panic(void) {
+    disable_irq_in_el1();
+
+    // The early output is already synchronous, and the PL011 may not be set up yet
+    if (!console_ready) {
+        return;
+    }
+
+    // Keep the order : what is already in the ring goes out first
+    muart_set_output(console_dev->write_sync);
+    console_dev->flush_sync();
+
+    if (console_dropped) {
+        char mark[64];
+        size_t len = console_format_dropped(mark, console_dropped);
+        console_dev->write_sync(mark, len);
+        console_dropped = 0;
+    }
+}
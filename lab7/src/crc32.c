@@ -0,0 +1,26 @@
+#include "crc32.h"
+
+unsigned int crc32_table[256];
+
+/* Build the byte-at-a-time lookup table of the reflected polynomial */
+void crc32_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc32_table[i] = c;
+    }
+}
+
+unsigned int crc32_update(unsigned int crc, const void* buf, size_t len) {
+    const unsigned char* p = (const unsigned char*)buf;
+    while (len--) {
+        crc = crc32_byte(crc, *p++);
+    }
+    return crc;
+}
+
+unsigned int crc32(const void* buf, size_t len) {
+    return crc32_final(crc32_update(CRC32_INIT, buf, len));
+}
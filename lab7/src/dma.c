@@ -0,0 +1,81 @@
+#include "dma.h"
+#include "registers.h"
+#include "utils.h"
+#include "driver.h"
+#include "muart.h"
+
+// The DMA controller found by dma_probe(), NULL until then
+static struct device* dma_device = NULL;
+
+/* Reset the channel and set its global enable bit */
+void dma_init_channel(int ch) {
+    regWrite(DMA_ENABLE, regRead(DMA_ENABLE) | (1 << ch));
+    regWrite(DMA_CS(ch), DMA_CS_RESET);
+    while (regRead(DMA_CS(ch)) & DMA_CS_RESET) {
+        // Wait for the reset to finish
+    }
+    regWrite(DMA_DEBUG(ch), 7);     // Clear the read error / FIFO error / read last not set error
+}
+
+/* Start the transfer described by cb on the channel, the channel must be idle */
+void dma_start(int ch, volatile struct dma_cb* cb) {
+    // The CB must be in memory before the engine fetches it
+    __asm__ volatile("dsb sy" ::: "memory");
+
+    regWrite(DMA_CS(ch), DMA_CS_END | DMA_CS_INT);
+    regWrite(DMA_CONBLK_AD(ch), DMA_BUS_ADDR(cb));
+    regWrite(DMA_CS(ch), DMA_CS_ACTIVE);
+}
+
+int dma_busy(int ch) {
+    return regRead(DMA_CS(ch)) & DMA_CS_ACTIVE;
+}
+
+/* Acknowledge the END / INT of a finished transfer, return -1 if the channel stopped on an error */
+int dma_ack(int ch) {
+    unsigned int cs = regRead(DMA_CS(ch));
+
+    regWrite(DMA_CS(ch), DMA_CS_END | DMA_CS_INT);
+
+    // Writes done by the engine must be visible before the CPU reads the destination
+    __asm__ volatile("dsb sy" ::: "memory");
+
+    if (cs & DMA_CS_ERROR) {
+        dma_init_channel(ch);
+        return -1;
+    }
+    return 0;
+}
+
+/* Linear IRQ number of a channel (the interrupts of the DMA node are listed by channel) */
+int dma_channel_irq(int ch) {
+    int irq = -1;
+
+    if (dma_device && dma_device->node) {
+        irq = device_get_irq(dma_device, ch);
+    }
+    return (irq >= 0) ? irq : DMA_DEFAULT_IRQ(ch);
+}
+
+/* The registers are still the fixed ones of registers.h, only accept the controller where they point to */
+static int dma_probe(struct device* dev) {
+    if (dev->base != DMA_BASE) {
+        muart_puts("Error: unsupported DMA controller at ");
+        muart_send_hex(dev->base);
+        muart_puts("\r\n");
+        return -1;
+    }
+    dma_device = dev;
+    return 0;
+}
+
+static const char* const dma_compatible[] = { "brcm,bcm2835-dma", NULL };
+
+struct driver dma_driver = {
+    .name = "dma",
+    .compatible = dma_compatible,
+    .probe = dma_probe,
+    .default_base = DMA_BASE,
+    .default_size = 0xF00,
+    .default_irq = DMA_DEFAULT_IRQ(0),
+};
@@ -0,0 +1,229 @@
+#include "driver.h"
+#include "irq.h"
+#include "malloc.h"
+#include "string.h"
+#include "muart.h"
+
+/* Drivers probed by driver_probe_all(), the interrupt controllers must come before the devices using them */
+static struct driver* const drivers[] = {
+    &local_intc_driver,
+    &armctrl_driver,
+    &arm_timer_driver,
+    &dma_driver,
+    &muart_driver,
+    &pl011_driver,
+    &mailbox_driver,
+};
+
+#define NR_DRIVERS (sizeof(drivers) / sizeof(drivers[0]))
+
+/* Read a number of n big-endian cells and advance the pointer */
+static unsigned long read_cells(const unsigned int** cells, unsigned int n){
+    unsigned long value = 0;
+    for (unsigned int i = 0; i < n; i++){
+        value = (value << 32) | __builtin_bswap32(*(*cells)++);
+    }
+    return value;
+}
+
+/*
+ * Translate an address of the bus of node through the ranges of its ancestors
+ * Each entry of ranges is (child bus address, parent bus address, size), an empty ranges is a 1:1 mapping
+ */
+unsigned long fdt_translate_address(const fdt_node_t* node, unsigned long addr){
+    const fdt_node_t* bus = node->parent;
+
+    // The root bus is the ARM physical address space
+    while (bus && bus->parent){
+        unsigned int len;
+        const unsigned int* ranges = fdt_node_get_property(bus, "ranges", &len);
+        if (!ranges){
+            return FDT_BAD_ADDR;
+        }
+
+        unsigned int child_cells = bus->address_cells;
+        unsigned int parent_cells = bus->parent->address_cells;
+        unsigned int size_cells = bus->size_cells;
+        unsigned int entry_size = (child_cells + parent_cells + size_cells) * sizeof(unsigned int);
+        if (len > 0){
+            unsigned int n = len / entry_size;
+            unsigned int i;
+            for (i = 0; i < n; i++){
+                unsigned long child = read_cells(&ranges, child_cells);
+                unsigned long parent = read_cells(&ranges, parent_cells);
+                unsigned long size = read_cells(&ranges, size_cells);
+                if (addr >= child && addr - child < size){
+                    addr = addr - child + parent;
+                    break;
+                }
+            }
+            if (i == n){
+                return FDT_BAD_ADDR;
+            }
+        }
+        bus = bus->parent;
+    }
+    return addr;
+}
+
+/* The interrupt controller of a node, interrupt-parent is inherited from the ancestors */
+static const fdt_node_t* fdt_interrupt_parent(const fdt_node_t* node){
+    for ( ; node; node = node->parent){
+        fdt_node_t* intc = fdt_node_parse_phandle(node, "interrupt-parent", 0);
+        if (intc){
+            return intc;
+        }
+    }
+    return NULL;
+}
+
+/* Linear IRQ number of the index-th interrupt of a node, see irq.h for the specifiers */
+int fdt_node_get_irq(const fdt_node_t* node, unsigned int index){
+    const fdt_node_t* intc = fdt_interrupt_parent(node);
+    unsigned int cells, spec0, spec1;
+
+    if (!intc || fdt_node_read_u32(intc, "#interrupt-cells", 0, &cells) != 0 || cells < 1){
+        return -1;
+    }
+    if (fdt_node_read_u32(node, "interrupts", index * cells, &spec0) != 0){
+        return -1;
+    }
+
+    // <bank irq>, bank 0 is the basic pending register, bank 1 / 2 are IRQ_PEND1 / IRQ_PEND2
+    if (fdt_node_is_compatible(intc, "brcm,bcm2836-armctrl-ic") || fdt_node_is_compatible(intc, "brcm,bcm2835-armctrl-ic")){
+        if (cells < 2 || fdt_node_read_u32(node, "interrupts", index * cells + 1, &spec1) != 0 || spec1 >= 32){
+            return -1;
+        }
+        if (spec0 == 0){
+            return (spec1 < 8) ? IRQ_BASIC(spec1) : -1;
+        }
+        if (spec0 == 1 || spec0 == 2){
+            return IRQ_GPU((spec0 - 1) * 32 + spec1);
+        }
+        return -1;
+    }
+
+    // <irq flags>, the bit of CORE0_IRQ_SRC
+    if (fdt_node_is_compatible(intc, "brcm,bcm2836-l1-intc")){
+        return (spec0 < 32) ? IRQ_LOCAL(spec0) : -1;
+    }
+    return -1;
+}
+
+int device_get_irq(const struct device* dev, unsigned int index){
+    if (dev->node){
+        return fdt_node_get_irq(dev->node, index);
+    }
+    return (index == 0) ? dev->irq : -1;
+}
+
+/* A node without status, or with status "okay" / "ok", is enabled */
+static int fdt_node_is_available(const fdt_node_t* node){
+    unsigned int len;
+    const char* status = fdt_node_get_property(node, "status", &len);
+    if (!status){
+        return 1;
+    }
+    return strcmp(status, "okay") == 0 || strcmp(status, "ok") == 0;
+}
+
+/* Fill the device of a node, return -1 if its reg can't be translated */
+static int device_from_node(struct device* dev, fdt_node_t* node){
+    unsigned long addr = 0, size = 0;
+
+    dev->name = node->name;
+    dev->node = node;
+    dev->base = 0;
+    dev->size = 0;
+    dev->irq = fdt_node_get_irq(node, 0);
+
+    // Devices such as the ARM timer have no reg
+    if (fdt_node_read_reg(node, 0, &addr, &size) == 0){
+        dev->base = fdt_translate_address(node, addr);
+        dev->size = size;
+        if (dev->base == FDT_BAD_ADDR){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int driver_probe_device(struct driver* drv, struct device* dev){
+    int err = drv->probe(dev);
+
+    #if LOG_DRIVER
+    muart_puts("[driver] ");
+    muart_puts(drv->name);
+    muart_puts(" : ");
+    muart_puts(dev->name);
+    muart_puts(" at ");
+    muart_send_hex(dev->base);
+    muart_puts(", IRQ ");
+    muart_send_dec(dev->irq);
+    muart_puts(err ? " failed\r\n" : "\r\n");
+    #endif
+
+    if (err){
+        muart_puts("Error: probe of ");
+        muart_puts(dev->name);
+        muart_puts(" by ");
+        muart_puts(drv->name);
+        muart_puts(" failed\r\n");
+    }
+    return err;
+}
+
+/* Probe one driver against every enabled node it is compatible with */
+static int driver_probe(struct driver* drv){
+    int found = 0;
+    int failed = 0;
+
+    for (int i = 0; drv->compatible[i]; i++){
+        fdt_node_t* node = NULL;
+        while ((node = fdt_find_compatible(drv->compatible[i], node)) != NULL){
+            // A node listing several strings of the driver is only probed for the first one
+            int seen = 0;
+            for (int j = 0; j < i; j++){
+                seen |= fdt_node_is_compatible(node, drv->compatible[j]);
+            }
+            if (seen || !fdt_node_is_available(node)){
+                continue;
+            }
+            found++;
+
+            // The driver may keep the device
+            struct device* dev = simple_alloc(sizeof(struct device));
+            if (!dev || device_from_node(dev, node) != 0){
+                muart_puts("Error: can't map the registers of ");
+                muart_puts(node->path);
+                muart_puts("\r\n");
+                failed++;
+                continue;
+            }
+            failed += (driver_probe_device(drv, dev) != 0);
+        }
+    }
+
+    // Not described by the device tree, use the addresses this driver was written for
+    if (!found){
+        struct device* dev = simple_alloc(sizeof(struct device));
+        if (!dev){
+            return failed + 1;
+        }
+        dev->name = drv->name;
+        dev->node = NULL;
+        dev->base = drv->default_base;
+        dev->size = drv->default_size;
+        dev->irq = drv->default_irq;
+        failed += (driver_probe_device(drv, dev) != 0);
+    }
+    return failed;
+}
+
+int driver_probe_all(void){
+    int failed = 0;
+    for (unsigned int i = 0; i < NR_DRIVERS; i++){
+        failed += driver_probe(drivers[i]);
+    }
+    return failed;
+}
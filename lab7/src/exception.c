@@ -4,7 +4,8 @@
 #include "registers.h"
 #include "timer.h"
 #include "syscall.h"
-#include "async_uart.h"
+#include "irq.h"
+#include "console.h"
 #include "sched.h"
 
 /* The API to initialize the exception vector table */
@@ -26,11 +27,17 @@ void exception_table_init(){
 }
 
 void unexpected_irq_handler(){
+    // FIQ / SError or an unknown exception from EL0, print it synchronously so it isn't stuck in the console ring
+    console_panic();
+
     muart_puts("Unexpected IRQ \r\n");
 }
 
 /* The SVC-specific handler: print the system reg's content and handle system calls */ 
 void svc_handler(){
+    // Unexpected synchronous exception in the kernel, the console can't count on interrupts anymore
+    console_panic();
+
     // Call the assembly function to read the system register
     unsigned long spsr = get_spsr_el1();
     unsigned long elr = get_elr_el1();
@@ -72,39 +79,13 @@ void svc_handler(){
     }
 }
 
-/* High-level IRQ handler, determines the interrupt source and calls the specific handler */
+/* High-level IRQ handler, every source goes through the handler table (see irq.h) */
 void irq_entry(void) {
-    // Load the value of core 0 interrupt source
-    unsigned int irq_status = regRead(CORE0_IRQ_SRC);
-    
-    // Check if it's a timer interrupt (bit 1 stands for CNTPNSIRQ interrupt)
-    if (irq_status & 2){
-        // muart_puts("\r\nTimer interrupt received\r\n");
-        // If bit 1 is set, branch to timer-specific handler
-        timer_irq_handler();
-    }
-    // Check if it's a GPU IRQ signals (bit 8 stands for GPU interrupt)
-    else if ( irq_status & (1<<8) ){
-        // Check if it's an AUX interrupt (bit 29 in IRQ_PEND1 stands for AUX int is pending)
-        if ( regRead(IRQ_PEND1) & (1<<29) ){
-            // Check if it's the mini UART interrupt (bit 0 stands the mini UART has an interrupt pending)
-            if( regRead(AUXIRQ) & 1 ){ 
-                // branch to uart-specific IRQ handler
-                uart_irq_handler();
-            }
-            else{
-                // If we reach here, it's an unexpected IRQ
-                unexpected_irq_handler();         
-            }
-        }
-        else{
-            // If we reach here, it's an unexpected IRQ
-            unexpected_irq_handler(); 
-        }
+    irq_dispatch();
 
-    }
-    else{
-        // If we reach here, it's an unexpected IRQ
-        unexpected_irq_handler();
+    // Every pending source is handled, now it is safe to give the CPU to another thread
+    if (need_resched) {
+        need_resched = 0;
+        schedule();
     }
 }
\ No newline at end of file
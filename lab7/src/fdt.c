@@ -4,10 +4,14 @@
 #include "types.h"
 #include "muart.h"
 
-/* Convert big-endian 32-bit value to little-endian 32-bit value */
+/* Convert big-endian 32-bit value to little-endian 32-bit value, a single rev instruction */
 static inline unsigned int be_to_le32(unsigned int be32_val){
-    char* bytes = (char*)&be32_val;         // Casting to char* for byte-by-byte access
-    return (unsigned int)(bytes[0]<<24) | (unsigned int)(bytes[1]<<16) | (unsigned int)(bytes[2]<<8) | (unsigned int)(bytes[3]);
+    return __builtin_bswap32(be32_val);
+}
+
+/* Convert little-endian 32-bit value to big-endian 32-bit value, the same byte swap */
+static inline unsigned int le_to_be32(unsigned int le32_val){
+    return be_to_le32(le32_val);
 }
 
 /* 
@@ -162,4 +166,157 @@ unsigned long get_initramfs_address(const void* fdt){
         // Some error occurs
         return 1;
     }
-}
\ No newline at end of file
+}
+
+/* Callback function to find the "/chosen" node, data points to the node pointer to fill */
+static int chosen_callback(const void *fdt, const void *node_ptr, const char *node_name, int depth, void *data){
+    if( (depth == 1) && (strcmp(node_name, "chosen") == 0) ){
+        *(const void**)data = node_ptr;
+        return 0;
+    }
+    return 1;
+}
+
+/* Read a property of one or two cells (32-bit or 64-bit value), prop_val_ptr is returned by fdt_get_property */
+static int fdt_read_cells(const unsigned int* prop_val_ptr, unsigned long* value){
+    unsigned int len = be_to_le32(prop_val_ptr[-2]);   // len and nameoff are stored right before the value
+    if (len == 4){
+        *value = be_to_le32(prop_val_ptr[0]);
+        return 0;
+    }
+    if (len == 8){
+        *value = ((unsigned long)be_to_le32(prop_val_ptr[0]) << 32) | be_to_le32(prop_val_ptr[1]);
+        return 0;
+    }
+    return -1;
+}
+
+/* Read linux,initrd-start / linux,initrd-end of the /chosen node */
+int fdt_get_initrd(const void* fdt, unsigned long* start, unsigned long* end){
+    const void* chosen = NULL;
+    fdt_traverse(fdt, chosen_callback, &chosen);
+    if (!chosen){
+        return -1;
+    }
+
+    const unsigned int* start_ptr = fdt_get_property(fdt, chosen, "linux,initrd-start");
+    const unsigned int* end_ptr = fdt_get_property(fdt, chosen, "linux,initrd-end");
+    if (!start_ptr || !end_ptr){
+        return -1;
+    }
+    if (fdt_read_cells(start_ptr, start) != 0 || fdt_read_cells(end_ptr, end) != 0){
+        return -1;
+    }
+    return 0;
+}
+
+/* 
+ * Open n zeroed bytes at offset `at` of the blob, everything behind it moves n bytes up
+ * Blocks starting behind `at` move with it, the block containing `at` is grown by the caller
+ */
+static int fdt_splice(void* fdt, size_t bufsize, unsigned int at, unsigned int n){
+    fdt_header* header = fdt;
+    char* blob = fdt;
+    unsigned int totalsize = be_to_le32(header->totalsize);
+
+    if (at > totalsize || totalsize + n > bufsize){
+        return -1;
+    }
+
+    // Copy from the end, the areas overlap
+    for (unsigned int i = totalsize; i > at; i--){
+        blob[i - 1 + n] = blob[i - 1];
+    }
+    for (unsigned int i = 0; i < n; i++){
+        blob[at + i] = 0;
+    }
+
+    header->totalsize = le_to_be32(totalsize + n);
+    if (be_to_le32(header->off_dt_struct) > at){
+        header->off_dt_struct = le_to_be32(be_to_le32(header->off_dt_struct) + n);
+    }
+    if (be_to_le32(header->off_dt_strings) > at){
+        header->off_dt_strings = le_to_be32(be_to_le32(header->off_dt_strings) + n);
+    }
+    if (be_to_le32(header->off_mem_rsvmap) > at){
+        header->off_mem_rsvmap = le_to_be32(be_to_le32(header->off_mem_rsvmap) + n);
+    }
+    return 0;
+}
+
+/* Set a property of one or two cells in the node at node_off (offset of its name in the blob), add it if it doesn't exist */
+static int fdt_set_cells(void* fdt, size_t bufsize, unsigned int node_off, const char* name, unsigned long value){
+    fdt_header* header = fdt;
+    char* blob = fdt;
+
+    // Overwrite an existing property, keeping its size
+    unsigned int* prop_val_ptr = (unsigned int*)fdt_get_property(fdt, blob + node_off, name);
+    if (prop_val_ptr){
+        unsigned int len = be_to_le32(prop_val_ptr[-2]);
+        if (len == 8){
+            prop_val_ptr[0] = le_to_be32(value >> 32);
+            prop_val_ptr[1] = le_to_be32(value & 0xFFFFFFFF);
+            return 0;
+        }
+        if (len == 4 && (value >> 32) == 0){
+            prop_val_ptr[0] = le_to_be32(value);
+            return 0;
+        }
+        return -1;
+    }
+
+    // Look for the name in the strings block, append it if it is not there
+    unsigned int off_strings = be_to_le32(header->off_dt_strings);
+    unsigned int size_strings = be_to_le32(header->size_dt_strings);
+    unsigned int nameoff = 0;
+    while (nameoff < size_strings && strcmp(blob + off_strings + nameoff, name) != 0){
+        nameoff += strlen(blob + off_strings + nameoff) + 1;
+    }
+    if (nameoff >= size_strings){
+        unsigned int name_len = strlen(name) + 1;
+        nameoff = size_strings;
+        if (fdt_splice(fdt, bufsize, off_strings + size_strings, name_len) != 0){
+            return -1;
+        }
+        strcpy(blob + off_strings + nameoff, name);
+        header->size_dt_strings = le_to_be32(size_strings + name_len);
+    }
+
+    // The new property goes right after the node name, properties must come before the subnodes
+    unsigned int at = node_off + ((strlen(blob + node_off) + 1 + 3) & ~3);
+    unsigned int cells = (value >> 32) ? 2 : 1;
+    unsigned int prop_size = 3 * sizeof(unsigned int) + cells * sizeof(unsigned int);    // token, len, nameoff, value
+    if (fdt_splice(fdt, bufsize, at, prop_size) != 0){
+        return -1;
+    }
+
+    unsigned int* prop_ptr = (unsigned int*)(blob + at);
+    prop_ptr[0] = le_to_be32(FDT_PROP);
+    prop_ptr[1] = le_to_be32(cells * sizeof(unsigned int));
+    prop_ptr[2] = le_to_be32(nameoff);
+    if (cells == 2){
+        prop_ptr[3] = le_to_be32(value >> 32);
+        prop_ptr[4] = le_to_be32(value & 0xFFFFFFFF);
+    }
+    else{
+        prop_ptr[3] = le_to_be32(value);
+    }
+    header->size_dt_struct = le_to_be32(be_to_le32(header->size_dt_struct) + prop_size);
+    return 0;
+}
+
+/* Set linux,initrd-start / linux,initrd-end of the /chosen node, used by the bootloader for an initramfs it received */
+int fdt_set_initrd(void* fdt, size_t bufsize, unsigned long start, unsigned long end){
+    const void* chosen = NULL;
+    fdt_traverse(fdt, chosen_callback, &chosen);
+    if (!chosen){
+        return -1;
+    }
+
+    // Adding properties inside /chosen doesn't move the node itself
+    unsigned int node_off = (const char*)chosen - (const char*)fdt;
+    if (fdt_set_cells(fdt, bufsize, node_off, "linux,initrd-start", start) != 0){
+        return -1;
+    }
+    return fdt_set_cells(fdt, bufsize, node_off, "linux,initrd-end", end);
+}
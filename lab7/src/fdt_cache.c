@@ -0,0 +1,493 @@
+#include "fdt_cache.h"
+#include "fdt.h"
+#include "malloc.h"
+#include "string.h"
+#include "muart.h"
+#include "timer.h"
+
+/* One string of the compatible list of a node, a node is in as many buckets as it has strings */
+typedef struct fdt_compat{
+    const char* compatible;         // In the struct block
+    fdt_node_t* node;
+    struct list_head hash_link;
+}fdt_compat_t;
+
+/* Hash tables, every bucket is a list in the order of the tree */
+static struct list_head path_hash[1 << FDT_PATH_HASH_BITS];
+static struct list_head compat_hash[1 << FDT_COMPAT_HASH_BITS];
+static struct list_head phandle_hash[1 << FDT_PHANDLE_HASH_BITS];
+static struct list_head prop_hash[1 << FDT_PROP_HASH_BITS];
+
+static fdt_node_t* root_node = NULL;
+
+/* Multiplicative hash, the high bits of key * 2^32 / golden ratio are the best mixed */
+#define fdt_hashfn(key, bits)   ((unsigned int)((unsigned int)(key) * 2654435761U) >> (32 - (bits)))
+
+/* Read a big-endian 32-bit cell */
+static inline unsigned int fdt32(const void* ptr){
+    return __builtin_bswap32(*(const unsigned int*)ptr);
+}
+
+/* FNV-1a hash of a string */
+static unsigned int fdt_str_hash(const char* str){
+    unsigned int hash = 2166136261U;
+    while (*str){
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static inline struct list_head* path_bucket(const char* path){
+    return &path_hash[fdt_hashfn(fdt_str_hash(path), FDT_PATH_HASH_BITS)];
+}
+
+static inline struct list_head* compat_bucket(const char* compat){
+    return &compat_hash[fdt_hashfn(fdt_str_hash(compat), FDT_COMPAT_HASH_BITS)];
+}
+
+static inline struct list_head* phandle_bucket(unsigned int phandle){
+    return &phandle_hash[fdt_hashfn(phandle, FDT_PHANDLE_HASH_BITS)];
+}
+
+/* The key of a property is its node and its name */
+static inline struct list_head* prop_bucket(const fdt_node_t* node, const char* name){
+    unsigned int key = fdt_str_hash(name) ^ (unsigned int)((unsigned long)node >> 3);
+    return &prop_hash[fdt_hashfn(key, FDT_PROP_HASH_BITS)];
+}
+
+/* Empty all the buckets, the nodes of the old tree stay in the simple allocator's heap */
+static void fdt_cache_reset(void){
+    for (int i = 0; i < (1 << FDT_PATH_HASH_BITS); i++){
+        INIT_LIST_HEAD(&path_hash[i]);
+    }
+    for (int i = 0; i < (1 << FDT_COMPAT_HASH_BITS); i++){
+        INIT_LIST_HEAD(&compat_hash[i]);
+    }
+    for (int i = 0; i < (1 << FDT_PHANDLE_HASH_BITS); i++){
+        INIT_LIST_HEAD(&phandle_hash[i]);
+    }
+    for (int i = 0; i < (1 << FDT_PROP_HASH_BITS); i++){
+        INIT_LIST_HEAD(&prop_hash[i]);
+    }
+    root_node = NULL;
+}
+
+/* Allocate a node, give it its full path and link it under its parent */
+static fdt_node_t* fdt_new_node(fdt_node_t* parent, const char* name){
+    fdt_node_t* node = simple_alloc(sizeof(fdt_node_t));
+    if (!node){
+        return NULL;
+    }
+
+    // "/" for the root, "/name" for its children, "parent/name" below
+    size_t parent_len = (parent && parent->parent) ? strlen(parent->path) : 0;
+    char* path = simple_alloc(parent_len + 1 + strlen(name) + 1);
+    if (!path){
+        return NULL;
+    }
+    if (parent_len){
+        strcpy(path, parent->path);
+    }
+    path[parent_len] = '/';
+    strcpy(path + parent_len + 1, name);
+
+    node->name = name;
+    node->path = path;
+    node->parent = parent;
+    INIT_LIST_HEAD(&node->children);
+    node->properties = NULL;
+    node->phandle = 0;
+    node->address_cells = 2;    // Defaults of the devicetree specification
+    node->size_cells = 1;
+    if (parent){
+        list_add_tail(&node->sibling, &parent->children);
+    }
+    else{
+        INIT_LIST_HEAD(&node->sibling);
+    }
+    list_add_tail(&node->path_link, path_bucket(path));
+    INIT_LIST_HEAD(&node->phandle_link);
+    return node;
+}
+
+/* Pick up the properties which are indexed or used by the lookups */
+static int fdt_index_property(fdt_node_t* node, fdt_property_t* prop){
+    if (strcmp(prop->name, "compatible") == 0){
+        // A list of null-terminated strings
+        const char* compat = prop->value;
+        const char* end = compat + prop->len;
+        while (compat < end){
+            fdt_compat_t* entry = simple_alloc(sizeof(fdt_compat_t));
+            if (!entry){
+                return -1;
+            }
+            entry->compatible = compat;
+            entry->node = node;
+            list_add_tail(&entry->hash_link, compat_bucket(compat));
+            compat += strlen(compat) + 1;
+        }
+    }
+    else if (prop->len == 4){
+        if ((strcmp(prop->name, "phandle") == 0 || strcmp(prop->name, "linux,phandle") == 0) && node->phandle == 0){
+            node->phandle = fdt32(prop->value);
+            list_add_tail(&node->phandle_link, phandle_bucket(node->phandle));
+        }
+        else if (strcmp(prop->name, "#address-cells") == 0){
+            node->address_cells = fdt32(prop->value);
+        }
+        else if (strcmp(prop->name, "#size-cells") == 0){
+            node->size_cells = fdt32(prop->value);
+        }
+    }
+    return 0;
+}
+
+/* Walk the struct block once, see fdt_traverse for its layout */
+static int fdt_build_tree(const void* fdt){
+    const fdt_header* header = fdt;
+    const unsigned int* struct_ptr = (const unsigned int*)((const char*)fdt + fdt32(&header->off_dt_struct));
+    const unsigned int* struct_end = (const unsigned int*)((const char*)struct_ptr + fdt32(&header->size_dt_struct));
+    const char* strings_ptr = (const char*)fdt + fdt32(&header->off_dt_strings);
+
+    fdt_node_t* cur = NULL;                 // Node whose properties / children are being read
+    fdt_property_t** prop_tail = NULL;      // Where the next property of cur is linked
+
+    while (struct_ptr < struct_end){
+        unsigned int token = fdt32(struct_ptr++);
+
+        switch (token)
+        {
+            case FDT_BEGIN_NODE:{
+                const char* node_name = (const char*)struct_ptr;
+                if (!cur && root_node){
+                    // A second root
+                    return -1;
+                }
+
+                fdt_node_t* node = fdt_new_node(cur, node_name);
+                if (!node){
+                    return -1;
+                }
+                if (!cur){
+                    root_node = node;
+                }
+                cur = node;
+                prop_tail = &node->properties;
+
+                // Skip node name, padded to a 32-bit boundary
+                struct_ptr += (strlen(node_name) + 1 + 3) / 4;
+                break;
+            }
+
+            case FDT_PROP:{
+                if (!cur){
+                    return -1;
+                }
+                unsigned int len = fdt32(struct_ptr++);
+                unsigned int nameoff = fdt32(struct_ptr++);
+
+                fdt_property_t* prop = simple_alloc(sizeof(fdt_property_t));
+                if (!prop){
+                    return -1;
+                }
+                prop->name = strings_ptr + nameoff;
+                prop->value = struct_ptr;
+                prop->len = len;
+                prop->node = cur;
+                prop->next = NULL;
+
+                // The properties come before the subnodes, only a malformed blob needs the walk to the tail
+                if (!prop_tail){
+                    prop_tail = &cur->properties;
+                    while (*prop_tail){
+                        prop_tail = &(*prop_tail)->next;
+                    }
+                }
+                *prop_tail = prop;
+                prop_tail = &prop->next;
+                list_add_tail(&prop->hash_link, prop_bucket(cur, prop->name));
+
+                if (fdt_index_property(cur, prop) != 0){
+                    return -1;
+                }
+
+                // Skip property value, padded to a 32-bit boundary
+                struct_ptr += (len + 3) / 4;
+                break;
+            }
+
+            case FDT_END_NODE:{
+                if (!cur){
+                    return -1;
+                }
+                cur = cur->parent;
+                prop_tail = NULL;
+                break;
+            }
+
+            case FDT_NOP:
+                break;
+
+            case FDT_END:
+                // Every node must be closed
+                return (root_node && !cur) ? 0 : -1;
+
+            default:
+                return -1;
+        }
+    }
+    return -1;      // No FDT_END
+}
+
+/* Build the tree from the blob */
+int fdt_unflatten(const void* fdt){
+    const fdt_header* header = fdt;
+
+    fdt_cache_reset();
+    if (fdt32(&header->magic) != FDT_MAGIC){
+        muart_puts("fdt_unflatten: invalid magic number !\r\n");
+        return -1;
+    }
+
+    if (fdt_build_tree(fdt) != 0){
+        muart_puts("fdt_unflatten: malformed device tree or out of memory !\r\n");
+        fdt_cache_reset();
+        return -1;
+    }
+
+#if LOG_FDT_CACHE
+    muart_puts("[fdt_unflatten] Device tree at ");
+    muart_send_hex((unsigned long)fdt);
+    muart_puts(" unflattened\r\n");
+#endif
+    return 0;
+}
+
+fdt_node_t* fdt_root(void){
+    return root_node;
+}
+
+fdt_node_t* fdt_find_node_by_path(const char* path){
+    struct list_head* bucket = path_bucket(path);
+    struct list_head* pos;
+
+    list_for_each(pos, bucket){
+        fdt_node_t* node = list_entry(pos, fdt_node_t, path_link);
+        if (strcmp(node->path, path) == 0){
+            return node;
+        }
+    }
+    return NULL;
+}
+
+fdt_node_t* fdt_find_compatible(const char* compat, fdt_node_t* from){
+    struct list_head* bucket = compat_bucket(compat);
+    struct list_head* pos;
+
+    // The bucket is in the order of the tree, return the first match after `from`
+    list_for_each(pos, bucket){
+        fdt_compat_t* entry = list_entry(pos, fdt_compat_t, hash_link);
+        if (strcmp(entry->compatible, compat) != 0){
+            continue;
+        }
+        if (!from){
+            return entry->node;
+        }
+        if (entry->node == from){
+            from = NULL;
+        }
+    }
+    return NULL;
+}
+
+fdt_node_t* fdt_find_node_by_phandle(unsigned int phandle){
+    struct list_head* bucket = phandle_bucket(phandle);
+    struct list_head* pos;
+
+    if (phandle == 0){
+        return NULL;
+    }
+    list_for_each(pos, bucket){
+        fdt_node_t* node = list_entry(pos, fdt_node_t, phandle_link);
+        if (node->phandle == phandle){
+            return node;
+        }
+    }
+    return NULL;
+}
+
+const void* fdt_node_get_property(const fdt_node_t* node, const char* name, unsigned int* len){
+    struct list_head* bucket = prop_bucket(node, name);
+    struct list_head* pos;
+
+    list_for_each(pos, bucket){
+        fdt_property_t* prop = list_entry(pos, fdt_property_t, hash_link);
+        if (prop->node == node && strcmp(prop->name, name) == 0){
+            if (len){
+                *len = prop->len;
+            }
+            return prop->value;
+        }
+    }
+    return NULL;
+}
+
+int fdt_node_read_u32(const fdt_node_t* node, const char* name, unsigned int index, unsigned int* value){
+    unsigned int len;
+    const unsigned int* cells = fdt_node_get_property(node, name, &len);
+
+    if (!cells || len < (index + 1) * sizeof(unsigned int)){
+        return -1;
+    }
+    *value = fdt32(&cells[index]);
+    return 0;
+}
+
+int fdt_node_read_number(const fdt_node_t* node, const char* name, unsigned long* value){
+    unsigned int len;
+    const unsigned int* cells = fdt_node_get_property(node, name, &len);
+
+    if (!cells){
+        return -1;
+    }
+    if (len == 4){
+        *value = fdt32(&cells[0]);
+        return 0;
+    }
+    if (len == 8){
+        *value = ((unsigned long)fdt32(&cells[0]) << 32) | fdt32(&cells[1]);
+        return 0;
+    }
+    return -1;
+}
+
+int fdt_node_is_compatible(const fdt_node_t* node, const char* compat){
+    struct list_head* bucket = compat_bucket(compat);
+    struct list_head* pos;
+
+    list_for_each(pos, bucket){
+        fdt_compat_t* entry = list_entry(pos, fdt_compat_t, hash_link);
+        if (entry->node == node && strcmp(entry->compatible, compat) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+fdt_node_t* fdt_node_parse_phandle(const fdt_node_t* node, const char* name, unsigned int index){
+    unsigned int phandle;
+    if (fdt_node_read_u32(node, name, index, &phandle) != 0){
+        return NULL;
+    }
+    return fdt_find_node_by_phandle(phandle);
+}
+
+int fdt_node_read_reg(const fdt_node_t* node, unsigned int index, unsigned long* addr, unsigned long* size){
+    const fdt_node_t* parent = node->parent;
+    if (!parent || parent->address_cells < 1 || parent->address_cells > 2 || parent->size_cells > 2){
+        return -1;
+    }
+
+    unsigned int len;
+    const unsigned int* cells = fdt_node_get_property(node, "reg", &len);
+    unsigned int entry_cells = parent->address_cells + parent->size_cells;
+    if (!cells || len < (index + 1) * entry_cells * sizeof(unsigned int)){
+        return -1;
+    }
+    cells += index * entry_cells;
+
+    *addr = 0;
+    for (unsigned int i = 0; i < parent->address_cells; i++){
+        *addr = (*addr << 32) | fdt32(cells++);
+    }
+    *size = 0;
+    for (unsigned int i = 0; i < parent->size_cells; i++){
+        *size = (*size << 32) | fdt32(cells++);
+    }
+    return 0;
+}
+
+unsigned long fdt_initrd_start(void){
+    unsigned long addr;
+    fdt_node_t* chosen = fdt_find_node_by_path("/chosen");
+
+    if (!chosen || fdt_node_read_number(chosen, "linux,initrd-start", &addr) != 0){
+        return 0;
+    }
+    return addr;
+}
+
+
+#define FDT_BENCH_ROUNDS 1000
+
+static void fdt_bench_report(const char* name, unsigned long ticks){
+    unsigned long freq = get_cntfrq_el0();
+
+    muart_puts(name);
+    muart_puts(": ");
+    muart_send_dec(FDT_BENCH_ROUNDS);
+    muart_puts(" lookups in ");
+    muart_send_dec((int)(ticks * 1000000 / freq));
+    muart_puts(" us\r\n");
+}
+
+/* Callback of the blob scan : stop at the first node compatible with the mini UART */
+static int aux_uart_callback(const void *fdt, const void *node_ptr, const char *node_name, int depth, void *data){
+    const char* compat = fdt_get_property(fdt, node_ptr, "compatible");
+    if (compat && strcmp(compat, "brcm,bcm2835-aux-uart") == 0){
+        *(const void**)data = node_ptr;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Each case runs FDT_BENCH_ROUNDS lookups on the blob (fdt_traverse) and on the tree
+ * 1. linux,initrd-start of /chosen, near the start of the blob : initramfs_callback against fdt_initrd_start
+ * 2. The mini UART node by its compatible string, near the end of the blob
+ */
+void fdt_cache_benchmark(const void* fdt){
+    unsigned long start, ticks;
+    unsigned long sum = 0;
+
+    muart_puts("\r\n=== Device tree lookup benchmark ===\r\n");
+
+    start = get_cntpct_el0();
+    for (int i = 0; i < FDT_BENCH_ROUNDS; i++){
+        initramfs_context_t cxt;
+        cxt.found = 0;
+        cxt.address = 0;
+        fdt_traverse(fdt, initramfs_callback, &cxt);
+        sum += cxt.address;
+    }
+    ticks = get_cntpct_el0() - start;
+    fdt_bench_report("Blob, /chosen", ticks);
+
+    start = get_cntpct_el0();
+    for (int i = 0; i < FDT_BENCH_ROUNDS; i++){
+        sum -= fdt_initrd_start();
+    }
+    ticks = get_cntpct_el0() - start;
+    fdt_bench_report("Tree, /chosen", ticks);
+
+    start = get_cntpct_el0();
+    for (int i = 0; i < FDT_BENCH_ROUNDS; i++){
+        const void* node_ptr = NULL;
+        fdt_traverse(fdt, aux_uart_callback, &node_ptr);
+        sum += (node_ptr != NULL);
+    }
+    ticks = get_cntpct_el0() - start;
+    fdt_bench_report("Blob, compatible", ticks);
+
+    start = get_cntpct_el0();
+    for (int i = 0; i < FDT_BENCH_ROUNDS; i++){
+        sum -= (fdt_find_compatible("brcm,bcm2835-aux-uart", NULL) != NULL);
+    }
+    ticks = get_cntpct_el0() - start;
+    fdt_bench_report("Tree, compatible", ticks);
+
+    if (sum != 0){
+        muart_puts("Error: the lookups don't agree\r\n");
+    }
+}
@@ -0,0 +1,285 @@
+#include "irq.h"
+#include "driver.h"
+#include "exception.h"
+#include "utils.h"
+#include "muart.h"
+#include "timer.h"
+
+/* Descriptor table, indexed by the linear IRQ number */
+static struct irq_desc irq_desc[NR_IRQS];
+
+/* Bases of the two controllers, replaced by the ones of the device tree when they are probed */
+static unsigned long armctrl_base = ARMCTRL_DEFAULT_BASE;
+static unsigned long local_intc_base = LOCAL_INTC_DEFAULT_BASE;
+
+/*
+ * Enabled GPU / basic interrupts of each bank : IRQ_PEND1, IRQ_PEND2, basic pending
+ * The pending registers also show the sources which are not enabled, only these bits are dispatched
+ */
+static unsigned int armctrl_enabled[3];
+
+/* Local interrupts without a handler, they can't be disabled here so they are ignored from then on */
+static unsigned int local_ignored;
+
+/* Statistics of irq_dispatch() itself */
+static unsigned long irq_exceptions;        // IRQ exceptions taken
+static unsigned long irq_handled;           // Handlers called, irq_handled / irq_exceptions sources per exception
+static unsigned long irq_spurious;          // Exceptions with nothing to handle
+
+static const unsigned int armctrl_pend_reg[3] = { ARMCTRL_PEND1, ARMCTRL_PEND2, ARMCTRL_BASIC_PEND };
+static const unsigned int armctrl_enable_reg[3] = { ARMCTRL_ENABLE1, ARMCTRL_ENABLE2, ARMCTRL_ENABLE_BASIC };
+static const unsigned int armctrl_disable_reg[3] = { ARMCTRL_DISABLE1, ARMCTRL_DISABLE2, ARMCTRL_DISABLE_BASIC };
+
+/* Bank of a GPU / basic interrupt, -1 for a local one */
+static inline int armctrl_bank(unsigned int irq){
+    if (irq < IRQ_BASIC(8)){
+        return irq / 32;
+    }
+    return -1;
+}
+
+void irq_enable(unsigned int irq){
+    int bank = armctrl_bank(irq);
+    if (bank < 0){
+        // Local interrupts are enabled by their own control registers (e.g. enable_core_timer_int)
+        return;
+    }
+
+    unsigned long flags = irq_save();
+    armctrl_enabled[bank] |= 1U << (irq % 32);
+    regWrite(armctrl_base + armctrl_enable_reg[bank], 1U << (irq % 32));
+    irq_restore(flags);
+}
+
+void irq_disable(unsigned int irq){
+    int bank = armctrl_bank(irq);
+    if (bank < 0){
+        return;
+    }
+
+    unsigned long flags = irq_save();
+    regWrite(armctrl_base + armctrl_disable_reg[bank], 1U << (irq % 32));
+    armctrl_enabled[bank] &= ~(1U << (irq % 32));
+    irq_restore(flags);
+}
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned int flags, const char* name, void* data){
+    if (irq >= NR_IRQS || handler == NULL){
+        return -1;
+    }
+
+    unsigned long daif = irq_save();
+    struct irq_desc* desc = &irq_desc[irq];
+    if (desc->handler){
+        irq_restore(daif);
+        muart_puts("Error: IRQ ");
+        muart_send_dec(irq);
+        muart_puts(" is already used by ");
+        muart_puts(desc->name);
+        muart_puts("\r\n");
+        return -1;
+    }
+    desc->handler = handler;
+    desc->data = data;
+    desc->name = name;
+    desc->flags = flags;
+    if (irq >= IRQ_LOCAL(0)){
+        local_ignored &= ~(1U << (irq - IRQ_LOCAL(0)));
+    }
+    irq_restore(daif);
+
+    if (!(flags & IRQF_NO_AUTOEN)){
+        irq_enable(irq);
+    }
+
+    #if LOG_IRQ
+    muart_puts("[irq] IRQ ");
+    muart_send_dec(irq);
+    muart_puts(" -> ");
+    muart_puts(name);
+    muart_puts("\r\n");
+    #endif
+    return 0;
+}
+
+void free_irq(unsigned int irq, void* data){
+    if (irq >= NR_IRQS){
+        return;
+    }
+
+    unsigned long daif = irq_save();
+    struct irq_desc* desc = &irq_desc[irq];
+    if (desc->handler && desc->data == data){
+        irq_disable(irq);
+        desc->handler = NULL;
+        desc->data = NULL;
+    }
+    irq_restore(daif);
+}
+
+/* A source nobody handles would fire forever, turn it off */
+static void irq_unexpected(unsigned int irq){
+    irq_desc[irq].unhandled++;
+
+    muart_puts("Unexpected IRQ ");
+    muart_send_dec(irq);
+    muart_puts("\r\n");
+
+    if (irq >= IRQ_LOCAL(0)){
+        local_ignored |= 1U << (irq - IRQ_LOCAL(0));
+    }
+    else{
+        irq_disable(irq);
+    }
+}
+
+/* Call the handler of an interrupt and account its latency and time */
+static void irq_handle(unsigned int irq, unsigned long entry){
+    struct irq_desc* desc = &irq_desc[irq];
+
+    if (!desc->handler){
+        irq_unexpected(irq);
+        return;
+    }
+
+    unsigned long start = get_cntpct_el0();
+    desc->handler(desc->data);
+    unsigned long ticks = get_cntpct_el0() - start;
+
+    desc->count++;
+    desc->total_ticks += ticks;
+    if (ticks > desc->max_ticks){
+        desc->max_ticks = ticks;
+    }
+    if (start - entry > desc->max_latency){
+        desc->max_latency = start - entry;
+    }
+    irq_handled++;
+}
+
+/*
+ * Handle the pending interrupts, every one in a single exception
+ * Each pass reads CORE0_IRQ_SRC and, when bit 8 is set, IRQ_PEND1 / IRQ_PEND2 / basic pending once, then calls the
+ * handler of every set bit with ctz, the passes go on until nothing is pending
+ * Handlers never schedule() here, the timer only sets need_resched and irq_entry() switches threads afterwards
+ */
+void irq_dispatch(void){
+    unsigned long entry = get_cntpct_el0();
+    int found = 0;
+
+    irq_exceptions++;
+
+    for (;;){
+        unsigned int src = regRead(local_intc_base + LOCAL_IRQ_SRC0) & ~local_ignored;
+        int pass = 0;
+
+        // Second level first, the scheduler tick (a local interrupt) comes last in the pass
+        if (src & (1U << LOCAL_IRQ_GPU)){
+            src &= ~(1U << LOCAL_IRQ_GPU);
+            for (int bank = 0; bank < 3; bank++){
+                unsigned int pending = regRead(armctrl_base + armctrl_pend_reg[bank]) & armctrl_enabled[bank];
+                while (pending){
+                    unsigned int bit = __builtin_ctz(pending);
+                    pending &= pending - 1;
+                    irq_handle(bank * 32 + bit, entry);
+                    pass++;
+                }
+            }
+        }
+
+        while (src){
+            unsigned int bit = __builtin_ctz(src);
+            src &= src - 1;
+            irq_handle(IRQ_LOCAL(bit), entry);
+            pass++;
+        }
+
+        // Nothing enabled is pending anymore
+        if (!pass){
+            break;
+        }
+        found += pass;
+    }
+
+    if (!found){
+        irq_spurious++;
+    }
+}
+
+/* Split at whole seconds so that ticks * 10^9 can't overflow */
+static void irq_print_ns(unsigned long ticks, unsigned long freq){
+    muart_send_udec(ticks / freq * 1000000000UL + ticks % freq * 1000000000UL / freq);
+    muart_puts(" ns");
+}
+
+/* Print the counters and the handler time of every interrupt which has fired */
+void irq_show_stats(void){
+    unsigned long freq = get_cntfrq_el0();
+
+    muart_puts("IRQ exceptions: ");
+    muart_send_udec(irq_exceptions);
+    muart_puts(", handlers called: ");
+    muart_send_udec(irq_handled);
+    muart_puts(", spurious: ");
+    muart_send_udec(irq_spurious);
+    muart_puts("\r\n");
+
+    for (unsigned int irq = 0; irq < NR_IRQS; irq++){
+        struct irq_desc* desc = &irq_desc[irq];
+        if (!desc->handler && !desc->count && !desc->unhandled){
+            continue;
+        }
+
+        muart_send_dec(irq);
+        muart_puts("\t");
+        muart_puts(desc->handler ? desc->name : "(none)");
+        muart_puts("\tcount ");
+        muart_send_udec(desc->count);
+        if (desc->unhandled){
+            muart_puts(", unhandled ");
+            muart_send_udec(desc->unhandled);
+        }
+        if (desc->count){
+            muart_puts(", avg ");
+            irq_print_ns(desc->total_ticks / desc->count, freq);
+            muart_puts(", max ");
+            irq_print_ns(desc->max_ticks, freq);
+            muart_puts(", max latency ");
+            irq_print_ns(desc->max_latency, freq);
+        }
+        muart_puts("\r\n");
+    }
+}
+
+
+/* --- Drivers of the interrupt controllers --- */
+static int armctrl_probe(struct device* dev){
+    armctrl_base = dev->base;
+    return 0;
+}
+
+static int local_intc_probe(struct device* dev){
+    local_intc_base = dev->base;
+    return 0;
+}
+
+static const char* const armctrl_compatible[] = { "brcm,bcm2836-armctrl-ic", "brcm,bcm2835-armctrl-ic", NULL };
+static const char* const local_intc_compatible[] = { "brcm,bcm2836-l1-intc", NULL };
+
+struct driver armctrl_driver = {
+    .name = "armctrl",
+    .compatible = armctrl_compatible,
+    .probe = armctrl_probe,
+    .default_base = ARMCTRL_DEFAULT_BASE,
+    .default_size = 0x200,
+    .default_irq = IRQ_LOCAL(LOCAL_IRQ_GPU),
+};
+
+struct driver local_intc_driver = {
+    .name = "local_intc",
+    .compatible = local_intc_compatible,
+    .probe = local_intc_probe,
+    .default_base = LOCAL_INTC_DEFAULT_BASE,
+    .default_size = 0x100,
+    .default_irq = -1,
+};
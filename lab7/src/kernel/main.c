@@ -1,12 +1,15 @@
 #include "muart.h"
 #include "shell.h"
 #include "fdt.h"
+#include "fdt_cache.h"
+#include "driver.h"
 #include "cpio.h"
 #include "exception.h"
 #include "timer.h"
 #include "malloc.h"
 #include "sched.h"
 #include "vfs.h"
+#include "console.h"
 
 /* Global buddy system instance */
 buddy_system_t buddy;
@@ -51,7 +54,7 @@ int video_player_test(void* fdt) {
     }
     
     init_data->filename = "syscall.img";
-    init_data->initramfs_addr = get_initramfs_address(fdt);
+    init_data->initramfs_addr = fdt_initrd_start();
 
     // Create a kernel thread that will load and execute syscall.img
     pid_t pid = kernel_thread(kernel_fork_process_cpio, init_data);
@@ -454,7 +457,7 @@ int vfs_img_test(void* fdt) {
     }
     
     init_data->filename = "vfs1.img";
-    init_data->initramfs_addr = get_initramfs_address(fdt);
+    init_data->initramfs_addr = fdt_initrd_start();
 
     // Create a kernel thread that will load and execute syscall.img
     pid_t pid = kernel_thread(kernel_fork_process_cpio, init_data);
@@ -482,9 +485,15 @@ void main(void* fdt){
     muart_send_hex(((unsigned long)fdt));
     muart_puts("\r\n");
 
+    // Unflatten the device tree once, the lookups below don't rescan the blob
+    if (fdt_unflatten(fdt) != 0) {
+        muart_puts("Error: Failed to unflatten the device tree\r\n");
+        return;
+    }
+
     // Get the initramfs address from the device tree
-    unsigned long initramfs_addr = get_initramfs_address(fdt);
-    if (initramfs_addr == 1) {
+    unsigned long initramfs_addr = fdt_initrd_start();
+    if (initramfs_addr == 0) {
         muart_puts("Error: Failed to get initramfs address from device tree\r\n");
         return;
     }
@@ -497,6 +506,11 @@ void main(void* fdt){
 
     // Initialize the vector table
     exception_table_init();
+
+    // Bind the drivers to the devices of the device tree, the IRQ handlers are installed here
+    if (driver_probe_all() != 0) {
+        muart_puts("Error: Some devices failed to probe\r\n");
+    }
     
     // Enable the core timer and enable the core timer interrupt
     core_timer_init();
@@ -510,9 +524,18 @@ void main(void* fdt){
     // Initialize the scheduler
     sched_init();
 
+    // Kernel output goes through the async UART TX ring from now on (interrupts are enabled by sched_init)
+    console_init();
+
     // Demo of the dynamic allocator
     // dynamic_allocator_demo();
 
+    // Benchmark of the PID allocator
+    // pid_alloc_benchmark();
+
+    // Benchmark of the device tree lookups
+    // fdt_cache_benchmark(fdt);
+
     // Test thread mechanism
     // muart_puts("\r\n=== Starting Thread Test ===\r\n");
     // thread_test();
@@ -0,0 +1,73 @@
+#include "lz4.h"
+
+/* Read the extra length bytes after a nibble of 15 : each 255 adds 255 and continues, any other value ends it */
+static int lz4_read_length(const unsigned char** ip, const unsigned char* end, size_t* len) {
+    unsigned char c;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        c = *(*ip)++;
+        *len += c;
+    } while (c == 255);
+    return 0;
+}
+
+/*
+ * Each sequence : token (literal length << 4 | match length - 4), literals, 2-byte little endian offset, match
+ * The last sequence only has literals
+ * Copies go forward one byte at a time, so overlapping matches (offset < length) repeat the pattern as they should
+ */
+long lz4_decompress(const unsigned char* src, size_t src_size, unsigned char* dst, size_t dst_size) {
+    const unsigned char* ip = src;
+    const unsigned char* ip_end = src + src_size;
+    unsigned char* op = dst;
+    unsigned char* op_end = dst + dst_size;
+
+    while (ip < ip_end) {
+        unsigned char token = *ip++;
+
+        // Literals
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && lz4_read_length(&ip, ip_end, &lit_len) < 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+        while (lit_len--) {
+            *op++ = *ip++;
+        }
+
+        // The last sequence ends right after its literals
+        if (ip == ip_end) {
+            break;
+        }
+
+        // Match
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 0xF;
+        if (match_len == 15 && lz4_read_length(&ip, ip_end, &match_len) < 0) {
+            return -1;
+        }
+        match_len += 4;
+        if (match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        const unsigned char* match = op - offset;
+        while (match_len--) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
@@ -2,33 +2,130 @@
 #include "registers.h"
 #include "utils.h"
 #include "muart.h"
+#include "irq.h"
+#include "driver.h"
+#include "exception.h"
+#include "sched.h"
+#include "list.h"
+#include "timer.h"
 
-void mailbox_call(unsigned int channel, volatile unsigned int* msg){
-    unsigned long msg_addr = (unsigned long)msg;
-    
-    // Combine the message address (upper 28 bits) with channel number (lower 4 bits)  
-    msg_addr = (msg_addr & ~0xF) | (channel & 0xF);
-    
-    // Check whether the Mailbox 0 status register’s full flag is set.
-    while( regRead(MAILBOX_STATUS) & MAILBOX_FULL ){
-        // Mailbox is Full: do nothing
+// Registers of the mailbox found by mailbox_probe(), the fixed address of registers.h until then
+static unsigned long mailbox_base = MAILBOX_BASE;
+static int mailbox_irq_ready = 0;           // 1 once the answers are taken by mailbox_irq_handler()
+
+#define DAIF_IRQ_MASKED (1 << 7)            // The I bit of DAIF
+
+/* A message written to the mailbox, the firmware answers with the same value once the buffer is filled */
+struct mbox_request {
+    struct list_head list;                  // In mbox_pending
+    unsigned int message;                   // Address of the buffer | channel
+    volatile int done;
+    struct wait_queue_head wait;            // The caller sleeps here
+};
+
+// Requests waiting for their answer, oldest first (the firmware handles them in order)
+static struct list_head mbox_pending;
+static unsigned long mbox_stray = 0;        // Answers without a request
+
+static void mbox_queue_init(void){
+    if (mbox_pending.next == NULL){
+        INIT_LIST_HEAD(&mbox_pending);
     }
-    // If not, then you can write the data to Mailbox 1 Read/Write register.
-    regWrite(MAILBOX_WRITE, msg_addr);
-    
-    while(1){
-        // Check whether the Mailbox 0 status register’s empty flag is set.
-        while( regRead(MAILBOX_STATUS) & MAILBOX_EMPTY ){
-            // Mailbox is Empty: do nothing
+}
+
+/*
+ * Complete the request an answer belongs to, called with interrupts disabled
+ * The property channel answers with the address of the buffer, the other channels (e.g. the legacy framebuffer)
+ * may answer with a status instead, then the oldest request of the channel gets it
+ */
+static void mbox_complete(unsigned int response){
+    struct mbox_request* match = NULL;
+    struct list_head* pos;
+
+    list_for_each(pos, &mbox_pending){
+        struct mbox_request* req = list_entry(pos, struct mbox_request, list);
+        if (req->message == response){
+            match = req;
+            break;
         }
-        // If not, then you can read from Mailbox 0 Read/Write register.
-        unsigned int response = regRead(MAILBOX_READ);
-    
-        // Check if the value is the same as you wrote in step 1.
-        if((response & 0xF) == channel){
-            return;
+        if (!match && (response & 0xF) != MBOX_CH_PROP && (req->message & 0xF) == (response & 0xF)){
+            match = req;
+        }
+    }
+
+    if (match){
+        list_del(&match->list);
+        match->done = 1;
+        wake_up(&match->wait);
+        return;
+    }
+    mbox_stray++;
+
+    #if LOG_MAILBOX
+    muart_puts("[mailbox] stray answer ");
+    muart_send_hex(response);
+    muart_puts("\r\n");
+    #endif
+}
+
+/* Take every answer in mailbox 0, reading it empty also clears the interrupt */
+static void mbox_drain(void){
+    while (!(regRead(mailbox_base + MBOX_STATUS) & MAILBOX_EMPTY)){
+        mbox_complete(regRead(mailbox_base + MBOX_READ));
+    }
+}
+
+static void mailbox_irq_handler(void* data){
+    mbox_drain();
+}
+
+int mailbox_call(unsigned int channel, volatile unsigned int* msg){
+    struct mbox_request req;
+    unsigned long flags = irq_save();
+
+    mbox_queue_init();
+
+    // Mailbox 1 holds 8 messages, it is only full while the firmware is far behind
+    unsigned long start = get_cntpct_el0();
+    unsigned long timeout = get_cntfrq_el0() / 1000 * MBOX_WRITE_TIMEOUT_MS;
+    while (regRead(mailbox_base + MBOX_WRITE_STATUS) & MAILBOX_FULL){
+        if (get_cntpct_el0() - start > timeout){
+            irq_restore(flags);
+            muart_puts("Error: mailbox is full, the firmware doesn't answer\r\n");
+            return -1;
         }
     }
+
+    // Combine the message address (upper 28 bits) with channel number (lower 4 bits)
+    req.message = ((unsigned int)(unsigned long)msg & ~0xF) | (channel & 0xF);
+    req.done = 0;
+    init_waitqueue_head(&req.wait);
+    list_add_tail(&req.list, &mbox_pending);
+    regWrite(mailbox_base + MBOX_WRITE, req.message);
+
+    if (mailbox_irq_ready && task_can_sleep()){
+        // Slow property calls don't hold the CPU, a signal can't cut the wait short since the firmware writes the buffer
+        while (!req.done){
+            sleep_on(&req.wait);
+        }
+    }
+    else if (mailbox_irq_ready && !(flags & DAIF_IRQ_MASKED)){
+        // The idle task can't sleep, keep the interrupts on so the timer still runs the other tasks
+        irq_restore(flags);
+        while (!req.done){
+            // do nothing
+        }
+        irq_save();
+    }
+    else{
+        // Early boot (or interrupts off) : poll, the answers of the other requests are completed on the way
+        while (!req.done){
+            mbox_drain();
+        }
+    }
+
+    irq_restore(flags);
+    return 0;
 }
 
 void get_board_revision(){
@@ -85,4 +182,30 @@ void get_memory_info(){
         // Request is failed
         muart_puts("Request is failed\r\n");
     }
-}
\ No newline at end of file
+}
+
+
+/* --- Driver of the VideoCore mailbox --- */
+static int mailbox_probe(struct device* dev){
+    mailbox_base = dev->base;
+    mbox_queue_init();
+
+    // Without an interrupt mailbox_call() keeps polling
+    if (dev->irq < 0 || request_irq(dev->irq, mailbox_irq_handler, 0, "mailbox", NULL) != 0){
+        return 0;
+    }
+    regWrite(mailbox_base + MBOX_CONFIG, MBOX_CONFIG_IRQ_DATA);
+    mailbox_irq_ready = 1;
+    return 0;
+}
+
+static const char* const mailbox_compatible[] = { "brcm,bcm2835-mbox", NULL };
+
+struct driver mailbox_driver = {
+    .name = "mailbox",
+    .compatible = mailbox_compatible,
+    .probe = mailbox_probe,
+    .default_base = MAILBOX_BASE,
+    .default_size = 0x40,
+    .default_irq = IRQ_BASIC(1),
+};
@@ -1,9 +1,22 @@
 #include "muart.h"
 #include "registers.h"
 #include "utils.h"
+#include "string.h"
 
-/* Receive the cahr data transmitted from host */ 
-char muart_receive(){
+/* Output / input backend, NULL : polling */
+static muart_output_t muart_output = NULL;
+static muart_input_t muart_input = NULL;
+
+void muart_set_output(muart_output_t output) {
+    muart_output = output;
+}
+
+void muart_set_input(muart_input_t input) {
+    muart_input = input;
+}
+
+/* Receive the char data from host by polling */
+char muart_receive_sync(){
     while ( !(regRead(AUX_MU_LSR_REG) & 1) ){
         // do nothing
     }
@@ -11,8 +24,16 @@ char muart_receive(){
     return regRead(AUX_MU_IO_REG)&0xFF;
 }
 
-/* Transmit the char data to host */ 
-void muart_send(const char c){
+/* Receive the cahr data transmitted from host */ 
+char muart_receive(){
+    if (muart_input) {
+        return muart_input();
+    }
+    return muart_receive_sync();
+}
+
+/* Transmit the char data to host by polling */ 
+void muart_send_sync(const char c){
     while ( !(regRead(AUX_MU_LSR_REG) & 32) ){
         // do nothing
     }
@@ -21,24 +42,33 @@ void muart_send(const char c){
     return;
 }
 
+/* Write size bytes through the output backend, or poll them out one by one */
+static void muart_write(const char* buf, size_t size) {
+    if (muart_output) {
+        muart_output(buf, size);
+        return;
+    }
+    for (size_t i = 0; i < size; i++) {
+        muart_send_sync(buf[i]);
+    }
+}
+
+/* Transmit the char data to host */ 
+void muart_send(const char c){
+    muart_write(&c, 1);
+}
+
 /* Write the C string str to the transmit FIFO by mini UART */ 
 void muart_puts(const char* str) {
-    while(*str){
-        muart_send(*str);
-        str++;
-    }
-    return;
+    muart_write(str, strlen(str));
 }
 
 /* Transmit the int data to host in hex */
 void muart_send_hex(unsigned int value) {
     // Display prefix of hex
-    muart_send('0');
-    muart_send('x');
-    
-    char hex_digits[8];
+    char hex_digits[10] = {'0', 'x'};
     
-    for (int i = 7; i >= 0; i--) {
+    for (int i = 9; i >= 2; i--) {
         int hex_digit = value & 0xF; // Get the lower 4 bits
         if (hex_digit < 10){
             // Convert to char by ASCII code  
@@ -50,10 +80,8 @@ void muart_send_hex(unsigned int value) {
         value = value >> 4; // right shift 4 bits
     }
     
-    // Display the value using muart_send
-    for (int i = 0; i < 8; i++) {
-        muart_send(hex_digits[i]);
-    }
+    // Display the value with a single write, so it is not split by other output
+    muart_write(hex_digits, 10);
 }
 
 /* Transmit the int data to host in decimal */
@@ -83,9 +111,19 @@ void muart_send_dec(int num){
         num /= 10;
     }
 
-    for (unsigned int i = 0; i < digit_count; i++){
-        muart_send(digits[i]);
-    }
+    muart_write(digits, digit_count);
+}
+
+void muart_send_udec(unsigned long num){
+    // 2^64 - 1 has 20 digits, filled from the end
+    char digits[20];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + (num % 10);
+        num /= 10;
+    } while (num);
+
+    muart_write(&digits[i], sizeof(digits) - i);
 }
 
 
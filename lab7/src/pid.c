@@ -1,109 +1,143 @@
 #include "pid.h"
 #include "bitmap.h"
 #include "muart.h"
+#include "sched.h"
+#include "timer.h"
 
 /* Global PID bitmap */
 static pid_bitmap_t pid_bitmap;
 
+/* PID hash table, a bucket holds the tasks whose pid has the same low PID_HASH_BITS bits */
+static struct list_head pid_hash[PID_HASH_SIZE];
+
+/**
+ * Mark a PID as used / free and keep the summary bit of its word in sync
+ */
+static void pid_map_set(pid_bitmap_t* map, int pid) {
+    unsigned int word = BIT_WORD(pid);
+
+    set_bit(pid, map->pid_bitmap);
+    if (map->pid_bitmap[word] == ~0UL) {
+        clear_bit(word, map->free_summary);    // 這個 word 已經滿了
+    }
+}
+
+static void pid_map_clear(pid_bitmap_t* map, int pid) {
+    clear_bit(pid, map->pid_bitmap);
+    set_bit(BIT_WORD(pid), map->free_summary);
+}
+
 /**
- * Find the first zero bit in the bitmap, starting from offset.
+ * Return the first free PID of a word whose summary bit is set
+ */
+static inline int pid_map_first_free(pid_bitmap_t* map, unsigned int word) {
+    return word * BITS_PER_LONG + __builtin_ctzl(~map->pid_bitmap[word]);
+}
+
+/**
+ * Find a free PID, searching from `from` to MAX_PID and then wrapping around to MIN_PID
+ * Only the word of `from` is looked at in pid_bitmap, the other words are skipped with the summary,
+ * so at most PID_SUMMARY_WORDS + 1 words are read however full the bitmap is
  * 
- * @param bitmap  Base address of the bitmap
- * @param size    Total number of bits in the bitmap
- * @param offset  Start searching from this position
- * @return        Index of the first zero bit found, or size if not found
+ * @param map     PID bitmap
+ * @param from    First PID to try, MIN_PID <= from <= MAX_PID
+ * @return        A free PID, or -1 if every PID is in use
  */
-unsigned int find_next_zero_bit(const unsigned long *bitmap, unsigned int size, unsigned int offset) {
-    // If offset is out of range, return size directly
-    if (offset >= size) {
-        return size;
+static int pid_map_find(pid_bitmap_t* map, unsigned int from) {
+    unsigned int word = BIT_WORD(from);
+    unsigned long summary;
+    unsigned int s;
+
+    // Free PIDs at or after `from` in its own word
+    unsigned long free = ~map->pid_bitmap[word] & (~0UL << (from % BITS_PER_LONG));
+    if (free) {
+        return word * BITS_PER_LONG + __builtin_ctzl(free);
     }
-    
-    // Calculate starting element and bit offset
-    unsigned int word_offset = BIT_WORD(offset);
-    unsigned int bit_offset = offset % BITS_PER_LONG;
-    unsigned long word;
-    
-    // Check bits after offset in the current element
-    word = bitmap[word_offset] >> bit_offset;
-    
-    // If there is a zero bit after the offset in the current word (i.e., ~word has a 1 bit)
-    if (~word != 0) {
-        bit_offset += __builtin_ffsl(~word) - 1;
-        if (bit_offset < BITS_PER_LONG && offset + bit_offset - (offset % BITS_PER_LONG) < size) {
-            return offset + bit_offset - (offset % BITS_PER_LONG);
+
+    // The next words which still have a free PID
+    word++;
+    if (word < PID_MAP_WORDS) {
+        s = BIT_WORD(word);
+        summary = map->free_summary[s] & (~0UL << (word % BITS_PER_LONG));
+        while (1) {
+            if (summary) {
+                return pid_map_first_free(map, s * BITS_PER_LONG + __builtin_ctzl(summary));
+            }
+            if (++s >= PID_SUMMARY_WORDS) {
+                break;
+            }
+            summary = map->free_summary[s];
         }
     }
-    
-    // Check subsequent elements
-    size -= (offset + (BITS_PER_LONG - bit_offset));
-    word_offset++;
-    
-    // Handle full unsigned long words
-    while (size >= BITS_PER_LONG) {
-        if (bitmap[word_offset] != ~0UL) {
-            // Found the first zero bit
-            bit_offset = __builtin_ffsl(~bitmap[word_offset]) - 1;
-            return word_offset * BITS_PER_LONG + bit_offset;
+
+    // Wrap around, nothing is free after `from`, so the first free word is the answer
+    // (PID 0 / 1 and the bits after MAX_PID are always marked used)
+    for (s = 0; s < PID_SUMMARY_WORDS; s++) {
+        summary = map->free_summary[s];
+        if (summary) {
+            return pid_map_first_free(map, s * BITS_PER_LONG + __builtin_ctzl(summary));
         }
-        
-        word_offset++;
-        size -= BITS_PER_LONG;
     }
-    
-    // Handle the remaining bits less than one unsigned long
-    if (size > 0) {
-        word = bitmap[word_offset];
-        if (word != ~0UL) {
-            bit_offset = __builtin_ffsl(~word) - 1;
-            if (bit_offset < size) {
-                return word_offset * BITS_PER_LONG + bit_offset;
-            }
-        }
+
+    return -1;
+}
+
+/**
+ * Reset a PID bitmap : every PID in [MIN_PID, MAX_PID] is free
+ */
+static void pid_map_init(pid_bitmap_t* map) {
+    for (int i = 0; i < PID_MAP_WORDS; i++) {
+        map->pid_bitmap[i] = 0;
     }
-    
-    // If not found, search from the beginning (circular search)
-    word_offset = BIT_WORD(MIN_PID);
-    unsigned int search_limit = BIT_WORD(offset);
-    
-    for (; word_offset < search_limit; word_offset++) {
-        if (bitmap[word_offset] != ~0UL) {
-            bit_offset = __builtin_ffsl(~bitmap[word_offset]) - 1;
-            return word_offset * BITS_PER_LONG + bit_offset;
-        }
+    for (int i = 0; i < PID_SUMMARY_WORDS; i++) {
+        map->free_summary[i] = 0;
     }
-    
-    // No zero bit found
-    return size;
+    for (int i = 0; i < PID_MAP_WORDS; i++) {
+        set_bit(i, map->free_summary);
+    }
+
+    // Reserve PID 0 and 1
+    pid_map_set(map, 0);    // Reserved for idle task
+    pid_map_set(map, 1);    // Reserved for init task
+
+    // The tail of the last word is not a valid PID, mark it used so the search never returns it
+    for (int pid = MAX_PID + 1; pid < PID_MAP_WORDS * BITS_PER_LONG; pid++) {
+        pid_map_set(map, pid);
+    }
+
+    map->last_pid = 1;
 }
 
 /**
- * Find the first zero bit in the bitmap
- * 
- * @param bitmap  Base address of the bitmap
- * @param size    Total number of bits in the bitmap
- * @return        Index of the first zero bit found, or size if not found
+ * Take the next free PID after last_pid
  */
-unsigned int find_first_zero_bit(const unsigned long *bitmap, unsigned int size) {
-    return find_next_zero_bit(bitmap, size, MIN_PID);
+static int pid_map_alloc(pid_bitmap_t* map) {
+    int from = map->last_pid + 1;
+    if (from > MAX_PID) {
+        from = MIN_PID;  // Wrap around to the minimum available PID
+    }
+
+    int pid = pid_map_find(map, from);
+    if (pid < 0) {
+        return -1;
+    }
+
+    pid_map_set(map, pid);
+    map->last_pid = pid;
+    return pid;
 }
 
 /**
  * Initialize the PID bitmap
  */
 void pid_bitmap_init(void) {
-    // Clear the entire bitmap
-    for (int i = 0; i < BITS_TO_LONGS(MAX_PID + 1); i++) {
-        pid_bitmap.pid_bitmap[i] = 0;
+    pid_map_init(&pid_bitmap);
+
+    // Empty hash buckets
+    for (int i = 0; i < PID_HASH_SIZE; i++) {
+        INIT_LIST_HEAD(&pid_hash[i]);
     }
     
-    // Reserve PID 0 and 1
-    set_bit(0, pid_bitmap.pid_bitmap); // Reserved for idle task
-    set_bit(1, pid_bitmap.pid_bitmap); // Reserved for init task
-    
-    // Set last_pid
-    pid_bitmap.last_pid = 1;
-    
     muart_puts("PID bitmap initialized, PIDs range from ");
     muart_send_dec(MIN_PID);
     muart_puts(" to ");
@@ -112,35 +146,21 @@ void pid_bitmap_init(void) {
 }
 
 /**
- * Allocate a new PID
+ * Allocate a new PID for the task and add the task into the PID hash table
  * 
+ * @param task    Task which owns the PID
  * @return        Allocated PID, or -1 on failure
  */
-pid_t pid_alloc(void) {
-    // Start searching from the PID after the last allocated one
-    int offset = pid_bitmap.last_pid + 1;
-    if (offset > MAX_PID) {
-        offset = MIN_PID;  // Wrap around to the minimum available PID
+pid_t pid_alloc(struct task_struct* task) {
+    int pid = pid_map_alloc(&pid_bitmap);
+    if (pid < 0) {
+        muart_puts("Error: No free PID available\r\n");
+        return -1;
     }
-    
-    // Find the next available PID
-    int pid = find_next_zero_bit(pid_bitmap.pid_bitmap, MAX_PID + 1, offset);
-    
-    // Check if the found PID is valid
-    if (pid < MIN_PID || pid > MAX_PID) {
-        // If not found or invalid, search again from the minimum PID
-        pid = find_next_zero_bit(pid_bitmap.pid_bitmap, MAX_PID + 1, MIN_PID);
-        
-        // Check again
-        if (pid < MIN_PID || pid > MAX_PID) {
-            muart_puts("Error: No free PID available\r\n");
-            return -1;
-        }
-    }
-    
-    // Mark the PID as allocated
-    set_bit(pid, pid_bitmap.pid_bitmap);
-    pid_bitmap.last_pid = pid;
+
+    // Make the task reachable from its PID
+    task->pid = pid;
+    list_add(&task->pid_link, &pid_hash[pid_hashfn(pid)]);
     
     return pid;
 }
@@ -166,6 +186,105 @@ void pid_free(pid_t pid) {
         return;
     }
     
+    // Remove the task from the PID hash table
+    struct task_struct* task = find_task_by_pid(pid);
+    if (task) {
+        list_del(&task->pid_link);
+    }
+
     // Free the PID
-    clear_bit(pid, pid_bitmap.pid_bitmap);
-} 
\ No newline at end of file
+    pid_map_clear(&pid_bitmap, pid);
+}
+
+/**
+ * Find the task of a PID
+ * Only the tasks of the same bucket are compared, MAX_PID / PID_HASH_SIZE of them at most
+ * 
+ * @param pid     PID to look up
+ * @return        The task, or NULL if the PID is not allocated
+ */
+struct task_struct* find_task_by_pid(pid_t pid) {
+    if (pid < MIN_PID || pid > MAX_PID) {
+        return NULL;
+    }
+
+    struct list_head* pos;
+    list_for_each(pos, &pid_hash[pid_hashfn(pid)]) {
+        struct task_struct* task = list_entry(pos, struct task_struct, pid_link);
+        if (task->pid == pid) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/* Private bitmap of the benchmark, the PIDs of the running tasks are not touched */
+static pid_bitmap_t bench_bitmap;
+
+#define PID_BENCH_ROUNDS 10000
+
+static void pid_bench_report(const char* name, unsigned long ticks) {
+    unsigned long freq = get_cntfrq_el0();
+
+    muart_puts(name);
+    muart_puts(": ");
+    muart_send_dec(PID_BENCH_ROUNDS);
+    muart_puts(" alloc/free in ");
+    muart_send_dec((int)(ticks * 1000000 / freq));
+    muart_puts(" us, ");
+    muart_send_dec(ticks ? (int)(PID_BENCH_ROUNDS * freq / ticks) : 0);
+    muart_puts(" ops/s\r\n");
+}
+
+/**
+ * Measure pid alloc / free on an almost full PID space
+ * 1. 99% occupancy : one PID in every 128 is free, every round frees a random used PID and allocates again
+ * 2. Worst case    : a single free PID right behind last_pid, every allocation has to wrap around the whole space
+ */
+void pid_alloc_benchmark(void) {
+    unsigned long start, ticks;
+    unsigned int seed = 2025;
+    int pid;
+
+    muart_puts("\r\n=== PID allocator benchmark ===\r\n");
+
+    // Case 1 : fill the whole space and give back one PID out of 128
+    pid_map_init(&bench_bitmap);
+    while (pid_map_alloc(&bench_bitmap) >= 0)
+        ;
+    for (pid = MIN_PID; pid <= MAX_PID; pid += 128) {
+        pid_map_clear(&bench_bitmap, pid);
+    }
+
+    start = get_cntpct_el0();
+    for (int i = 0; i < PID_BENCH_ROUNDS; i++) {
+        pid_map_alloc(&bench_bitmap);
+
+        // Free a pseudo random PID which is in use (xorshift)
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        pid = MIN_PID + seed % (MAX_PID - MIN_PID + 1);
+        while (!test_bit(pid, bench_bitmap.pid_bitmap)) {
+            pid = (pid == MAX_PID) ? MIN_PID : pid + 1;
+        }
+        pid_map_clear(&bench_bitmap, pid);
+    }
+    ticks = get_cntpct_el0() - start;
+    pid_bench_report("99% full", ticks);
+
+    // Case 2 : only one free PID, it is always found after a full wrap around
+    pid_map_init(&bench_bitmap);
+    while (pid_map_alloc(&bench_bitmap) >= 0)
+        ;
+    pid = MAX_PID / 2;
+    pid_map_clear(&bench_bitmap, pid);
+
+    start = get_cntpct_el0();
+    for (int i = 0; i < PID_BENCH_ROUNDS; i++) {
+        pid = pid_map_alloc(&bench_bitmap);
+        pid_map_clear(&bench_bitmap, pid);
+    }
+    ticks = get_cntpct_el0() - start;
+    pid_bench_report("1 PID free", ticks);
+}
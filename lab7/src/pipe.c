@@ -0,0 +1,250 @@
+#include "pipe.h"
+#include "malloc.h"
+#include "mm.h"
+#include "exception.h"
+
+#define LOG_PIPE 0
+#if LOG_PIPE
+#include "muart.h"
+#endif
+
+static int pipe_open(struct vnode* file_node, struct file** target, int flags);
+static int pipe_close(struct file* file);
+static int pipe_read(struct file* file, void* buf, size_t len);
+static int pipe_write(struct file* file, const void* buf, size_t len);
+static long pipe_lseek64(struct file* file, long offset, int whence);
+
+static struct file_operations pipe_file_ops = {
+    .open = pipe_open,
+    .close = pipe_close,
+    .read = pipe_read,
+    .write = pipe_write,
+    .lseek64 = pipe_lseek64,
+};
+
+/* Create one end of the pipe */
+static int pipe_open(struct vnode* file_node, struct file** target, int flags) {
+    if (!file_node || !target) {
+        return VFS_EINVAL;
+    }
+
+    struct pipe_inode* pipe = (struct pipe_inode*)file_node->internal;
+
+    struct file* file = (struct file*)dmalloc(sizeof(struct file));
+    if (!file) {
+        return VFS_ENOMEM;
+    }
+    file->vnode = file_node;
+    file->f_pos = 0;
+    file->f_ops = file_node->f_ops;
+    file->flags = flags;
+    file->f_count = 1;
+
+    if (flags == O_RDONLY) {
+        pipe->readers++;
+    }
+    else {
+        pipe->writers++;
+    }
+
+    *target = file;
+    return VFS_OK;
+}
+
+/* Also called by exit_task() with interrupts disabled, so the interrupt state is restored instead of enabled */
+static int pipe_close(struct file* file) {
+    if (!file) {
+        return VFS_EINVAL;
+    }
+
+    unsigned long flags = irq_save();
+
+    struct vnode* vnode = file->vnode;
+    struct pipe_inode* pipe = (struct pipe_inode*)vnode->internal;
+
+    // Wake up the other end so that it can see EOF (no writer) or a broken pipe (no reader)
+    if (file->flags == O_RDONLY) {
+        pipe->readers--;
+        wake_up(&pipe->wr_wait);
+    }
+    else {
+        pipe->writers--;
+        wake_up(&pipe->rd_wait);
+    }
+
+    // Free the pipe after both ends are closed
+    if (pipe->readers == 0 && pipe->writers == 0) {
+        #if LOG_PIPE
+            muart_puts("[pipe_close] Freeing pipe\r\n");
+        #endif
+        dfree(pipe->buf);
+        dfree(pipe);
+        dfree(vnode);
+    }
+
+    dfree(file);
+    irq_restore(flags);
+    return VFS_OK;
+}
+
+/* Read up to len bytes, block while the pipe is empty and there is still a writer, return 0 on EOF */
+static int pipe_read(struct file* file, void* buf, size_t len) {
+    if (!file || !buf) {
+        return VFS_EINVAL;
+    }
+    if (file->flags != O_RDONLY) {
+        return VFS_EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    struct pipe_inode* pipe = (struct pipe_inode*)file->vnode->internal;
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    disable_irq_in_el1();
+
+    while (pipe->head == pipe->tail) {
+        if (pipe->writers == 0) {
+            enable_irq_in_el1();
+            return 0;   // EOF
+        }
+        if (signal_pending(current)) {
+            enable_irq_in_el1();
+            return VFS_EINTR;
+        }
+        sleep_on(&pipe->rd_wait);
+    }
+
+    size_t used = pipe->head - pipe->tail;
+    size_t to_read = (len < used) ? len : used;
+
+    // Copy in at most two pieces: up to the end of the buffer, then from the beginning
+    size_t offset = pipe->tail & PIPE_BUF_MASK;
+    size_t first = PIPE_BUF_SIZE - offset;
+    if (first > to_read) {
+        first = to_read;
+    }
+    memcpy(buf, pipe->buf + offset, first);
+    memcpy((char*)buf + first, pipe->buf, to_read - first);
+    pipe->tail += to_read;
+
+    wake_up(&pipe->wr_wait);
+    enable_irq_in_el1();
+
+    #if LOG_PIPE
+        muart_puts("[pipe_read] Read ");
+        muart_send_dec(to_read);
+        muart_puts(" bytes\r\n");
+    #endif
+    return to_read;
+}
+
+/* Write all len bytes, block while the pipe is full, fail with VFS_EPIPE if every read end is closed */
+static int pipe_write(struct file* file, const void* buf, size_t len) {
+    if (!file || !buf) {
+        return VFS_EINVAL;
+    }
+    if (file->flags != O_WRONLY) {
+        return VFS_EINVAL;
+    }
+
+    struct pipe_inode* pipe = (struct pipe_inode*)file->vnode->internal;
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    size_t written = 0;
+
+    disable_irq_in_el1();
+
+    while (written < len) {
+        if (pipe->readers == 0) {
+            enable_irq_in_el1();
+            return written ? written : VFS_EPIPE;
+        }
+
+        size_t space = PIPE_BUF_SIZE - (pipe->head - pipe->tail);
+        if (space == 0) {
+            if (signal_pending(current)) {
+                enable_irq_in_el1();
+                return written ? written : VFS_EINTR;
+            }
+            sleep_on(&pipe->wr_wait);
+            continue;
+        }
+
+        size_t chunk = len - written;
+        if (chunk > space) {
+            chunk = space;
+        }
+
+        size_t offset = pipe->head & PIPE_BUF_MASK;
+        size_t first = PIPE_BUF_SIZE - offset;
+        if (first > chunk) {
+            first = chunk;
+        }
+        memcpy(pipe->buf + offset, (const char*)buf + written, first);
+        memcpy(pipe->buf, (const char*)buf + written + first, chunk - first);
+        pipe->head += chunk;
+        written += chunk;
+
+        // Let the reader consume while we wait for more space
+        wake_up(&pipe->rd_wait);
+    }
+
+    enable_irq_in_el1();
+
+    #if LOG_PIPE
+        muart_puts("[pipe_write] Wrote ");
+        muart_send_dec(written);
+        muart_puts(" bytes\r\n");
+    #endif
+    return written;
+}
+
+static long pipe_lseek64(struct file* file, long offset, int whence) {
+    return VFS_EINVAL;  // Pipes are not seekable
+}
+
+/* Create a pipe, return the read end in files[0] and the write end in files[1] */
+int pipe_create(struct file* files[2]) {
+    if (!files) {
+        return VFS_EINVAL;
+    }
+
+    struct pipe_inode* pipe = (struct pipe_inode*)dmalloc(sizeof(struct pipe_inode));
+    struct vnode* vnode = (struct vnode*)dmalloc(sizeof(struct vnode));
+    char* buf = (char*)dmalloc(PIPE_BUF_SIZE);
+    if (!pipe || !vnode || !buf) {
+        if (pipe) dfree(pipe);
+        if (vnode) dfree(vnode);
+        if (buf) dfree(buf);
+        return VFS_ENOMEM;
+    }
+
+    pipe->buf = buf;
+    pipe->head = 0;
+    pipe->tail = 0;
+    pipe->readers = 0;
+    pipe->writers = 0;
+    init_waitqueue_head(&pipe->rd_wait);
+    init_waitqueue_head(&pipe->wr_wait);
+    pipe->vnode = vnode;
+
+    // A pipe is not in any mounted file system
+    vnode->mount = NULL;
+    vnode->v_ops = NULL;
+    vnode->f_ops = &pipe_file_ops;
+    vnode->internal = pipe;
+
+    if (pipe_open(vnode, &files[0], O_RDONLY) != VFS_OK) {
+        dfree(buf);
+        dfree(pipe);
+        dfree(vnode);
+        return VFS_ENOMEM;
+    }
+    if (pipe_open(vnode, &files[1], O_WRONLY) != VFS_OK) {
+        pipe_close(files[0]);   // Frees the pipe since it has no writer
+        return VFS_ENOMEM;
+    }
+
+    return VFS_OK;
+}
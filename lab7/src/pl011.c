@@ -0,0 +1,440 @@
+#include "pl011.h"
+#include "registers.h"
+#include "utils.h"
+#include "mm.h"
+#include "mailbox.h"
+#include "dma.h"
+#include "exception.h"
+#include "sched.h"
+#include "signal.h"
+#include "chardev.h"
+#include "muart.h"
+#include "driver.h"
+
+#define LOG_PL011 0
+
+// Size of the RX / TX buffer is 2^PL011_BUFFER_SHIFT bytes, can be overridden with -DPL011_BUFFER_SHIFT=...
+#ifndef PL011_BUFFER_SHIFT
+#define PL011_BUFFER_SHIFT 12
+#endif
+#define PL011_BUFFER_SIZE (1 << PL011_BUFFER_SHIFT)
+#define PL011_BUFFER_MASK (PL011_BUFFER_SIZE - 1)
+
+/*
+ * The DMA engine moves 32-bit words and every word written to DR sends one char (read from DR : one char + error flags),
+ * so a DMA transfer goes through a word buffer, one word per char
+ * Less than PL011_DMA_MIN bytes are cheaper to push into the 16-byte FIFO from the TX interrupt
+ */
+#define PL011_DMA_CHUNK 512
+#define PL011_DMA_MIN   32
+
+/* Bits of LCRH / CR / IFLS / DMACR */
+#define PL011_LCRH_FEN      (1 << 4)        // Enable the FIFOs
+#define PL011_LCRH_WLEN_8   (3 << 5)        // 8-bit word
+#define PL011_CR_UARTEN     (1 << 0)
+#define PL011_CR_TXE        (1 << 8)
+#define PL011_CR_RXE        (1 << 9)
+#define PL011_IFLS_TX_1_8   (0 << 0)        // TX interrupt when the TX FIFO drains to 2 bytes
+#define PL011_IFLS_RX_1_2   (2 << 3)        // RX interrupt when the RX FIFO fills to 8 bytes
+#define PL011_DMACR_TXDMAE  (1 << 1)
+#define PL011_DR_ERROR      0xF00           // Overrun / break / parity / framing error of the received char
+
+/* Mailbox property tag and clock id */
+#define SET_CLOCK_RATE      0x00038002
+#define CLOCK_ID_UART       2
+
+static char rx_buffer[PL011_BUFFER_SIZE];
+static volatile int rx_head = 0;            // Point to the index can write
+static volatile int rx_tail = 0;            // Point to the index can read
+
+static char tx_buffer[PL011_BUFFER_SIZE];
+static volatile int tx_head = 0;
+static volatile int tx_tail = 0;
+
+static struct wait_queue_head rx_wait;
+static struct wait_queue_head tx_wait;
+
+// TX DMA : the words of the transfer in flight, the CPU must not touch DR until it is done
+static volatile unsigned int tx_dma_words[PL011_DMA_CHUNK] __attribute__((aligned(32)));
+static volatile struct dma_cb tx_cb;
+static volatile int tx_dma_active = 0;
+static int pl011_dma_ok = 0;                // 0 : DMA failed or not initialized, only use the FIFO
+
+static unsigned long pl011_rx_errors = 0;   // Chars received with an error flag
+static unsigned long pl011_dma_errors = 0;
+
+static int pl011_irq = PL011_DEFAULT_IRQ;   // From the device tree once probed
+
+/* Ask the firmware to run the UART reference clock at rate Hz, return 0 on success */
+static int pl011_set_clock(unsigned int rate) {
+    volatile unsigned int __attribute__((aligned(16))) mailbox[9];
+
+    mailbox[0] = 9 * 4;             // buffer size in bytes
+    mailbox[1] = REQUEST_CODE;
+    // tags begin
+    mailbox[2] = SET_CLOCK_RATE;    // tag identifier
+    mailbox[3] = 12;                // value buffer size
+    mailbox[4] = TAG_REQUEST_CODE;
+    mailbox[5] = CLOCK_ID_UART;     // clock id
+    mailbox[6] = rate;              // rate in Hz
+    mailbox[7] = 0;                 // don't skip setting turbo
+    // tags end
+    mailbox[8] = END_TAG;
+
+    if (mailbox_call(8, mailbox) != 0) {
+        return -1;
+    }
+
+    return (mailbox[1] == REQUEST_SUCCEED) ? 0 : -1;
+}
+
+/* Move GPIO 14 / 15 from the mini UART (ALT5) to the PL011 (ALT0) */
+static void pl011_gpio_init(void) {
+    unsigned int reg;
+    reg = regRead(GPFSEL1);
+    reg &= ~(7<<12);        // GPIO 14
+    reg |= 4<<12;
+    reg &= ~(7<<15);        // GPIO 15
+    reg |= 4<<15;
+    regWrite(GPFSEL1, reg);
+
+    // Disable GPIO pull up/down
+    regWrite(GPPUD, 0);
+    waitCycle(150);
+    regWrite(GPPUDCLK0, (1<<14)|(1<<15));
+    waitCycle(150);
+    regWrite(GPPUDCLK0, 0);
+}
+
+/*
+ * Start the next piece of the TX buffer, called with interrupts disabled
+ * A long backlog is copied into the DMA word buffer and its space in the TX buffer is released at once,
+ * a short one is pushed into the FIFO and the TX interrupt asks for more when the FIFO runs low
+ */
+static void pl011_tx_kick(void) {
+    unsigned int imsc = regRead(PL011_IMSC);
+
+    // DR belongs to the DMA engine until its interrupt
+    if (tx_dma_active) {
+        return;
+    }
+
+    size_t used = (tx_head - tx_tail) & PL011_BUFFER_MASK;
+    if (used == 0) {
+        regWrite(PL011_IMSC, imsc & ~PL011_INT_TX);
+        return;
+    }
+
+    if (pl011_dma_ok && used >= PL011_DMA_MIN) {
+        size_t n = (used < PL011_DMA_CHUNK) ? used : PL011_DMA_CHUNK;
+        for (size_t i = 0; i < n; i++) {
+            tx_dma_words[i] = (unsigned char)tx_buffer[tx_tail];
+            tx_tail = (tx_tail + 1) & PL011_BUFFER_MASK;
+        }
+
+        tx_cb.ti = DMA_TI_INTEN | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_SRC_INC | DMA_TI_PERMAP(DMA_DREQ_UART_TX);
+        tx_cb.source_ad = DMA_BUS_ADDR(tx_dma_words);
+        tx_cb.dest_ad = DMA_BUS_PERIPHERAL(PL011_DR);
+        tx_cb.txfr_len = n * 4;
+        tx_cb.stride = 0;
+        tx_cb.nextconbk = 0;
+
+        tx_dma_active = 1;
+        regWrite(PL011_IMSC, imsc & ~PL011_INT_TX);
+        dma_start(PL011_TX_DMA_CHANNEL, &tx_cb);
+        return;
+    }
+
+    while (tx_head != tx_tail && !(regRead(PL011_FR) & PL011_FR_TXFF)) {
+        regWrite(PL011_DR, tx_buffer[tx_tail]);
+        tx_tail = (tx_tail + 1) & PL011_BUFFER_MASK;
+    }
+
+    if (tx_head != tx_tail) {
+        regWrite(PL011_IMSC, imsc | PL011_INT_TX);
+    } else {
+        regWrite(PL011_IMSC, imsc & ~PL011_INT_TX);
+    }
+}
+
+/* Set up the PL011 on GPIO 14 / 15, enable its TX interrupt and the TX DMA channel */
+void pl011_init(void) {
+    init_waitqueue_head(&rx_wait);
+    init_waitqueue_head(&tx_wait);
+    rx_head = rx_tail = 0;
+    tx_head = tx_tail = 0;
+
+    // Disable the UART and flush the FIFOs (clearing FEN empties them) during configuration
+    regWrite(PL011_CR, 0);
+    regWrite(PL011_LCRH, 0);
+
+    unsigned long clock = PL011_CLOCK;
+    if (pl011_set_clock(PL011_CLOCK) != 0) {
+        // Keep the firmware default (init_uart_clock, 48MHz unless config.txt says otherwise)
+        muart_puts("pl011: failed to set the UART clock\r\n");
+    }
+
+    pl011_gpio_init();
+
+    // Baud rate divisor = clock / (16 * baud), 6-bit fraction : 64 * clock / (16 * baud) = 4 * clock / baud (rounded)
+    unsigned long div = (clock * 4 + PL011_BAUD / 2) / PL011_BAUD;
+    regWrite(PL011_ICR, PL011_INT_ALL);
+    regWrite(PL011_IBRD, div >> 6);
+    regWrite(PL011_FBRD, div & 0x3F);
+    regWrite(PL011_LCRH, PL011_LCRH_FEN | PL011_LCRH_WLEN_8);   // Must be written after IBRD / FBRD to latch them
+    regWrite(PL011_IFLS, PL011_IFLS_TX_1_8 | PL011_IFLS_RX_1_2);
+    regWrite(PL011_IMSC, 0);
+    regWrite(PL011_DMACR, PL011_DMACR_TXDMAE);
+    regWrite(PL011_CR, PL011_CR_UARTEN | PL011_CR_TXE | PL011_CR_RXE);
+
+    dma_init_channel(PL011_TX_DMA_CHANNEL);
+    pl011_dma_ok = 1;
+
+    // Enable the PL011 and the TX DMA channel interrupts at the second-level controller
+    irq_enable(pl011_irq);
+    irq_enable(dma_channel_irq(PL011_TX_DMA_CHANNEL));
+
+    #if LOG_PL011
+    muart_puts("pl011: IBRD ");
+    muart_send_dec(div >> 6);
+    muart_puts(", FBRD ");
+    muart_send_dec(div & 0x3F);
+    muart_puts("\r\n");
+    #endif
+}
+
+/* The PL011 interrupt : drain the RX FIFO and refill the TX FIFO */
+void pl011_irq_handler(void) {
+    unsigned int mis = regRead(PL011_MIS);
+    int rx_old_head = rx_head;
+    int tx_old_tail = tx_tail;
+
+    regWrite(PL011_ICR, mis);
+
+    while (!(regRead(PL011_FR) & PL011_FR_RXFE)) {
+        unsigned int data = regRead(PL011_DR);
+        if (data & PL011_DR_ERROR) {
+            pl011_rx_errors++;
+        }
+        if (((rx_head + 1) & PL011_BUFFER_MASK) != rx_tail) {
+            rx_buffer[rx_head] = data & 0xFF;
+            rx_head = (rx_head + 1) & PL011_BUFFER_MASK;
+        }
+    }
+
+    if (mis & PL011_INT_TX) {
+        pl011_tx_kick();
+    }
+
+    if (rx_head != rx_old_head) {
+        wake_up(&rx_wait);
+    }
+    if (tx_tail != tx_old_tail) {
+        wake_up(&tx_wait);
+    }
+}
+
+/* The TX DMA channel interrupt : the transfer is done, DR is free again */
+void pl011_dma_irq_handler(void) {
+    int tx_old_tail = tx_tail;
+
+    if (dma_ack(PL011_TX_DMA_CHANNEL) < 0) {
+        // The rest of that chunk is lost, don't trust the channel anymore
+        pl011_dma_errors++;
+        pl011_dma_ok = 0;
+    }
+    tx_dma_active = 0;
+
+    pl011_tx_kick();
+
+    if (tx_tail != tx_old_tail) {
+        wake_up(&tx_wait);
+    }
+}
+
+/* Non-blocking write : copy the data into the TX buffer, return the bytes accepted */
+size_t pl011_write(const char* buffer, size_t size) {
+    unsigned long flags = irq_save();
+    size_t count = 0;
+
+    while (count < size && ((tx_head + 1) & PL011_BUFFER_MASK) != tx_tail) {
+        tx_buffer[tx_head] = buffer[count++];
+        tx_head = (tx_head + 1) & PL011_BUFFER_MASK;
+    }
+    pl011_tx_kick();
+
+    irq_restore(flags);
+    return count;
+}
+
+size_t pl011_tx_space(void) {
+    return (tx_tail - tx_head - 1) & PL011_BUFFER_MASK;
+}
+
+/* Copy at most size bytes out of the RX buffer, called with interrupts disabled */
+static size_t pl011_read_buffered(char* buffer, size_t size) {
+    size_t used = (rx_head - rx_tail) & PL011_BUFFER_MASK;
+    size_t count = (size < used) ? size : used;
+    size_t first = PL011_BUFFER_SIZE - rx_tail;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(buffer, &rx_buffer[rx_tail], first);
+    memcpy(buffer + first, rx_buffer, count - first);
+    rx_tail = (rx_tail + count) & PL011_BUFFER_MASK;
+    return count;
+}
+
+/**
+ * Blocking read : sleep until the RX buffer has data, then copy out what is there (at most size bytes)
+ * As with the mini UART, the RX interrupts are only on while somebody waits, the shell polls the FIFO otherwise
+ */
+long pl011_read_wait(char* buffer, size_t size) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    if (size == 0) {
+        return 0;
+    }
+
+    disable_irq_in_el1();
+    while (rx_head == rx_tail) {
+        if (signal_pending(current)) {
+            enable_irq_in_el1();
+            return -1;
+        }
+        regWrite(PL011_IMSC, regRead(PL011_IMSC) | PL011_INT_RX | PL011_INT_RT);
+        sleep_on(&rx_wait);
+    }
+
+    size_t count = pl011_read_buffered(buffer, size);
+
+    if (list_empty(&rx_wait.task_list)) {
+        regWrite(PL011_IMSC, regRead(PL011_IMSC) & ~(PL011_INT_RX | PL011_INT_RT));
+    }
+    enable_irq_in_el1();
+
+    return count;
+}
+
+/* Blocking write : sleep whenever the TX buffer is full until the TX interrupt makes room */
+long pl011_write_wait(const char* buffer, size_t size) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    size_t written = 0;
+
+    disable_irq_in_el1();
+    while (written < size) {
+        size_t n = pl011_write(buffer + written, size - written);
+        written += n;
+        if (written == size) {
+            break;
+        }
+        if (n == 0) {
+            if (signal_pending(current)) {
+                break;
+            }
+            sleep_on(&tx_wait);
+        }
+    }
+    enable_irq_in_el1();
+
+    return written ? (long)written : -1;
+}
+
+/* Poll the bytes out, bypassing the TX buffer */
+size_t pl011_write_sync(const char* buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        while (regRead(PL011_FR) & PL011_FR_TXFF) {
+            // do nothing
+        }
+        regWrite(PL011_DR, buffer[i]);
+    }
+    return size;
+}
+
+/* Receive a char by polling, bytes already buffered by the RX interrupt come first */
+char pl011_getc_sync(void) {
+    unsigned long flags = irq_save();
+    if (rx_head != rx_tail) {
+        char c = rx_buffer[rx_tail];
+        rx_tail = (rx_tail + 1) & PL011_BUFFER_MASK;
+        irq_restore(flags);
+        return c;
+    }
+    irq_restore(flags);
+
+    while (regRead(PL011_FR) & PL011_FR_RXFE) {
+        // do nothing
+    }
+    return regRead(PL011_DR) & 0xFF;
+}
+
+/* Transmit everything left in the TX buffer by polling, for when interrupts can't be relied on anymore (panic) */
+void pl011_flush_sync(void) {
+    regWrite(PL011_IMSC, regRead(PL011_IMSC) & ~PL011_INT_TX);
+
+    // Let the transfer in flight finish, it holds the oldest bytes
+    if (tx_dma_active) {
+        while (dma_busy(PL011_TX_DMA_CHANNEL)) {
+            // do nothing
+        }
+        dma_ack(PL011_TX_DMA_CHANNEL);
+        tx_dma_active = 0;
+    }
+
+    while (tx_head != tx_tail) {
+        pl011_write_sync(&tx_buffer[tx_tail], 1);
+        tx_tail = (tx_tail + 1) & PL011_BUFFER_MASK;
+    }
+}
+
+/* --- Driver of the PL011 --- */
+static void pl011_irq_entry(void* data) {
+    pl011_irq_handler();
+}
+
+static void pl011_dma_irq_entry(void* data) {
+    pl011_dma_irq_handler();
+}
+
+/* The registers are still the fixed ones of registers.h, only accept the PL011 where they point to */
+static int pl011_probe(struct device* dev) {
+    if (dev->base != PL011_BASE || dev->irq < 0) {
+        muart_puts("Error: unsupported PL011 at ");
+        muart_send_hex(dev->base);
+        muart_puts("\r\n");
+        return -1;
+    }
+    pl011_irq = dev->irq;
+    if (request_irq(pl011_irq, pl011_irq_entry, IRQF_NO_AUTOEN, "pl011", NULL) != 0) {
+        return -1;
+    }
+    if (request_irq(dma_channel_irq(PL011_TX_DMA_CHANNEL), pl011_dma_irq_entry, IRQF_NO_AUTOEN, "pl011-dma", NULL) != 0) {
+        free_irq(pl011_irq, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static const char* const pl011_compatible[] = { "arm,pl011", NULL };
+
+struct driver pl011_driver = {
+    .name = "pl011",
+    .compatible = pl011_compatible,
+    .probe = pl011_probe,
+    .default_base = PL011_BASE,
+    .default_size = 0x200,
+    .default_irq = PL011_DEFAULT_IRQ,
+};
+
+/* The PL011 as a console device */
+struct char_device pl011_device = {
+    .name       = "PL011 UART",
+    .init       = pl011_init,
+    .write      = pl011_write,
+    .tx_space   = pl011_tx_space,
+    .read_wait  = pl011_read_wait,
+    .write_wait = pl011_write_wait,
+    .write_sync = pl011_write_sync,
+    .getc_sync  = pl011_getc_sync,
+    .flush_sync = pl011_flush_sync,
+};
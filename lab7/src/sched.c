@@ -1,4 +1,5 @@
 #include "sched.h"
+#include "signal.h"
 #include "malloc.h"
 #include "list.h"
 #include "muart.h"
@@ -27,8 +28,14 @@ struct list_head task_lists;
 // Use a doubly-linked list to maintain the run queue
 struct list_head rq;
 
+// Zombies that nobody will wait for, reaped by the idle task (linked by task->list)
+static struct list_head zombie_list;
+
 static struct task_struct* idle_task = NULL;       // Idle thread
 
+// The time slice is over, schedule() is called on the way out of the IRQ exception
+volatile int need_resched = 0;
+
 
 /* 
  * Create a new kernel thread: initialize the properties of the task struct and add it to the run queue
@@ -49,7 +56,7 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
     }
 
     // Allocate PID
-    new_task->pid = pid_alloc();
+    new_task->pid = pid_alloc(new_task);
     if (new_task->pid < 0) {
         dfree(new_task);
         muart_puts("Failed to allocate PID\r\n");
@@ -60,6 +67,9 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
     // Initialize the properties for the task descriptor of the task
     new_task->state = TASK_RUNNING;
     new_task->parent = (struct task_struct*)get_current_thread();
+    new_task->exit_code = 0;
+    INIT_LIST_HEAD(&new_task->children);
+    init_waitqueue_head(&new_task->wait_chldexit);
     
     // Allocate a memory space for the task's kernel stack
     new_task->kernel_stack = dmalloc(THREAD_STACK_SIZE);
@@ -106,8 +116,19 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
     INIT_LIST_HEAD(&new_task->task);
     list_add_tail(&new_task->task, &task_lists);
 
+    // Add the new task into its parent's children
+    if (new_task->parent) {
+        list_add_tail(&new_task->sibling, &new_task->parent->children);
+    }
+    else {
+        INIT_LIST_HEAD(&new_task->sibling);
+    }
+
     // VFS init
     vfs_task_init(new_task);
+
+    // All signals take the default action
+    signal_init(new_task);
     
     enable_irq_in_el1();
     return new_task->pid;
@@ -118,7 +139,7 @@ pid_t kernel_thread(thread_func_t fn, void* arg) {
  * 目前 schedule() 只會在以下幾種情況被呼叫
  * 1. Thread Voluntary Yielding CPU
  * 2. Thread Exit (called in funtion `thread_exit()`)
- * 3. Timer interrupt (called in `timer_irq_handler()`) 
+ * 3. Timer interrupt (called in `irq_entry()` after the handlers, when `timer_irq_handler()` set need_resched) 
  */
 void schedule(){
     // Disable interrupt when pick a thread in run queue (prevent race conditions when accessing global variable like run queue, pid_bitmap and task list)
@@ -185,10 +206,9 @@ void thread_exit(){
     disable_irq_in_el1();
 
     struct task_struct* current = (struct task_struct*)get_current_thread();
-    current->state = TASK_ZOMBIE;
 
-    // Remove from the run queue
-    list_del(&current->list);
+    // Become a zombie (exit_code is set by exit() or by the signal which killed the task)
+    exit_task(current, current->exit_code);
 
     muart_puts("Thread ");
     muart_send_dec(current->pid);
@@ -201,11 +221,191 @@ void thread_exit(){
     while(1) {}
 }
 
+/* 
+ * Turn the task into a zombie : remove it from the run queue (or wait queue), give its children away and notify its parent
+ * 原本 idle task 每次都要掃過整個 task_lists 找 zombie，現在 zombie 只會出現在 parent 的 children 或 zombie_list 中
+ * Must be called with interrupt disabled
+ */
+void exit_task(struct task_struct* task, int exit_code){
+    struct list_head* pos;
+    struct list_head* tmp;
+
+    if (task->state == TASK_ZOMBIE || task->state == TASK_DEAD) {
+        return;
+    }
+
+    // Remove from the run queue or the wait queue
+    list_del(&task->list);
+    task->state = TASK_ZOMBIE;
+    task->exit_code = exit_code;
+
+    // Close the files now rather than when the zombie is reaped, e.g. the parent reading a pipe to EOF before waitpid()
+    // must see this write end closed
+    vfs_cleanup_task(task);
+
+    // Orphans : nobody can wait for them any more, the idle task reaps them when they exit
+    list_for_each_safe(pos, tmp, &task->children) {
+        struct task_struct* child = list_entry(pos, struct task_struct, sibling);
+        list_del(&child->sibling);
+        INIT_LIST_HEAD(&child->sibling);
+        child->parent = NULL;
+        if (child->state == TASK_ZOMBIE) {
+            list_add_tail(&child->list, &zombie_list);
+        }
+    }
+
+    // Only a user process can call waitpid(), the children of kernel threads are reaped by the idle task
+    struct task_struct* parent = task->parent;
+    if (parent && parent != idle_task && parent->user_program) {
+        // Stay in parent->children until the parent reaps it with waitpid()
+        wake_up(&parent->wait_chldexit);
+        send_signal(parent, SIGCHLD);
+    }
+    else {
+        list_del(&task->sibling);
+        INIT_LIST_HEAD(&task->sibling);
+        task->parent = NULL;
+        list_add_tail(&task->list, &zombie_list);
+    }
+}
+
+/* Free everything owned by a zombie, including the task structure itself */
+static void release_task(struct task_struct* zombie){
+    // Free the resoures : free the zombie task's stack
+    if (zombie->kernel_stack) {
+        dfree(zombie->kernel_stack);
+    }
+
+    if (zombie->user_stack) {
+        dfree(zombie->user_stack);
+    }
+
+    // Free the zombie task's user program memory
+    if (zombie->user_program) {
+        muart_puts("  Freeing user program (size: ");
+        muart_send_dec(zombie->user_program_size);
+        muart_puts(" bytes)\r\n");
+        dfree(zombie->user_program);
+        zombie->user_program = NULL;
+        zombie->user_program_size = 0;
+    }
+    
+    // Free the zombie task's pid
+    pid_free(zombie->pid);
+
+    // Mark the state of dead
+    zombie->state = TASK_DEAD;
+    
+    // Remove from task list 
+    list_del(&zombie->task);
+    
+    // The files were already closed by exit_task()
+
+    // Free the zombie itself
+    dfree(zombie);
+}
+
+/* Wait for a child (pid, or any child if pid is -1) to exit, return its pid, 0 if WNOHANG and no child has exited, -1 on error */
+pid_t do_waitpid(pid_t pid, int* status, int options){
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    struct list_head* pos;
+
+    disable_irq_in_el1();
+
+    while (1) {
+        int has_child = 0;
+
+        list_for_each(pos, &current->children) {
+            struct task_struct* child = list_entry(pos, struct task_struct, sibling);
+            if (pid != -1 && child->pid != pid) {
+                continue;
+            }
+            has_child = 1;
+
+            if (child->state == TASK_ZOMBIE) {
+                // Reap it right away, no need to go through the idle task
+                pid_t child_pid = child->pid;
+                if (status) {
+                    *status = child->exit_code;
+                }
+                list_del(&child->sibling);
+                release_task(child);
+                enable_irq_in_el1();
+                return child_pid;
+            }
+        }
+
+        if (!has_child) {
+            enable_irq_in_el1();
+            return -1;
+        }
+        if (options & WNOHANG) {
+            enable_irq_in_el1();
+            return 0;
+        }
+        if (signal_pending(current)) {
+            enable_irq_in_el1();
+            return -1;
+        }
+
+        // exit_task() of a child wakes us up
+        sleep_on(&current->wait_chldexit);
+    }
+}
+
+/* Initialize an empty wait queue */
+void init_waitqueue_head(struct wait_queue_head* wq){
+    INIT_LIST_HEAD(&wq->task_list);
+}
+
+/* 
+ * Put the current task to sleep on the wait queue and run another task
+ * 呼叫前要先 disable interrupt，避免在檢查 condition 和進入 sleep 之間被 wake_up 而錯過 (lost wake-up)
+ */
+void sleep_on(struct wait_queue_head* wq){
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    // Move the current task from the run queue to the wait queue
+    current->state = TASK_WAITING;
+    list_del(&current->list);
+    list_add_tail(&current->list, &wq->task_list);
+
+    // schedule() won't put a waiting task back to the run queue
+    schedule();
+
+    // Woken up by wake_up(), schedule() returns with interrupt disabled
+    disable_irq_in_el1();
+}
+
+/* 1 if the current context may call sleep_on() : the scheduler is running and it is not the idle task */
+int task_can_sleep(void){
+    // The idle task must stay runnable, schedule() falls back to it when the run queue is empty
+    return idle_task != NULL && (struct task_struct*)get_current_thread() != idle_task;
+}
+
+/* Move a task sleeping on a wait queue back to the run queue */
+void wake_up_process(struct task_struct* task){
+    list_del(&task->list);
+    task->state = TASK_RUNNING;
+    list_add_tail(&task->list, &rq);
+}
+
+/* Move every task sleeping on the wait queue back to the run queue */
+void wake_up(struct wait_queue_head* wq){
+    struct list_head* pos;
+    struct list_head* tmp;
+
+    list_for_each_safe(pos, tmp, &wq->task_list) {
+        wake_up_process(list_entry(pos, struct task_struct, list));
+    }
+}
+
 /* 
  * The function which the idle task will run
- * When the idle thread is scheduled, it checks if there is any zombie thread : 
+ * When the idle thread is scheduled, it checks if there is any zombie thread in zombie_list : 
  * If yes, it recycles the resources 
  * If there is no zombie task, just yield the CPU
+ * (Zombies whose parent can wait for them are reaped by waitpid() instead)
  */
 void idle_task_fn(){
     muart_puts("Idle task started\r\n");
@@ -213,56 +413,17 @@ void idle_task_fn(){
     while(1) {
         disable_irq_in_el1();
 
-        // Check if there is any zombie task in the task list
-        // If there is no zombie task, just yield the CPU
-        // If there is a zombie task, clean it  up
-        struct list_head* pos;
-        struct list_head* tmp;
-        struct task_struct* zombie;
-
-        list_for_each_safe(pos, tmp, &task_lists) {
-            // Find the zombie task
-            zombie = list_entry(pos, struct task_struct, task);
-            
-            if (zombie->state == TASK_ZOMBIE) {
-                muart_puts("Cleaning up zombie thread ");
-                muart_send_dec(zombie->pid);
-                muart_puts("\r\n");
-                
-                // Free the resoures : free the zombie task's stack
-                if (zombie->kernel_stack) {
-                    dfree(zombie->kernel_stack);
-                }
+        // Reap the zombies nobody will wait for (orphans and kernel threads)
+        // The cost is proportional to the number of exits, the task list is never scanned
+        while (!list_empty(&zombie_list)) {
+            struct task_struct* zombie = list_first_entry(&zombie_list, struct task_struct, list);
+            list_del(&zombie->list);
 
-                if (zombie->user_stack) {
-                    dfree(zombie->user_stack);
-                }
+            muart_puts("Cleaning up zombie thread ");
+            muart_send_dec(zombie->pid);
+            muart_puts("\r\n");
 
-                // Free the zombie task's user program memory
-                if (zombie->user_program) {
-                    muart_puts("  Freeing user program (size: ");
-                    muart_send_dec(zombie->user_program_size);
-                    muart_puts(" bytes)\r\n");
-                    dfree(zombie->user_program);
-                    zombie->user_program = NULL;
-                    zombie->user_program_size = 0;
-                }
-                
-                // Free the zombie task's pid
-                pid_free(zombie->pid);
-
-                // Mark the state of dead
-                zombie->state = TASK_DEAD;
-                
-                // Remove from task list 
-                list_del(&zombie->task);
-                
-                // Cleanup VFS resources for the zombie task
-                vfs_cleanup_task(zombie);  
-
-                // Free the zombie itself
-                dfree(zombie);
-            }
+            release_task(zombie);
         }
        
         // Yield the CPU, pick the next thread to run
@@ -299,10 +460,15 @@ static void create_idle_task(){
     idle_task->pid = 0;
     idle_task->parent = NULL;
     idle_task->state = TASK_RUNNING;
+    idle_task->exit_code = 0;
+    INIT_LIST_HEAD(&idle_task->children);
+    INIT_LIST_HEAD(&idle_task->sibling);
+    init_waitqueue_head(&idle_task->wait_chldexit);
     
     // Initialize user program fields for idle task (not used, but for consistency)
     idle_task->user_program = NULL;
     idle_task->user_program_size = 0;
+    signal_init(idle_task);
 
     // Set the cpu context of idle task
     idle_task->cpu_context.sp = (unsigned long)((char*)idle_task->kernel_stack + THREAD_STACK_SIZE);          // Set the stack pointer point to the top of the task's kernel stack
@@ -325,6 +491,9 @@ void sched_init(){
     // Initialize runqueue
     INIT_LIST_HEAD(&rq);
 
+    // Initialize the list of zombies to be reaped by the idle task
+    INIT_LIST_HEAD(&zombie_list);
+
     // Initialize bitmap of PID management
     pid_bitmap_init();
 
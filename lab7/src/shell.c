@@ -9,6 +9,7 @@
 #include "types.h"
 #include "timer.h"
 #include "async_uart.h"
+#include "irq.h"
 
 // Declaration of command
 static int cmd_help(int argc, char* argv[]);
@@ -21,6 +22,7 @@ static int cmd_memAlloc(int argc, char* argv[]);
 static int cmd_exec_prog(int argc, char* argv[]);
 static int cmd_async_uart(int argc, char* argv[]);
 static int cmd_set_timeout(int argc, char* argv[]);
+static int cmd_irqstat(int argc, char* argv[]);
 
 // Define a command table
 static const cmd_t cmdTable[] = {
@@ -37,6 +39,7 @@ static const cmd_t cmdTable[] = {
     {"exec", "\t\t: execute a user program at EL0\r\n\t\t  Usage: exec <filename>\r\n", cmd_exec_prog},
     {"auart", "\t\t: Example of using async UART for reading/writing data\r\n", cmd_async_uart},
     {"setTimeout", "\t: set a timeout to display a message\r\n\t\t  Usage: setTimeout \"MESSAGE\" SECONDS\r\n", cmd_set_timeout},
+    {"irqstat", "\t: show the count and handler time of every IRQ\r\n", cmd_irqstat},
     {NULL, NULL, NULL}
 };
 
@@ -169,6 +172,11 @@ int cmd_set_timeout(int argc, char* argv[]){
     return 0;
 }
 
+static int cmd_irqstat(int argc, char* argv[]){
+    irq_show_stats();
+    return 0;
+}
+
 void parse_args(char* cmd_line, int* argc, char* argv[], int max_args){
     *argc = 0;
     
@@ -0,0 +1,159 @@
+#include "signal.h"
+#include "sched.h"
+#include "exception.h"
+#include "mm.h"
+#include "muart.h"
+
+#define LOG_SIGNAL 0
+
+/* Signals that can't be caught, blocked or ignored */
+#define SIG_UNBLOCKABLE     sigmask(SIGKILL)
+
+/* Signals whose default action is to ignore them, the default action of the others is to terminate the task */
+#define SIG_DFL_IGNORE      sigmask(SIGCHLD)
+
+/* Condition flags of SPSR_EL1, M[3:0] = 0 is EL0t and DAIF = 0 unmasks every exception */
+#define SPSR_NZCV           0xF0000000UL
+
+/* Mark the signal pending on the task and wake it up if it's waiting, return 0 on success, -1 on failure */
+int send_signal(struct task_struct* task, int sig) {
+    if (!task || sig <= 0 || sig >= NSIG || task->state == TASK_ZOMBIE || task->state == TASK_DEAD) {
+        return -1;
+    }
+
+    task->sig_pending |= sigmask(sig);
+
+    // A sleeping task is woken up so that the signal is delivered without waiting for the event it sleeps on
+    if (task->state == TASK_WAITING && (sigmask(sig) & ~task->sig_blocked)) {
+        wake_up_process(task);
+    }
+
+    #if LOG_SIGNAL
+    muart_puts("[signal] Send signal ");
+    muart_send_dec(sig);
+    muart_puts(" to pid ");
+    muart_send_dec(task->pid);
+    muart_puts("\r\n");
+    #endif
+    return 0;
+}
+
+/* Check if the task has any pending signal which is not blocked */
+int signal_pending(struct task_struct* task) {
+    return (task->sig_pending & ~task->sig_blocked) != 0;
+}
+
+/* Push a signal frame on the user stack and make the task return to the handler */
+static void setup_frame(struct task_struct* current, struct trap_frame* tf, int sig, sighandler_t handler) {
+    // The frame is below the interrupted stack pointer, 16-byte aligned as required by AAPCS64
+    unsigned long sp = (tf->sp_el0 - sizeof(struct sigframe)) & ~0xFUL;
+    struct sigframe* frame = (struct sigframe*)sp;
+
+    memcpy(&frame->tf, tf, sizeof(struct trap_frame));
+    frame->blocked = current->sig_blocked;
+
+    // The same signal is blocked while its handler runs
+    current->sig_blocked |= sigmask(sig) & ~SIG_UNBLOCKABLE;
+
+    tf->regs[0] = sig;                                      // Argument of the handler
+    tf->regs[30] = (unsigned long)sigreturn_trampoline;     // The handler returns to the trampoline
+    tf->sp_el0 = sp;
+    tf->elr_el1 = (unsigned long)handler;
+}
+
+/* Deliver the pending signals of the current task before returning to user space (called right before kernel_exit 0) */
+void do_signal(struct trap_frame* tf) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    // Fast path : nothing to deliver
+    unsigned long pending = current->sig_pending & ~current->sig_blocked;
+    while (pending) {
+        int sig = __builtin_ctzl(pending);
+        current->sig_pending &= ~sigmask(sig);
+        pending &= ~sigmask(sig);
+
+        sighandler_t handler = current->sig_handlers[sig];
+        if (handler == SIG_IGN) {
+            continue;
+        }
+        if (handler == SIG_DFL) {
+            if (SIG_DFL_IGNORE & sigmask(sig)) {
+                continue;
+            }
+            #if LOG_SIGNAL
+            muart_puts("[signal] pid ");
+            muart_send_dec(current->pid);
+            muart_puts(" terminated by signal ");
+            muart_send_dec(sig);
+            muart_puts("\r\n");
+            #endif
+            current->exit_code = sig;
+            thread_exit();
+        }
+
+        // Run one handler at a time, the other pending signals are delivered when it returns through sigreturn()
+        setup_frame(current, tf, sig, handler);
+        return;
+    }
+}
+
+/* Reset the handlers to default and forget pending signals (new task / exec) */
+void signal_init(struct task_struct* task) {
+    task->sig_pending = 0;
+    task->sig_blocked = 0;
+    for (int i = 0; i < NSIG; i++) {
+        task->sig_handlers[i] = SIG_DFL;
+    }
+}
+
+/* Register a handler, return the previous handler or SIG_DFL on failure */
+sighandler_t do_sigaction(int sig, sighandler_t handler) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    if (sig <= 0 || sig >= NSIG || (sigmask(sig) & SIG_UNBLOCKABLE)) {
+        return SIG_DFL;
+    }
+
+    sighandler_t old = current->sig_handlers[sig];
+    current->sig_handlers[sig] = handler;
+    return old;
+}
+
+/* Change the blocked signals of the current task, return the previous mask */
+unsigned long do_sigprocmask(int how, unsigned long set) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    unsigned long old = current->sig_blocked;
+
+    switch (how) {
+        case SIG_BLOCK:
+            current->sig_blocked |= set;
+            break;
+        case SIG_UNBLOCK:
+            current->sig_blocked &= ~set;
+            break;
+        case SIG_SETMASK:
+            current->sig_blocked = set;
+            break;
+        default:
+            break;
+    }
+    current->sig_blocked &= ~(SIG_UNBLOCKABLE | 1UL);   // Bit 0 is not a signal
+    return old;
+}
+
+/* Restore the user context saved by do_signal(), return the restored x0 */
+unsigned long do_sigreturn(struct trap_frame* tf) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+
+    // The handler has returned, sp_el0 is back at the frame
+    struct sigframe* frame = (struct sigframe*)tf->sp_el0;
+
+    memcpy(tf, &frame->tf, sizeof(struct trap_frame));
+    current->sig_blocked = frame->blocked & ~SIG_UNBLOCKABLE;
+
+    // The frame on the user stack can't be trusted : return to EL0t with DAIF clear, only the user's NZCV flags are kept
+    tf->spsr_el1 &= SPSR_NZCV;
+
+    // syscall_handler() stores the return value into x0, so return the interrupted x0
+    return tf->regs[0];
+}
@@ -13,6 +13,9 @@
 #include "registers.h"
 #include "utils.h"
 #include "vfs.h"
+#include "pipe.h"
+#include "console.h"
+#include "chardev.h"
 
 #define LOG_SYSCALL 0
 
@@ -39,7 +42,7 @@ void syscall_handler(struct trap_frame* tf) {
             ret = sys_fork();
             break;
         case SYS_EXIT:
-            sys_exit();
+            sys_exit((int)tf->regs[0]);
             break;
         case SYS_MBOX_CALL:
             ret = sys_mbox_call((unsigned char)tf->regs[0], (unsigned int*)tf->regs[1]);
@@ -47,6 +50,15 @@ void syscall_handler(struct trap_frame* tf) {
         case SYS_KILL:
             sys_kill((int)tf->regs[0]);
             break;
+        case SYS_SIGNAL:
+            ret = (unsigned long)sys_signal((int)tf->regs[0], (sighandler_t)tf->regs[1]);
+            break;
+        case SYS_SIGKILL:
+            ret = sys_sigkill((int)tf->regs[0], (int)tf->regs[1]);
+            break;
+        case SYS_SIGRETURN:
+            ret = sys_sigreturn(tf);
+            break;
         case SYS_OPEN:
             ret = open((const char*)tf->regs[0], (int)tf->regs[1]);
             break;
@@ -69,6 +81,15 @@ void syscall_handler(struct trap_frame* tf) {
         case SYS_CHDIR:
             ret = chdir((const char*)tf->regs[0]);
             break;
+        case SYS_PIPE:
+            ret = pipe((int*)tf->regs[0]);
+            break;
+        case SYS_SIGPROCMASK:
+            ret = sys_sigprocmask((int)tf->regs[0], tf->regs[1]);
+            break;
+        case SYS_WAITPID:
+            ret = sys_waitpid((int)tf->regs[0], (int*)tf->regs[1], (int)tf->regs[2]);
+            break;
         default:
             muart_puts("Unknown system call\r\n");
             break;
@@ -84,18 +105,14 @@ int sys_getpid(void) {
     return current->pid;
 }
 
+/* Read from the RX buffer of the console UART, the task sleeps until at least one byte is received */
 size_t sys_uartread(char buf[], size_t size) {
-    for(size_t i = 0; i < size; i++) {
-        buf[i] = muart_receive();
-    }
-    return size;
+    return console_device()->read_wait(buf, size);
 }
 
+/* Write into the TX buffer of the console UART, the task sleeps while the buffer is full */
 size_t sys_uartwrite(const char buf[], size_t size) {
-    for(size_t i = 0; i < size; i++) {
-        muart_send(buf[i]);
-    }
-    return size;
+    return console_device()->write_wait(buf, size);
 }
 
 /*
@@ -243,6 +260,13 @@ int sys_exec(const char* name, char *const argv[]) {
     // Reset user context
     memzero((unsigned long)regs, sizeof(*regs));
     
+    // Handlers of the old program don't exist in the new one
+    for (int i = 0; i < NSIG; i++) {
+        if (current->sig_handlers[i] != SIG_IGN) {
+            current->sig_handlers[i] = SIG_DFL;
+        }
+    }
+
     // Set new program entry point
     regs->elr_el1 = (unsigned long)current->user_program;
     regs->sp_el0 = (unsigned long)current->user_stack + THREAD_STACK_SIZE;
@@ -273,7 +297,7 @@ int sys_fork() {
         return -1;
     }
 
-    child->pid = pid_alloc();
+    child->pid = pid_alloc(child);
     if (child->pid < 0) {
         dfree(child);
         muart_puts("fork: Failed to allocate PID\r\n");
@@ -310,6 +334,24 @@ int sys_fork() {
 
     child->parent = parent;
     child->state = TASK_RUNNING;
+    child->exit_code = 0;
+    INIT_LIST_HEAD(&child->children);
+    list_add_tail(&child->sibling, &parent->children);
+    init_waitqueue_head(&child->wait_chldexit);
+
+    // The child inherits the working directory and shares the parent's open files (e.g. both ends of a pipe)
+    strcpy(child->cwd, parent->cwd);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        child->fd_table[i] = parent->fd_table[i];
+        if (child->fd_table[i]) {
+            child->fd_table[i]->f_count++;
+        }
+    }
+
+    // The child inherits the handlers and the blocked mask, but not the pending signals
+    memcpy(child->sig_handlers, parent->sig_handlers, sizeof(child->sig_handlers));
+    child->sig_blocked = parent->sig_blocked;
+    child->sig_pending = 0;
 
     /*
     // Calculate memory offsets
@@ -417,69 +459,72 @@ int sys_fork() {
     return child->pid;  // Return child's PID to the parent
 }
 
-void sys_exit() {
+void sys_exit(int status) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    current->exit_code = (status & 0xff) << 8;
     thread_exit();
 }
 
 int sys_mbox_call(unsigned int ch, unsigned int *mbox) {
-    disable_irq_in_el1();
-
-    unsigned long msg_addr = (unsigned long)mbox;
-    
-    // Combine the message address (upper 28 bits) with channel number (lower 4 bits)  
-    msg_addr = (msg_addr & ~0xF) | (ch & 0xF);
-    
-    // Check whether the Mailbox 0 status register’s full flag is set.
-    while( regRead(MAILBOX_STATUS) & MAILBOX_FULL ){
-        // Mailbox is Full: do nothing
-    }
-    // If not, then you can write the data to Mailbox 1 Read/Write register.
-    regWrite(MAILBOX_WRITE, msg_addr);
-    
-    while(1){
-        // Check whether the Mailbox 0 status register’s empty flag is set.
-        while( regRead(MAILBOX_STATUS) & MAILBOX_EMPTY ){
-            // Mailbox is Empty: do nothing
-        }
-        // If not, then you can read from Mailbox 0 Read/Write register.
-        unsigned int response = regRead(MAILBOX_READ);
-    
-        // Check if the value is the same as you wrote in step 1.
-        if((response & 0xF) == ch){
-            return;     // 這邊不要亂加 return 0，加了會狂跳 exception，原因 I don't know ==
-        }
+    // The caller sleeps until the mailbox interrupt brings the answer, the other tasks keep running
+    if (mailbox_call(ch, mbox) != 0) {
+        return 0;
     }
-    enable_irq_in_el1();
-    return 0;
+
+    // 1 if the firmware handled every tag of the request
+    return mbox[1] == REQUEST_SUCCEED;
 }
 
 void sys_kill(int pid) {
     disable_irq_in_el1();
-    struct list_head* pos;
-    struct list_head* n;
-    struct task_struct* task;
-    
-    list_for_each_safe(pos, n, &task_lists) {
-        task = list_entry(pos, struct task_struct, task);
-        if (task->pid == pid) {
-            muart_puts("Killing task PID: ");
-            muart_send_dec(pid);
-            muart_puts("\r\n");
-            
-            task->state = TASK_ZOMBIE;
-            
-            if (!list_empty(&task->list)) {
-                list_del(&task->list);
-            }
-            
-            if (task == get_current_thread()) {
-                schedule();
-            }
+    struct task_struct* task = find_task_by_pid(pid);
     
-            enable_irq_in_el1();
-            return;
+    if (task) {
+        muart_puts("Killing task PID: ");
+        muart_send_dec(pid);
+        muart_puts("\r\n");
+        
+        // Become a zombie as if it was killed by SIGKILL, the parent is notified
+        exit_task(task, SIGKILL);
+        
+        if (task == (struct task_struct*)get_current_thread()) {
+            schedule();
         }
     }
+
+    enable_irq_in_el1();
+}
+
+// syscall number : 8
+// Register a user handler (or SIG_DFL / SIG_IGN) for the signal, return the previous one
+sighandler_t sys_signal(int sig, sighandler_t handler) {
+    return do_sigaction(sig, handler);
+}
+
+// syscall number : 9
+// Send the signal to the task of pid, it is delivered the next time the task returns to user space
+int sys_sigkill(int pid, int sig) {
+    disable_irq_in_el1();
+    int ret = send_signal(find_task_by_pid(pid), sig);
+    enable_irq_in_el1();
+    return ret;
+}
+
+// syscall number : 10
+// Called by sigreturn_trampoline when a handler returns
+unsigned long sys_sigreturn(struct trap_frame* tf) {
+    return do_sigreturn(tf);
+}
+
+// syscall number : 19
+unsigned long sys_sigprocmask(int how, unsigned long set) {
+    return do_sigprocmask(how, set);
+}
+
+// syscall number : 20
+// pid -1 waits for any child, status gets the child's exit code
+int sys_waitpid(int pid, int* status, int options) {
+    return do_waitpid(pid, status, options);
 }
 
 // syscall number : 11
@@ -589,3 +634,40 @@ int chdir(const char *path) {
     #endif
     return 0;
 }
+
+// syscall number : 18
+// pipefd[0] is the read end, pipefd[1] is the write end
+int pipe(int pipefd[2]) {
+    struct task_struct* current = (struct task_struct*)get_current_thread();
+    struct file* files[2];
+
+    // Reserve two file descriptors before creating the pipe
+    int rfd = allocate_fd(current);
+    if (rfd < 0) {
+        return VFS_EMFILE;
+    }
+    current->fd_table[rfd] = (struct file*)1;   // Placeholder so that allocate_fd won't return it again
+    int wfd = allocate_fd(current);
+    current->fd_table[rfd] = NULL;
+    if (wfd < 0) {
+        return VFS_EMFILE;
+    }
+
+    int ret = pipe_create(files);
+    if (ret != VFS_OK) {
+        return ret;
+    }
+
+    current->fd_table[rfd] = files[0];
+    current->fd_table[wfd] = files[1];
+    pipefd[0] = rfd;
+    pipefd[1] = wfd;
+    #if LOG_SYSCALL
+        muart_puts("[sys_pipe] Created pipe, read fd ");
+        muart_send_dec(rfd);
+        muart_puts(", write fd ");
+        muart_send_dec(wfd);
+        muart_puts("\r\n");
+    #endif
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include "malloc.h"
 #include "sched.h"
 #include "list.h"
+#include "irq.h"
+#include "driver.h"
 
 static timer_t* timer_list = NULL;
 
@@ -62,7 +64,8 @@ void timer_irq_handler(void){
         timer_basic_irq_handler();
     }
 
-    schedule();
+    // Don't switch threads inside the handler, its time would include them (see irq_show_stats)
+    need_resched = 1;
 }
 
 
@@ -222,3 +225,32 @@ int setTimeout(const char* message, unsigned int seconds){
     enable_core_timer_int();
     return 0;
 }
+
+
+/* --- Driver of the ARM generic timer --- */
+static void timer_irq_entry(void* data){
+    timer_irq_handler();
+}
+
+static int arm_timer_probe(struct device* dev){
+    // The interrupts are <secure phys, non-secure phys, hyp, virt>, the scheduler tick is the non-secure physical timer
+    int irq = dev->node ? device_get_irq(dev, 1) : dev->irq;
+
+    // enable_core_timer_int() only knows CNTPNSIRQ of core 0
+    if (irq != IRQ_LOCAL(LOCAL_IRQ_CNTPNS)){
+        muart_puts("Error: unsupported IRQ of the ARM timer\r\n");
+        return -1;
+    }
+    return request_irq(irq, timer_irq_entry, 0, "timer", NULL);
+}
+
+static const char* const arm_timer_compatible[] = { "arm,armv7-timer", "arm,armv8-timer", NULL };
+
+struct driver arm_timer_driver = {
+    .name = "arm_timer",
+    .compatible = arm_timer_compatible,
+    .probe = arm_timer_probe,
+    .default_base = 0,
+    .default_size = 0,
+    .default_irq = IRQ_LOCAL(LOCAL_IRQ_CNTPNS),
+};
@@ -149,7 +149,11 @@ int vfs_open(const char* pathname, int flags, struct file** target) {
     }
     
     // Open the file's vnode
-    return vnode->f_ops->open(vnode, target, flags);
+    ret = vnode->f_ops->open(vnode, target, flags);
+    if (ret == VFS_OK) {
+        (*target)->f_count = 1;
+    }
+    return ret;
 }
 
 /* Close and release the file handle */
@@ -161,6 +165,11 @@ int vfs_close(struct file* file) {
         muart_puts("[vfs_close] Closing file\r\n");
     #endif
 
+    // The handle is still referred by other file descriptors (e.g. inherited by fork)
+    if (--file->f_count > 0) {
+        return VFS_OK;
+    }
+
     return file->f_ops->close(file);
 }
 /* Call the corresponding read method to read the file starting from f_pos, then updates f_pos after read. (or not if it’s a special file) */